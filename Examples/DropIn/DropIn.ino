@@ -28,6 +28,10 @@
 *
 *		ATTENTION: There is a 10 second delay from powering up uStepper to accepting input - this is to avoid movement on control jitter when CNC/Printer board starts up !
 *
+*		For step rates too high for the step interrupt, stepper.enableHardwareStepCounter() counts the steps in
+*		Timer4 instead. The library must then be built with -DDROPINHARDWARESTEPCOUNTER=1, and Step must also be
+*		wired to PE1 (T4) of the uStepper S.
+*
 */
 /********************************************************************************************
 * 	    	File:  LimitDetection.ino                                                         *
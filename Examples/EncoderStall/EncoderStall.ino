@@ -53,12 +53,11 @@ void setup() {
   stepper.checkOrientation(30.0);       //Check orientation of motor connector with +/- 30 microsteps movement
   Serial.begin(9600);
   stepper.setRPM(100);
-  stepper.encoder.encoderStallDetectSensitivity = -0.25;//Encoder stalldetect sensitivity - From -10 to 1 where lower number is less sensitive and higher is more sensitive. -0.25 works for most.
-  stepper.encoder.encoderStallDetectEnable = 1; //Enable the encoder stall detect
+  stepper.enableEncoderStallDetect(0.25);//Enable the encoder stall detect. A stall is an encoder speed deviating more than 25% from the driver speed. 0.25 works for most.
 }
 
 void loop() {
-  bool stall = stepper.encoder.encoderStallDetect;//Read the stall decision
+  bool stall = stepper.isEncoderStalled();//Read the stall decision
   Serial.println(stall);// Print out the result - 1 = stall detected
   if(stall)// Look for stall
     {
@@ -53,7 +53,7 @@ void setup() {
   stepper.setup();
   stepper.checkOrientation(30.0);       //Check orientation of motor connector with +/- 30 microsteps movement
   Serial.begin(9600);
-  stepper.encoder.encoderStallDetectEnable = 1; //Enable the encoder stall detect
+  stepper.enableEncoderStallDetect(); //Enable the encoder stall detect
 }
 
 void loop() {
@@ -66,12 +66,12 @@ void loop() {
     delay(1000);
     for(uint8_t stallValue = 0; stallValue<220;stallValue++)
     {
-      stepper.encoder.encoderStallDetectSensitivity = 1-(stallValue*0.05);
+      stepper.enableEncoderStallDetect(stallValue*0.01);
       delay(100);
-      if(!stepper.encoder.encoderStallDetect)
+      if(!stepper.isEncoderStalled())
       {
-        Serial.print("Sensitivity must be less than: ");
-        Serial.println(1-(stallValue*0.05));
+        Serial.print("Tolerance must be more than: ");
+        Serial.println(stallValue*0.01);
         stallValue=220;
       }
     }
@@ -0,0 +1,68 @@
+/********************************************************************************************
+* 	    	File:  JerkLimited.ino                                                            *
+*		    Version:    2.3.0                                          						    *
+*      	Date: 		December 27th, 2021  	                                    			*
+*       Author:  Thomas Hørring Olsen                                                       *
+*  Description:  Jerk Limited Example Sketch!                                               *
+*                                                                                           *
+* This example demonstrates S-shaped velocity profiles. The motor moves back and forth,     *
+* alternating between a trapezoidal profile and a jerk limited profile with the same        *
+* velocity and acceleration. The jerk limited moves take a little longer, but start and     *
+* stop much more smoothly. jerk_model.py in this folder simulates both profiles on a PC.    *
+*                                                                                           *
+* For more information, check out the documentation:                                        * 
+*                http://ustepper.com/docs/usteppers/html/index.html                         *
+*                                                                                           *
+*********************************************************************************************
+*	(C) 2020                                                                                  *
+*                                                                                           *
+*	uStepper ApS                                                                              *
+*	www.ustepper.com                                                                          *
+*	administration@ustepper.com                                                               *
+*                                                                                           *
+*	The code contained in this file is released under the following open source license:      *
+*                                                                                           *
+*			Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International               *
+*                                                                                           *
+* 	The code in this file is provided without warranty of any kind - use at own risk!       *
+* 	neither uStepper ApS nor the author, can be held responsible for any damage             *
+* 	caused by the use of the code contained in this file !                                  *
+*                                                                                           *
+*                                                                                           *
+********************************************************************************************/
+
+#include <uStepperS.h>
+
+uStepperS stepper;
+float angle = 1800.0;     //amount of degrees to move
+bool jerkLimited = 0;
+uint32_t startTime;
+
+void setup() {
+  // put your setup code here, to run once:
+  stepper.setup();        //Initialisation of the uStepper S
+  stepper.setMaxAcceleration(2000);     //use an acceleration of 2000 fullsteps/s^2
+  stepper.setMaxVelocity(200);          //Max velocity of 200 fullsteps/s
+  stepper.checkOrientation(30.0);       //Check orientation of motor connector with +/- 30 microsteps movement
+  Serial.begin(9600);
+}
+
+void loop() {
+  // put your main code here, to run repeatedly:
+  if(!stepper.getMotorState())          //If motor is at standstill
+  {
+    if(startTime)
+    {
+      Serial.print(jerkLimited ? "Jerk limited move: " : "Trapezoidal move: ");
+      Serial.print(millis() - startTime);
+      Serial.println(" ms");
+    }
+
+    delay(1000);
+    jerkLimited = !jerkLimited;
+    stepper.setMaxJerk(jerkLimited ? 40000.0 : 0.0);   //40000 fullsteps/s^3, or no jerk limit
+    startTime = millis();
+    stepper.moveAngle(angle);           //start new movement
+    angle = -angle;                     //invert angle variable, so the next move is in opposite direction
+  }
+}
@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+"""Host side reference model of the jerk limited ramp of the uStepper S library.
+
+Simulates the TMC5130 ramp generator (positioning and velocity mode, V1 = 0) together
+with the shaping done by uStepperS::jerkUpdate() each control tick, using the same
+integer arithmetic as the firmware. Prints peak acceleration, peak jerk, move time and
+overshoot with and without the jerk limit. Exits with status 1 if the jerk limited ramp
+exceeds the limit by more than JERKTOLERANCE, overshoots, or misses the target.
+
+    python3 jerk_model.py [steps/s] [steps/s^2] [steps/s^3] [microsteps to move]
+"""
+import sys
+
+CLOCKFREQ = 16000000
+CONTROLFREQ = 1000
+ICR1 = CLOCKFREQ // CONTROLFREQ
+SUBSTEPS = 250                      # ramp generator updates per control tick
+CLOCKS = ICR1 // SUBSTEPS
+VSTOP = 10
+MICROSTEPS = 256
+VELOCITYCONVERSION = 1.0 / 0.953674316
+ACCELERATIONCONVERSION = 1.0 / 116.415321827
+MOTIONBLENDTICKS = 2
+JERKMINVELOCITY = 1000
+# VACTUAL is an integer set once per control tick, so the jerk can only be held to one VACTUAL
+# unit per tick squared, in steps/s^3
+JERKTOLERANCE = CLOCKFREQ / 16777216.0 * CONTROLFREQ * CONTROLFREQ / MICROSTEPS
+
+
+def fixMul(a, b, shift):
+    # Arithmetic shift, as the firmware does on int64_t
+    return (a * b) >> shift
+
+
+class Driver:
+    """TMC5130 ramp generator with V1 = 0, so only AMAX, DMAX and VMAX are used"""
+
+    def __init__(self, amax, dmax, vmax):
+        self.AMAX = amax                # values set by the library
+        self.DMAX = dmax
+        self.VMAX = vmax
+        self.amaxReg = amax             # values in the driver
+        self.dmaxReg = dmax
+        self.vmaxReg = vmax
+        self.x = 0.0
+        self.v = 0.0
+        self.xTarget = 0
+        self.velocityMode = False
+
+    def run(self):
+        for _ in range(SUBSTEPS):
+            dvA = self.amaxReg * CLOCKS / 131072.0
+            dvD = self.dmaxReg * CLOCKS / 131072.0
+            if self.velocityMode:
+                if abs(self.v - self.vmaxReg) < 1.0 and self.amaxReg == 0:
+                    # VACTUAL is an integer, so this reads as the target speed. Only snapped
+                    # when the shaping has stopped, so the last tick of the ramp is not skewed
+                    self.v = float(self.vmaxReg)
+                elif self.v < self.vmaxReg:
+                    self.v = min(self.v + dvA, self.vmaxReg)
+                elif self.v > self.vmaxReg:
+                    self.v = max(self.v - dvA, self.vmaxReg)
+            else:
+                remaining = self.xTarget - self.x
+                direction = 1 if remaining >= 0 else -1
+                speed = self.v * direction
+                brake = speed * speed / (256.0 * self.dmaxReg) if speed > 0 else 0.0
+                if abs(remaining) < 1.0 and abs(self.v) <= VSTOP * 2:
+                    self.v = 0.0
+                    self.x = float(self.xTarget)
+                    continue
+                if speed < 0:
+                    speed = min(speed + dvD, 0.0)
+                elif abs(remaining) <= brake:
+                    speed = max(speed - dvD, VSTOP)
+                elif speed < self.vmaxReg:
+                    speed = min(speed + dvA, self.vmaxReg)
+                elif speed > self.vmaxReg:
+                    speed = max(speed - dvD, self.vmaxReg)
+                self.v = speed * direction
+            travel = self.v * CLOCKS / 16777216.0
+            if not self.velocityMode and self.v != 0 and abs(travel) > abs(self.xTarget - self.x):
+                travel = self.xTarget - self.x
+            self.x += travel
+
+
+class Jerk:
+    """Mirror of uStepperS::jerkShape(), brakingDistance() and jerkUpdate()"""
+
+    def __init__(self, driver, jerkStep):
+        self.driver = driver
+        self.jerkStep = jerkStep
+        self.jerkTaperGain = int(17179869184.0 * CONTROLFREQ / CLOCKFREQ)
+        self.jerkAccel = 0
+        self.jerkDecel = 0
+        self.jerkRising = False
+        self.jerkDecelerating = False
+        self.jerkTarget = 0
+
+    def shape(self, accel, limit, speedChange):
+        threshold = (self.jerkStep * speedChange * self.jerkTaperGain) >> 16
+        if accel > limit + self.jerkStep:
+            step = accel - self.jerkStep
+        else:
+            step = min(accel + self.jerkStep, limit)
+        if step * (step + self.jerkStep) > threshold:
+            step = accel
+            if accel * (accel + self.jerkStep) > threshold:
+                step = accel - self.jerkStep if accel > 2 * self.jerkStep else self.jerkStep
+        # Speed change of one jerk step within a tick, in VACTUAL units
+        stepChange = fixMul(self.jerkStep, ICR1, 17)
+        if fixMul(step, ICR1, 17) >= speedChange > stepChange:
+            # The ramp would reach the target within this tick, and the acceleration would drop
+            # to zero by more than the limit at the next. Leave one jerk step for that tick
+            step = ((speedChange - stepChange) << 17) // ICR1
+        return step
+
+    def stopDeceleration(self, speed, distance):
+        square = ((speed >> 8) + 1) * ((speed >> 8) + 1)
+        if square < (1 << 24):
+            return (square << 8) // distance + 1
+        return (square // distance + 1) << 8
+
+    def brakingDistance(self, speed):
+        d = self.driver
+        square = ((speed >> 8) + 1) * ((speed >> 8) + 1)
+        if square < (1 << 24):
+            distance = (square << 8) // d.DMAX
+        else:
+            distance = (square // d.DMAX) << 8
+        if self.jerkStep:
+            ticks = (d.DMAX << 15) // self.jerkStep
+            distance += fixMul(fixMul(speed, ICR1, 24), ticks, 16)
+            # The shaped deceleration has no DMAX to spare for catching up, so start a bit early
+            distance += distance >> 4
+        distance += fixMul(speed, ICR1 * MOTIONBLENDTICKS, 24)
+        return distance
+
+    def update(self, position, velocity):
+        d = self.driver
+        speed = abs(velocity)
+        if d.velocityMode:
+            target = d.VMAX
+            change = velocity - target if velocity >= 0 and velocity > target else target - velocity
+            if change == 0 or (velocity < target) != self.jerkRising:
+                # The speed is at its target, or the acceleration changes sign. AMAX is
+                # only a magnitude, so the shaped acceleration starts over from zero
+                self.jerkRising = velocity < target
+                self.jerkAccel = 0
+            self.jerkAccel = self.shape(self.jerkAccel, d.AMAX, change)
+            d.amaxReg = self.jerkAccel
+            return
+        remaining = d.xTarget - position
+        if d.xTarget != self.jerkTarget:
+            self.jerkTarget = d.xTarget
+            self.jerkDecelerating = False
+        if not self.jerkDecelerating:
+            if speed == 0 or (velocity > 0) != (remaining > 0) or abs(remaining) > self.brakingDistance(speed):
+                change = speed - d.VMAX if speed > d.VMAX else d.VMAX - speed
+                if speed == 0 or change == 0:
+                    # Standing still or cruising, so the acceleration starts over from zero
+                    self.jerkAccel = 0
+                if speed < d.VMAX and (velocity > 0) == (remaining > 0):
+                    # Ramping the acceleration down adds accel^2 / (2 * jerk) to the speed. Do
+                    # that in time on short moves, so the deceleration starts from zero
+                    ticks = (self.jerkAccel << 8) // self.jerkStep
+                    peak = speed + fixMul(fixMul(self.jerkAccel + self.jerkStep, ticks, 8), ICR1, 18)
+                    if abs(remaining) <= self.brakingDistance(peak) + fixMul(fixMul(peak, ICR1, 24), ticks, 8):
+                        change = 0
+                self.jerkAccel = self.shape(self.jerkAccel, d.AMAX, change)
+                d.amaxReg = self.jerkAccel
+                d.dmaxReg = d.DMAX
+                d.vmaxReg = d.VMAX
+                return
+            self.jerkDecelerating = True
+            self.jerkDecel = 0
+        if remaining == 0 or (velocity > 0) != (remaining > 0) or speed <= JERKMINVELOCITY:
+            return
+        # Deceleration needed to stop at the target from the position at the next tick
+        distance = abs(remaining) - fixMul(speed, ICR1, 24)
+        if distance <= 0:
+            return
+        required = self.stopDeceleration(speed, distance)
+        required = min(required + (required >> 3), 0xFFFE)
+        if self.jerkAccel:
+            # Finish ramping the acceleration down before slowing down
+            self.jerkAccel = self.jerkAccel - self.jerkStep if self.jerkAccel > self.jerkStep else 0
+            d.amaxReg = self.jerkAccel
+            d.dmaxReg = required
+            return
+        # Ramping the deceleration to zero at the end takes decel^3 / (24 * jerk^2) further
+        ticks = min(self.jerkDecel // self.jerkStep, 1023)
+        tail = fixMul(self.jerkDecel * ticks, ICR1 * ICR1 // 256, 33) * ticks // 24
+        if distance > tail:
+            target = self.stopDeceleration(speed, distance - tail)
+        else:
+            target = d.DMAX
+        # Only ramp the deceleration down when that does not fall behind the target
+        self.jerkDecel = self.shape(self.jerkDecel, min(max(target, self.jerkStep), d.DMAX), speed if target <= self.jerkDecel else 0xFFFFFFFF)
+        decel = max(required, self.jerkDecel)
+        target = speed - fixMul(self.jerkDecel, ICR1, 17)
+        if target < JERKMINVELOCITY:
+            target = JERKMINVELOCITY
+        d.dmaxReg = decel
+        d.vmaxReg = target
+
+
+def simulate(velocity, acceleration, jerk, steps, velocityMode):
+    vmax = int(min(velocity * MICROSTEPS * VELOCITYCONVERSION, 0x7FFE00))
+    amax = int(min(acceleration * MICROSTEPS * ACCELERATIONCONVERSION, 0xFFFE))
+    jerkStep = int(min(max(jerk * MICROSTEPS * ACCELERATIONCONVERSION / CONTROLFREQ, 1), 0xFFFE)) if jerk else 0
+    d = Driver(amax, amax, vmax)
+    d.velocityMode = velocityMode
+    d.xTarget = steps
+    shaper = Jerk(d, jerkStep) if jerkStep else None
+
+    speeds = []
+    overshoot = 0.0
+    for tick in range(60 * CONTROLFREQ):
+        if velocityMode and tick == 3 * CONTROLFREQ:
+            d.VMAX = 0                  # stop after 3 s
+        if velocityMode or not shaper:
+            d.vmaxReg = d.VMAX          # written by setRPM() / moveSteps()
+        if shaper:
+            shaper.update(int(d.x), int(d.v))
+        d.run()
+        speeds.append(d.v)
+        overshoot = max(overshoot, (d.x - steps) * (1 if steps > 0 else -1))
+        if not velocityMode and d.v == 0 and d.x == steps:
+            break
+        if velocityMode and tick > 3 * CONTROLFREQ and d.v == 0:
+            break
+
+    # Microsteps/s from VACTUAL, derivatives over one control tick
+    scale = CLOCKFREQ / 16777216.0 / MICROSTEPS
+    accel = [(b - a) * scale * CONTROLFREQ for a, b in zip(speeds, speeds[1:])]
+    jerks = [(b - a) * CONTROLFREQ for a, b in zip(accel, accel[1:])]
+    # The ramp generator completes a positioning move from below JERKMINVELOCITY on its own.
+    # Only that final stop is left out, the start from standstill is shaped
+    last = len(speeds)
+    if not velocityMode:
+        last = max([i for i, v in enumerate(speeds) if abs(v) > JERKMINVELOCITY] or [0])
+    cruise = jerks[:max(last - 1, 0)]
+    return {
+        'time': len(speeds) / float(CONTROLFREQ),
+        'accel': max(abs(a) for a in accel),
+        'jerk': max(abs(j) for j in jerks),
+        'shaped': max([abs(j) for j in cruise] or [0.0]),
+        'overshoot': overshoot,
+        'error': 0.0 if velocityMode else d.x - steps,
+    }
+
+
+def main():
+    velocity = float(sys.argv[1]) if len(sys.argv) > 1 else 200.0
+    acceleration = float(sys.argv[2]) if len(sys.argv) > 2 else 2000.0
+    jerk = float(sys.argv[3]) if len(sys.argv) > 3 else 40000.0
+    steps = int(sys.argv[4]) if len(sys.argv) > 4 else 10 * 200 * MICROSTEPS
+
+    failed = False
+    print('%.0f steps/s, %.0f steps/s^2, jerk limit %.0f steps/s^3' % (velocity, acceleration, jerk))
+    for name, velocityMode, move in (('positioning, %d microsteps' % steps, False, steps), ('velocity mode, 3 s', True, 0)):
+        print(name)
+        for label, j in (('  trapezoidal', 0.0), ('  jerk limited', jerk)):
+            r = simulate(velocity, acceleration, j, move, velocityMode)
+            print('%s: time %.3f s, peak acceleration %.0f steps/s^2, peak jerk %.0f (%.0f before the final stop) steps/s^3, overshoot %.1f, final error %.1f microsteps'
+                  % (label, r['time'], r['accel'], r['jerk'], r['shaped'], r['overshoot'], r['error']))
+            if j:
+                ok = r['shaped'] <= j + JERKTOLERANCE and r['overshoot'] < 1.0 and abs(r['error']) < 1.0
+                failed = failed or not ok
+                print('  %s: jerk limit %.0f + %.0f steps/s^3' % ('ok' if ok else 'FAIL', j, JERKTOLERANCE))
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,76 @@
+/********************************************************************************************
+* 	    	File:  StepInputBenchmark.ino                                                     *
+*		    Version:    2.3.0                                          						    *
+*      	Date: 		December 27th, 2021  	                                    			*
+*       Author:  Thomas Hørring Olsen                                                       *
+*  Description:  Step Input Benchmark Example Sketch!                                       *
+*                                                                                           *
+* This example checks how fast the DROPIN step input can be driven before step pulses are   *
+* missed. Step pulses are counted both by the step interrupt and by Timer4, and the result  *
+* is printed every second. Increase the step frequency of the controller until missed steps *
+* show up. step_input_model.py in this folder runs the same check against simulated pulse   *
+* trains on a PC.                                                                           *
+*                                                                                           *
+*	Pin connections:                                                                          *
+*	------------------------------                                                            *
+*	| Controller | uStepper S    |                                                            *
+*	|----------------------------|                                                            *
+*	|	Step       |	D2 and PE1   |                                                            *
+*	|	Dir        |		PB3	     |                                                            *
+*	|	GND        |		GND		     |                                                            *
+*	------------------------------                                                            *
+*                                                                                           *
+* For more information, check out the documentation:                                        * 
+*                http://ustepper.com/docs/usteppers/html/index.html                         *
+*                                                                                           *
+*********************************************************************************************
+*	(C) 2020                                                                                  *
+*                                                                                           *
+*	uStepper ApS                                                                              *
+*	www.ustepper.com                                                                          *
+*	administration@ustepper.com                                                               *
+*                                                                                           *
+*	The code contained in this file is released under the following open source license:      *
+*                                                                                           *
+*			Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International               *
+*                                                                                           *
+* 	The code in this file is provided without warranty of any kind - use at own risk!       *
+* 	neither uStepper ApS nor the author, can be held responsible for any damage             *
+* 	caused by the use of the code contained in this file !                                  *
+*                                                                                           *
+*                                                                                           *
+********************************************************************************************/
+
+#include <uStepperS.h>
+
+uStepperS stepper;
+stepInputCheck_t result;
+
+void setup() {
+  // put your setup code here, to run once:
+  stepper.setup(DROPIN, 200, 75, 7.0, 1.0);     //Dropin mode, 200 fullsteps per revolution, P = 75, I = 7, D = 1
+  Serial.begin(9600);
+  if(!stepper.enableStepInputCheck())
+  {
+    Serial.println("Step input check not available");
+  }
+}
+
+void loop() {
+  // put your main code here, to run repeatedly:
+  delay(1000);
+  stepper.getStepInputCheck(&result);
+  Serial.print("Timer edges: ");
+  Serial.print(result.timerEdges);
+  Serial.print(" ISR edges: ");
+  Serial.print(result.isrEdges);
+  Serial.print(" Missed: ");
+  Serial.print(result.missedSteps);
+  Serial.print(" Max frequency: ");
+  Serial.print(result.maxFrequency);
+  Serial.print(" steps/s Max backlog: ");
+  Serial.print(result.maxBacklog);
+  Serial.print(" Max ISR time: ");
+  Serial.print(result.maxServiceTime / 16.0);
+  Serial.println(" us");
+}
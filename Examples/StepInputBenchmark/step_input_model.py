@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Host side stand-in for the DROPIN step input check of the uStepper S library.
+
+Feeds a simulated step pulse train to a model of the ATmega328PB interrupt system: Timer4
+counts every falling edge, while the INT0 flag only holds one pending edge until interrupt0
+is entered. Interrupt0 can not be entered while it is running itself, or while the control
+interrupt has interrupts masked. Prints the same counts as uStepperS::getStepInputCheck(),
+plus the worst interrupt0 latency, and the highest constant step frequency without missed
+steps.
+
+The cycle counts below are estimates. The maxServiceTime reported by the firmware can be used
+to set ISRCYCLES for a given build.
+
+    python3 step_input_model.py [constant|ramp|burst] [steps/s] [seconds] [jitter, 0.0 - 1.0]
+"""
+import random
+import sys
+
+CLOCKFREQ = 16000000
+CONTROLFREQ = 1000
+ICR1 = CLOCKFREQ // CONTROLFREQ
+ISRCYCLES = 220                     # interrupt0 from vectoring to reti, incl. the attachInterrupt dispatch.
+                                    # About 95 with DROPINFASTSTEPISR
+RESPONSECYCLES = 7                  # interrupt response and vector jump
+TIMERREADCYCLES = 40                # interrupt0 entry until TCNT4 is read for the backlog
+# Windows with interrupts masked in each control period, (start, length) in cycles after the
+# compare match: entry until sei(), the DROPIN step count snapshot and the check snapshot
+MASKED = ((0, 90), (3200, 140))
+BURSTON = 0.005                     # burst train: seconds with pulses
+BURSTOFF = 0.005                    # burst train: seconds without pulses
+
+
+def masked(t):
+    """End of the masked window containing clock cycle t, or t if interrupts are enabled"""
+    phase = t % ICR1
+    for start, length in MASKED:
+        if start <= phase < start + length:
+            return t - phase + start + length
+    return t
+
+
+def pulseTrain(train, frequency, seconds, jitter, seed=1):
+    """Clock cycles of the falling STEP edges"""
+    rng = random.Random(seed)
+    edges = []
+    t = 0.0
+    end = seconds * CLOCKFREQ
+    cycle = (BURSTON + BURSTOFF) * CLOCKFREQ
+    while t < end:
+        if train == 'ramp':
+            f = max(frequency * t / end, 100.0)
+        else:
+            f = frequency
+        if train == 'burst' and t % cycle >= BURSTON * CLOCKFREQ:
+            t += cycle - t % cycle
+            continue
+        period = CLOCKFREQ / f
+        edges.append(int(t + rng.uniform(-jitter, jitter) * period * 0.5))
+        t += period
+    return sorted(set(e for e in edges if e >= 0))
+
+
+def simulate(edges):
+    timerEdges = len(edges)
+    isrEdges = 0
+    worstLatency = 0
+    maxBacklog = 0
+    busy = 0                        # first cycle interrupt0 can be entered again
+    perTick = {}
+    missedTicks = set()
+    i = 0
+    while i < len(edges):
+        # The edge sets the INT0 flag, interrupt0 is entered when interrupts are enabled
+        flagged = edges[i]
+        entry = max(flagged, busy)
+        while masked(entry) != entry:
+            entry = masked(entry)
+        entry += RESPONSECYCLES
+        # Edges until the flag is cleared by vectoring only set the flag again
+        j = i + 1
+        while j < len(edges) and edges[j] <= entry:
+            j += 1
+        if j - i > 1:
+            missedTicks.add(entry // ICR1)
+        isrEdges += 1
+        worstLatency = max(worstLatency, entry - flagged)
+        busy = entry + ISRCYCLES
+        # Timer4 is read at the start of interrupt0
+        k = j
+        while k < len(edges) and edges[k] <= entry + TIMERREADCYCLES:
+            k += 1
+        maxBacklog = max(maxBacklog, k - i - 1)
+        for e in edges[i:j]:
+            perTick[e // ICR1] = perTick.get(e // ICR1, 0) + 1
+        i = j
+
+    maxFrequency = max([n * CONTROLFREQ for tick, n in perTick.items() if tick not in missedTicks] or [0])
+    return {
+        'timerEdges': timerEdges,
+        'isrEdges': isrEdges,
+        'missed': timerEdges - isrEdges,
+        'maxFrequency': maxFrequency,
+        'maxBacklog': maxBacklog,
+        'latency': worstLatency,
+    }
+
+
+def highestFrequency(jitter):
+    """Bisect the highest constant step frequency without missed steps over 0.1 s"""
+    low, high = 1000.0, float(CLOCKFREQ) / RESPONSECYCLES
+    while high - low > 100.0:
+        f = (low + high) / 2
+        if simulate(pulseTrain('constant', f, 0.1, jitter))['missed']:
+            high = f
+        else:
+            low = f
+    return low
+
+
+def main():
+    train = sys.argv[1] if len(sys.argv) > 1 else 'constant'
+    frequency = float(sys.argv[2]) if len(sys.argv) > 2 else 50000.0
+    seconds = float(sys.argv[3]) if len(sys.argv) > 3 else 0.1
+    jitter = float(sys.argv[4]) if len(sys.argv) > 4 else 0.0
+
+    r = simulate(pulseTrain(train, frequency, seconds, jitter))
+    print('%s train, %.0f steps/s, %.3f s, jitter %.2f' % (train, frequency, seconds, jitter))
+    print('Timer edges: %d ISR edges: %d Missed: %d Max frequency: %d steps/s Max backlog: %d Worst latency: %.2f us'
+          % (r['timerEdges'], r['isrEdges'], r['missed'], r['maxFrequency'], r['maxBacklog'], r['latency'] * 1e6 / CLOCKFREQ))
+    print('Highest constant frequency without missed steps: %.0f steps/s' % highestFrequency(jitter))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Host side test of the encoder tracking loop of the uStepper S library.
+
+Mirrors uStepperEncoder::updateTrackingGains(), track() and trackAdvance() with the same
+integer arithmetic, and feeds the loop encoder samples of a shaft turning at constant speed.
+At each control frequency from CONTROLFREQMIN up, the speed estimate must settle on the
+true speed and stay there. Exits with status 1 if it does not.
+
+    python3 tracking_loop_test.py [bandwidth Hz]
+"""
+import math
+import sys
+
+CLOCKFREQ = 16000000
+CONTROLFREQMIN = 500
+CONTROLFREQMAX = 8000
+ENCODERSPEEDBANDWIDTH = 150.0
+ENCODERTRACKINGWNTMAX = 0.5
+SAMPLECYCLES = 400                  # TCNT1 when the encoder is selected, after the interrupt entry
+
+
+def fixMul(a, b, shift):
+    # Arithmetic shift, as the firmware does on int64_t
+    return (a * b) >> shift
+
+
+def toFix(value, shift):
+    return int(value * (1 << shift))
+
+
+def int32(value):
+    return ((value + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+
+
+class Tracking:
+    """Mirror of the tracking loop of uStepperEncoder"""
+
+    def __init__(self, bandwidth, controlFrequency):
+        wnT = min(2.0 * math.pi * bandwidth / controlFrequency, ENCODERTRACKINGWNTMAX)
+        self.kp = toFix(2.0 * wnT, 24)
+        self.ki = toFix(wnT * wnT, 24)
+        self.cyclesToTick = int(4294967296.0 * controlFrequency / CLOCKFREQ)
+        self.position = 0
+        self.fraction = 0
+        self.velocity = 0
+
+    def advance(self, step):
+        fraction = self.fraction + (step & 0xFFFF)
+        self.position = int32(self.position + (step >> 16) + (fraction >> 16))
+        self.fraction = fraction & 0xFFFF
+
+    def track(self, sample, sampleTime):
+        self.advance(self.velocity)
+        error = int32(sample - self.position)
+        error = max(min(error, 32767), -32767)
+        error = (error << 16) - self.fraction
+        error -= fixMul(self.velocity, (sampleTime * self.cyclesToTick) >> 16, 16)
+        self.velocity = int32(self.velocity + fixMul(error, self.ki, 24))
+        self.advance(fixMul(error, self.kp, 24))
+
+
+def run(bandwidth, controlFrequency, rpm, seconds=2.0):
+    """Mean and largest speed error over the last half, in encoder counts per second"""
+    loop = Tracking(bandwidth, controlFrequency)
+    ticks = int(seconds * controlFrequency)
+    speed = rpm / 60.0 * 65536.0 / controlFrequency      # counts per control tick
+    offset = SAMPLECYCLES * controlFrequency / float(CLOCKFREQ)
+    errors = []
+    for tick in range(ticks):
+        sample = int32(int(math.floor(speed * (tick + offset))))
+        loop.track(sample, SAMPLECYCLES)
+        if tick >= ticks // 2:
+            errors.append((loop.velocity / 65536.0 - speed) * controlFrequency)
+    return sum(errors) / len(errors), max(abs(e) for e in errors)
+
+
+def main():
+    bandwidth = float(sys.argv[1]) if len(sys.argv) > 1 else ENCODERSPEEDBANDWIDTH
+    failed = False
+    for controlFrequency in (CONTROLFREQMIN, 1000, 2000, 4000, CONTROLFREQMAX):
+        wnT = min(2.0 * math.pi * bandwidth / controlFrequency, ENCODERTRACKINGWNTMAX)
+        for rpm in (1.0, 60.0, 600.0):
+            mean, peak = run(bandwidth, controlFrequency, rpm)
+            # No lag on constant speed. The samples are whole encoder counts, which makes the
+            # estimate wander by up to about one count per tick, scaled by the loop gain
+            ok = abs(mean) <= 1.0 + 0.001 * rpm / 60.0 * 65536.0 and peak <= wnT * controlFrequency
+            failed = failed or not ok
+            print('%5d Hz %6.1f rpm: mean speed error %10.2f, peak %12.1f counts/s %s'
+                  % (controlFrequency, rpm, mean, peak, 'ok' if ok else 'FAIL'))
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,314 @@
+/********************************************************************************************
+* 	 	File: 		uStepperController.cpp													*
+*		Version:    2.3.0                                          						    *
+*      	Date: 		December 27th, 2021  	                                    			*
+*      	Authors: 	Thomas Hørring Olsen                                   					*
+*					Emil Jacobsen															*
+*                                                   										*
+*********************************************************************************************
+*	(C) 2021																				*
+*																							*
+*	uStepper ApS																			*
+*	www.ustepper.com 																		*
+*	administration@ustepper.com 															*
+*																							*
+*	The code contained in this file is released under the following open source license:	*
+*																							*
+*			Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International			*
+* 																							*
+* 	The code in this file is provided without warranty of any kind - use at own risk!		*
+* 	neither uStepper ApS nor the author, can be held responsible for any damage				*
+* 	caused by the use of the code contained in this file ! 									*
+*                                                                                           *
+********************************************************************************************/
+/**
+* @file uStepperController.cpp
+*
+* @brief      Function implementations for the control loop controller
+*
+*             This file contains class and function implementations for the controller used
+*             by the DROPIN mode.
+*
+* @author     Thomas Hørring Olsen (thomas@ustepper.com)
+*/
+#include <uStepperS.h>
+
+uStepperController::uStepperController(void)
+{
+
+}
+
+void uStepperController::setLaw(uint8_t law)
+{
+	uint8_t sreg = SREG;
+
+	if(law > CONTROLLAWPIDFF)
+	{
+		law = CONTROLLAWPID;
+	}
+
+	cli();
+	this->law = law;
+	this->reset();
+	SREG = sreg;
+}
+
+uint8_t uStepperController::getLaw(void)
+{
+	return this->law;
+}
+
+void uStepperController::setGains(float p, float i, float d)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->pTerm = p;
+	this->iTerm = i;
+	this->dTerm = d;
+#if CONTROLFIXEDPOINT
+	this->updateFixedGains();
+#endif
+	SREG = sreg;
+}
+
+void uStepperController::setFeedforwardGain(float ff)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->ffTerm = ff;
+#if CONTROLFIXEDPOINT
+	this->updateFixedGains();
+#endif
+	SREG = sreg;
+}
+
+void uStepperController::setDifferentialFilter(float alpha)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->differentialAlpha = alpha;
+#if CONTROLFIXEDPOINT
+	this->updateFixedGains();
+#endif
+	SREG = sreg;
+}
+
+void uStepperController::rescale(float ratio)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->iTerm /= ratio;
+	this->dTerm *= ratio;
+#if CONTROLFIXEDPOINT
+	this->updateFixedGains();
+#endif
+	SREG = sreg;
+}
+
+void uStepperController::reset(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->integral = 0.0;
+	this->errorOld = 0.0;
+	this->differential = 0.0;
+	this->integralReset = 0;
+	this->output = 0.0;
+#if CONTROLFIXEDPOINT
+	this->integralFixed = 0;
+	this->errorOldFixed = 0;
+	this->differentialFixed = 0;
+	this->outputFixed = 0;
+#endif
+	SREG = sreg;
+}
+
+float uStepperController::getIntegrator(void)
+{
+	float value;
+	uint8_t sreg = SREG;
+
+	cli();
+#if CONTROLFIXEDPOINT
+	value = FIXTOFLOAT(this->integralFixed, 8);
+#else
+	value = this->integral;
+#endif
+	SREG = sreg;
+
+	return value;
+}
+
+void uStepperController::setIntegrator(float value)
+{
+	uint8_t sreg = SREG;
+
+	value = constrain(value, -CONTROLLERINTEGRALLIMIT, CONTROLLERINTEGRALLIMIT);
+
+	cli();
+	this->integral = value;
+#if CONTROLFIXEDPOINT
+	this->integralFixed = FLOATTOFIX(value, 8);
+#endif
+	SREG = sreg;
+}
+
+float uStepperController::getOutput(void)
+{
+	float value;
+	uint8_t sreg = SREG;
+
+	cli();
+#if CONTROLFIXEDPOINT
+	value = FIXTOFLOAT(this->outputFixed, 8);
+#else
+	value = this->output;
+#endif
+	SREG = sreg;
+
+	return value;
+}
+
+float uStepperController::update(float error, float limit, float feedforward)
+{
+	float u;
+
+	u = error*this->pTerm;
+
+	if(u > limit)
+	{
+		u = limit;
+	}
+	else if(u < -limit)
+	{
+		u = -limit;
+	}
+
+	if(this->law >= CONTROLLAWPI)
+	{
+		this->integral += error*this->iTerm;
+
+		if(this->integral > CONTROLLERINTEGRALLIMIT)
+		{
+			this->integral = CONTROLLERINTEGRALLIMIT;
+		}
+		else if(this->integral < -CONTROLLERINTEGRALLIMIT)
+		{
+			this->integral = -CONTROLLERINTEGRALLIMIT;
+		}
+
+		if(error > -CONTROLLERINTEGRALRESETBAND && error < CONTROLLERINTEGRALRESETBAND)
+		{
+			if(!this->integralReset)
+			{
+				this->integralReset = 1;
+				this->integral = 0;
+			}
+		}
+		else
+		{
+			this->integralReset = 0;
+		}
+
+		u += this->integral;
+	}
+
+	if(this->law >= CONTROLLAWPID)
+	{
+		this->differential += this->differentialAlpha*((error - this->errorOld)*this->dTerm - this->differential);
+		u += this->differential;
+	}
+
+	this->errorOld = error;
+
+	if(this->law == CONTROLLAWPIDFF)
+	{
+		u += feedforward*this->ffTerm;
+	}
+
+	this->output = u;
+
+	return u;
+}
+
+#if CONTROLFIXEDPOINT
+void uStepperController::updateFixedGains(void)
+{
+	this->pTermFixed = FLOATTOFIX(this->pTerm, FIXSHIFT);
+	this->iTermFixed = FLOATTOFIX(this->iTerm, 24);
+	this->dTermFixed = FLOATTOFIX(this->dTerm, 8);
+	this->ffTermFixed = FLOATTOFIX(this->ffTerm, FIXSHIFT);
+	this->differentialAlphaFixed = FLOATTOFIX(this->differentialAlpha, FIXSHIFT);
+}
+
+int32_t uStepperController::updateFixed(int32_t error, int32_t limit, int32_t feedforward)
+{
+	int32_t u;
+
+	// Q16.16 * Q16.16 -> Q24.8
+	u = fixMul(error, this->pTermFixed, 24);
+
+	if(u > limit)
+	{
+		u = limit;
+	}
+	else if(u < -limit)
+	{
+		u = -limit;
+	}
+
+	if(this->law >= CONTROLLAWPI)
+	{
+		// Q16.16 * Q8.24 -> Q24.8
+		this->integralFixed += fixMul(error, this->iTermFixed, 32);
+
+		if(this->integralFixed > FLOATTOFIX(CONTROLLERINTEGRALLIMIT, 8))
+		{
+			this->integralFixed = FLOATTOFIX(CONTROLLERINTEGRALLIMIT, 8);
+		}
+		else if(this->integralFixed < -FLOATTOFIX(CONTROLLERINTEGRALLIMIT, 8))
+		{
+			this->integralFixed = -FLOATTOFIX(CONTROLLERINTEGRALLIMIT, 8);
+		}
+
+		if(error > -((int32_t)CONTROLLERINTEGRALRESETBAND << FIXSHIFT) && error < ((int32_t)CONTROLLERINTEGRALRESETBAND << FIXSHIFT))
+		{
+			if(!this->integralReset)
+			{
+				this->integralReset = 1;
+				this->integralFixed = 0;
+			}
+		}
+		else
+		{
+			this->integralReset = 0;
+		}
+
+		u += this->integralFixed;
+	}
+
+	if(this->law >= CONTROLLAWPID)
+	{
+		// First order low pass of dError * D, Q16.16 * Q24.8 -> Q24.8
+		this->differentialFixed += fixMul(fixMul(error - this->errorOldFixed, this->dTermFixed, FIXSHIFT) - this->differentialFixed, this->differentialAlphaFixed, FIXSHIFT);
+		u += this->differentialFixed;
+	}
+
+	this->errorOldFixed = error;
+
+	if(this->law == CONTROLLAWPIDFF)
+	{
+		// Q24.8 * Q16.16 -> Q24.8
+		u += fixMul(feedforward, this->ffTermFixed, FIXSHIFT);
+	}
+
+	this->outputFixed = u;
+
+	return u;
+}
+#endif
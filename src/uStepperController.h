@@ -0,0 +1,186 @@
+/********************************************************************************************
+* 	 	File: 		uStepperController.h													*
+*		Version:    2.3.0                                          						    *
+*      	Date: 		December 27th, 2021  	                                    			*
+*      	Authors: 	Thomas Hørring Olsen                                   					*
+*					Emil Jacobsen															*
+*                                                   										*
+*********************************************************************************************
+*	(C) 2021																				*
+*																							*
+*	uStepper ApS																			*
+*	www.ustepper.com 																		*
+*	administration@ustepper.com 															*
+*																							*
+*	The code contained in this file is released under the following open source license:	*
+*																							*
+*			Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International			*
+* 																							*
+* 	The code in this file is provided without warranty of any kind - use at own risk!		*
+* 	neither uStepper ApS nor the author, can be held responsible for any damage				*
+* 	caused by the use of the code contained in this file ! 									*
+*                                                                                           *
+********************************************************************************************/
+/**
+* @file uStepperController.h
+*
+* @brief      Function prototypes and definitions for the control loop controller
+*
+*             This file contains class and function prototypes for the controller used
+*             by the DROPIN mode, as well as necessary constants.
+*
+* @author     Thomas Hørring Olsen (thomas@ustepper.com)
+*/
+#include <Arduino.h>
+
+#define CONTROLLAWP 0		/**< Proportional controller */
+#define CONTROLLAWPI 1		/**< Proportional and integral controller */
+#define CONTROLLAWPID 2		/**< Proportional, integral and differential controller (default) */
+#define CONTROLLAWPIDFF 3	/**< PID controller with feedforward */
+
+#define CONTROLLERINTEGRALLIMIT 200000.0	/**< Limit of the integrator, in controller output units */
+#define CONTROLLERINTEGRALRESETBAND 10		/**< The integrator is cleared when the error enters +/- this band */
+#define CONTROLLEROUTPUTMARGIN 10000.0		/**< The proportional part is limited to the current speed plus this margin */
+
+/**
+ * @brief      Prototype of class for the control loop controller
+ *
+ *             All controller state is kept in the object, so it can be reset, inspected
+ *             and used in more than one loop. Gains are given per control tick, i.e. the
+ *             integral gain includes the sample period and the differential gain includes
+ *             the sample frequency. No memory is allocated.
+ */
+class uStepperController
+{
+friend class uStepperS;
+	public:
+		/**
+		 * @brief	Constructor of uStepperController class
+		 */
+		uStepperController(void);
+
+		/**
+		 * @brief      	Select the control law
+		 *
+		 *				Changing the law resets the controller state.
+		 *
+		 * @param[in]  	law - CONTROLLAWP, CONTROLLAWPI, CONTROLLAWPID or CONTROLLAWPIDFF
+		 */
+		void setLaw(uint8_t law);
+
+		/**
+		 * @brief      	Get the selected control law
+		 *
+		 * @return 		CONTROLLAWP, CONTROLLAWPI, CONTROLLAWPID or CONTROLLAWPIDFF
+		 */
+		uint8_t getLaw(void);
+
+		/**
+		 * @brief      	Set the controller gains
+		 *
+		 * @param[in]  	p - proportional gain
+		 * @param[in]  	i - integral gain, per control tick
+		 * @param[in]  	d - differential gain, per control tick
+		 */
+		void setGains(float p, float i, float d);
+
+		/**
+		 * @brief      	Set the gain of the feedforward input, used by CONTROLLAWPIDFF
+		 *
+		 * @param[in]  	ff - feedforward gain. Default is 1.0
+		 */
+		void setFeedforwardGain(float ff);
+
+		/**
+		 * @brief      	Set the coefficient of the low pass filter on the differential part
+		 *
+		 * @param[in]  	alpha - filter coefficient, 0.0 - 1.0. 1.0 = no filtering
+		 */
+		void setDifferentialFilter(float alpha);
+
+		/**
+		 * @brief      	Clear the integrator, the differential filter and the stored error
+		 */
+		void reset(void);
+
+		/**
+		 * @brief      	Get the current value of the integrator
+		 *
+		 * @return 		integrator value, in controller output units
+		 */
+		float getIntegrator(void);
+
+		/**
+		 * @brief      	Preload the integrator, e.g. for bumpless transfer between modes
+		 *
+		 * @param[in]  	value - integrator value, in controller output units
+		 */
+		void setIntegrator(float value);
+
+		/**
+		 * @brief      	Get the output of the latest controller update
+		 *
+		 * @return 		controller output
+		 */
+		float getOutput(void);
+
+		/**
+		 * @brief      	Run one controller update
+		 *
+		 * @param[in]  	error - control error
+		 * @param[in]  	limit - limit of the proportional part
+		 * @param[in]  	feedforward - feedforward input, only used by CONTROLLAWPIDFF
+		 *
+		 * @return 		controller output
+		 */
+		float update(float error, float limit, float feedforward = 0.0);
+
+#if CONTROLFIXEDPOINT
+		/**
+		 * @brief      	Run one controller update in fixed point arithmetic
+		 *
+		 * @param[in]  	error - control error, Q16.16
+		 * @param[in]  	limit - limit of the proportional part, Q24.8
+		 * @param[in]  	feedforward - feedforward input, Q24.8. Only used by CONTROLLAWPIDFF
+		 *
+		 * @return 		controller output, Q24.8
+		 */
+		int32_t updateFixed(int32_t error, int32_t limit, int32_t feedforward = 0);
+#endif
+
+	private:
+		/** Multiply the integral gain by 1/ratio and the differential gain by ratio, when the control frequency is changed by ratio */
+		void rescale(float ratio);
+
+		uint8_t law = CONTROLLAWPID;
+
+		float pTerm = 0.0;
+		float iTerm = 0.0;
+		float dTerm = 0.0;
+		float ffTerm = 1.0;
+		float differentialAlpha = 1.0;
+
+		float integral = 0.0;
+		float errorOld = 0.0;
+		float differential = 0.0;
+		bool integralReset = 0;
+		float output = 0.0;
+
+#if CONTROLFIXEDPOINT
+		/** Gains. P and FF are Q16.16, I is Q8.24, D is Q24.8 */
+		int32_t pTermFixed = 0;
+		int32_t iTermFixed = 0;
+		int32_t dTermFixed = 0;
+		int32_t ffTermFixed = 1L << FIXSHIFT;
+		/** Differential low pass coefficient, Q16.16 */
+		int32_t differentialAlphaFixed = 1L << FIXSHIFT;
+
+		/** State. Error is Q16.16, integral, differential and output are Q24.8 */
+		int32_t integralFixed = 0;
+		int32_t errorOldFixed = 0;
+		int32_t differentialFixed = 0;
+		int32_t outputFixed = 0;
+
+		void updateFixedGains(void);
+#endif
+};
@@ -35,12 +35,40 @@
 
 extern uStepperS * pointer;
 
+/** Shadow slot of each register address, or NOSHADOW if the register is not kept in the shadow */
+static const uint8_t shadowSlots[SHADOWADDRESSES] PROGMEM = {
+	0, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x00 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x08 */
+	1, 2, NOSHADOW, 3, 4, 5, NOSHADOW, NOSHADOW,	/* 0x10 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x18 */
+	6, NOSHADOW, NOSHADOW, 7, 8, 9, 10, 11,	/* 0x20 */
+	12, NOSHADOW, 13, 14, 15, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x28 */
+	NOSHADOW, NOSHADOW, NOSHADOW, 16, 17, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x30 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x38 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x40 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x48 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x50 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x58 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW,	/* 0x60 */
+	NOSHADOW, NOSHADOW, NOSHADOW, NOSHADOW, 18, 19, 20, NOSHADOW,	/* 0x68 */
+	21,	/* 0x70 */
+};
+
 uStepperDriver::uStepperDriver( void ){
+	uint8_t i;
+
+	for(i = 0; i < DRIVERASYNCFRAMES; i++)
+	{
+		this->asyncFrames[i].transaction.done = 1;
+	}
 }
 
 
 void uStepperDriver::reset( void ){
 
+	// Driver contents are unknown, so make sure every register below is written
+	this->invalidateShadow();
+
 	// Reset stallguard
 	this->writeRegister( TCOOLTHRS, 0 );
 	this->writeRegister( THIGH, 	0);
@@ -48,6 +76,7 @@ void uStepperDriver::reset( void ){
 	this->writeRegister( SW_MODE, 	0 );
 	this->clearStall();
 
+	this->positionOffset = 0;
 	this->writeRegister(XACTUAL, 0);
 	this->writeRegister(XTARGET, 0);
 	
@@ -97,11 +126,15 @@ void uStepperDriver::init( uStepperS * _pointer ){
 	this->stop();
 
 	while(this->readRegister(VACTUAL) != 0);
+
+	// Clear the reset flag of the power-up, so only later resets replay the configuration
+	this->readRegister(GSTAT);
+	this->resetDetected = 0;
 }
 
 void uStepperDriver::readMotorStatus(void)
 {
-	while(TCNT1 > 15900);		//If interrupt is just about to happen, wait for it to finish
+	while(TCNT1 > ICR1 - 100);		//If interrupt is just about to happen, wait for it to finish
 	this->readRegister(XACTUAL);
 }
 
@@ -155,15 +188,71 @@ void uStepperDriver::setHoldCurrent( uint8_t current )
 
 void uStepperDriver::updateCurrent( void )
 {
-	this->writeRegister( IHOLD_IRUN, IHOLD( this->holdCurrent) | IRUN( this->current) | IHOLDDELAY( this->holdDelay) );
+	// Direct mode scales the coil currents with IHOLD
+	if(this->directMode)
+	{
+		this->writeRegister( IHOLD_IRUN, IHOLD( this->current) | IRUN( this->current) | IHOLDDELAY( this->holdDelay) );
+	}
+	else
+	{
+		this->writeRegister( IHOLD_IRUN, IHOLD( this->holdCurrent) | IRUN( this->current) | IHOLDDELAY( this->holdDelay) );
+	}
 }
 
 void uStepperDriver::setPosition( int32_t position )
 {
+	uint8_t timsk = TIMSK1;
+
 	this->mode = DRIVER_POSITION;
 	this->setRampMode(POSITIONING_MODE);
-	this->writeRegister(XTARGET, position);
+
+	// Keep the closed loop from changing the lead between reading it and writing the target
+	TIMSK1 &= ~(1 << OCIE1A);
 	this->xTarget = position;
+
+	// XTARGET holds the coil currents in direct mode
+	if(this->directMode)
+	{
+		TIMSK1 = timsk;
+		return;
+	}
+
+	this->writeRegister(XTARGET, position + this->positionOffset);
+	TIMSK1 = timsk;
+}
+
+void uStepperDriver::setDirectMode( bool enable )
+{
+	int32_t position;
+
+	// XDIRECT shares address with XTARGET, so the ramp must not move while switching
+	this->stop();
+	this->directMode = enable;
+
+	if(enable)
+	{
+		this->setCoilCurrents(0, 0);
+	}
+
+	this->writeRegister( GCONF, (this->readRegister( GCONF ) & ~DIRECT_MODE(1)) | DIRECT_MODE(enable) );
+	this->updateCurrent();
+
+	if(!enable)
+	{
+		// Target still holds the last coil currents
+		position = this->readRegister(XACTUAL);
+		this->xTarget = position - this->positionOffset;
+		this->writeRegister(XTARGET, position);
+	}
+}
+
+void uStepperDriver::setCoilCurrents( int16_t coilA, int16_t coilB )
+{
+	coilA = constrain(coilA, -DIRECTCURRENTMAX, DIRECTCURRENTMAX);
+	coilB = constrain(coilB, -DIRECTCURRENTMAX, DIRECTCURRENTMAX);
+
+	// Two 9 bit two's complement values
+	this->writeRegister( XDIRECT, ((uint32_t)coilA & 0x1FF) | (((uint32_t)coilB & 0x1FF) << 16) );
 }
 
 void uStepperDriver::setShaftDirection( bool direction )
@@ -223,7 +312,7 @@ void uStepperDriver::setRampMode( uint8_t mode ){
 void uStepperDriver::enableStealth()
 {
 	/* Set GCONF and enable stealthChop */
-	this->writeRegister( GCONF, EN_PWM_MODE(1) | I_SCALE_ANALOG(1) ); 
+	this->writeRegister( GCONF, EN_PWM_MODE(1) | I_SCALE_ANALOG(1) | DIRECT_MODE(this->directMode) ); 
 	this->setShaftDirection(pointer->shaftDir);
 
 	/* Set PWMCONF for StealthChop */
@@ -246,7 +335,23 @@ int32_t uStepperDriver::getVelocity( void )
 
 int32_t uStepperDriver::getPosition( void )
 {
-	return this->readRegister(XACTUAL);
+	int32_t position;
+	int32_t offset;
+	bool changed;
+
+	// Read again if the closed loop changed the lead during the read
+	do
+	{
+		cli();
+		offset = this->positionOffset;
+		sei();
+		position = this->readRegister(XACTUAL);
+		cli();
+		changed = (offset != this->positionOffset);
+		sei();
+	}while(changed);
+
+	return position - offset;
 }
 
 void uStepperDriver::stop( void )
@@ -258,10 +363,17 @@ void uStepperDriver::stop( void )
 void uStepperDriver::setHome(int32_t initialSteps)
 {
 	int32_t xActual, xTarget;
+	uint8_t timsk = TIMSK1;
+
+	// The control interrupt updates XACTUAL and positionOffset in closed loop, so it is
+	// masked until the position counter has been moved. Home starts a new closed loop lead
+	TIMSK1 &= ~(1 << OCIE1A);
+	this->positionOffset = 0;
+	pointer->closedLoopReset();
 
 	if(this->mode == DRIVER_POSITION)
 	{
-		xActual = this->getPosition();
+		xActual = this->readRegister(XACTUAL);
 		xTarget = this->readRegister(XTARGET);
 
 		xTarget -= xActual;
@@ -279,78 +391,298 @@ void uStepperDriver::setHome(int32_t initialSteps)
 	}
 
 	pointer->pidPositionStepsIssued = initialSteps;
+	TIMSK1 = timsk;
 }
 
-int32_t uStepperDriver::writeRegister( uint8_t address, uint32_t datagram ){
-
-	// Disabled interrupts until write is complete
-	//cli();
-	TIMSK1 &= ~(1 << OCIE1A);
-	// Enable SPI mode 3 to use TMC5130
-	this->pointer->setSPIMode(3);
-
-	uint32_t package = 0;
+void uStepperDriver::prepareFrame( spiTransaction_t *transaction, uint8_t *tx, uint8_t *rx, uint8_t address, uint32_t datagram )
+{
+	tx[0] = address;
+	tx[1] = (datagram >> 24) & 0xff;
+	tx[2] = (datagram >> 16) & 0xff;
+	tx[3] = (datagram >> 8) & 0xff;
+	tx[4] = (datagram) & 0xff;
+
+	transaction->csPort = &PORTE;
+	transaction->csMask = (1 << CS_DRIVER);
+	transaction->csActiveHigh = 0;
+	transaction->strobePort = NULL;
+	// SPI mode 3 is used by TMC5130
+	transaction->spiMode = 3;
+	transaction->txBuffer = tx;
+	transaction->rxBuffer = rx;
+	transaction->length = 5;
+}
 
-	// Add the value of WRITE_ACCESS to enable register write
-	address += WRITE_ACCESS;
+int32_t uStepperDriver::transferFrame( uint8_t address, uint32_t datagram )
+{
+	spiTransaction_t transaction;
+	uint8_t tx[5], rx[5];
+	int32_t package = 0;
 
-	this->chipSelect(false);
+	this->prepareFrame(&transaction, tx, rx, address, datagram);
+	transaction.callback = NULL;
+	this->pointer->spiTransfer(&transaction);
 
-	this->status = this->pointer->SPI(address);
+	this->captureStatus(rx[0], address & WRITE_ACCESS);
 
-	package |= this->pointer->SPI((datagram >> 24) & 0xff);
+	package |= rx[1];
 	package <<= 8;
-	package |= this->pointer->SPI((datagram >> 16) & 0xff);
+	package |= rx[2];
 	package <<= 8;
-	package |= this->pointer->SPI((datagram >> 8) & 0xff);
+	package |= rx[3];
 	package <<= 8;
-	package |= this->pointer->SPI((datagram) & 0xff);
+	package |= rx[4];
 
-	this->chipSelect(true); // Set CS HIGH
+	return package;
+}
+
+void uStepperDriver::asyncFrameDone( spiTransaction_t *transaction )
+{
+	::pointer->driver.captureStatus(transaction->rxBuffer[0], 1);
+}
+
+void uStepperDriver::captureStatus( uint8_t status, bool write )
+{
+	uint8_t sreg = SREG;
+
+	// Called both from the SPI1 interrupt and from the caller of a register access, so the 
+	// read-modify-write of pendingWrites must not be interrupted
+	cli();
+	this->status = status;
+	this->statusTick = this->pointer->controlTicks;
+
+	if(status & DRIVERRESETFLAG)
+	{
+		this->resetDetected = 1;
+	}
+
+	if(write)
+	{
+		// Status of a write frame is sampled before the new value takes effect
+		this->pendingWrites--;
+		this->statusFresh = 0;
+	}
+	else
+	{
+		this->statusFresh = (this->pendingWrites == 0);
+	}
+	SREG = sreg;
+}
+
+void uStepperDriver::writePending( void )
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->pendingWrites++;
+	this->statusFresh = 0;
+	SREG = sreg;
+}
+
+uint8_t uStepperDriver::getLastStatus( uint32_t *timestamp )
+{
+	uint8_t sreg = SREG;
+	uint8_t status;
+
+	cli();
+	status = this->status;
+	if(timestamp)
+	{
+		*timestamp = this->statusTick;
+	}
+	SREG = sreg;
+
+	return status;
+}
+
+bool uStepperDriver::lastStatusValid( uint32_t maxAge )
+{
+	uint8_t sreg = SREG;
+	bool valid;
+
+	cli();
+	valid = this->statusFresh && (this->pointer->controlTicks - this->statusTick) <= maxAge;
+	SREG = sreg;
+
+	return valid;
+}
+
+void uStepperDriver::writeRegisterAsync( uint8_t address, uint32_t datagram )
+{
+	driverFrame_t *frame = &this->asyncFrames[this->asyncFrameIndex];
+	bool changed;
+	uint8_t timsk = TIMSK1;
+
+	// Shadow is updated in submission order, matching the order of the frames on the bus
+	TIMSK1 &= ~(1 << OCIE1A);
+	changed = this->shadowUpdate(address, datagram);
+	TIMSK1 = timsk;
+
+	if(!changed)
+	{
+		return;
+	}
+
+	this->writePending();
+
+	// Reuse the oldest slot. It is normally long done, so this rarely waits
+	this->pointer->spiWait(&frame->transaction);
+
+	this->prepareFrame(&frame->transaction, frame->tx, frame->rx, address + WRITE_ACCESS, datagram);
+	frame->transaction.callback = uStepperDriver::asyncFrameDone;
+
+	this->pointer->spiSubmitWait(&frame->transaction);
+
+	this->asyncFrameIndex = (this->asyncFrameIndex + 1) % DRIVERASYNCFRAMES;
+}
+
+uint8_t uStepperDriver::shadowSlot( uint8_t address )
+{
+	if(address >= SHADOWADDRESSES)
+	{
+		return NOSHADOW;
+	}
+
+	return pgm_read_byte(&shadowSlots[address]);
+}
+
+bool uStepperDriver::shadowUpdate( uint8_t address, uint32_t datagram )
+{
+	uint8_t slot = this->shadowSlot(address);
+
+	if(slot == NOSHADOW)
+	{
+		return 1;
+	}
+
+	if((this->shadowValid & (1UL << slot)) && this->shadow[slot] == datagram)
+	{
+		return 0;
+	}
+
+	this->shadow[slot] = datagram;
+	this->shadowValid |= (1UL << slot);
+
+	return 1;
+}
+
+void uStepperDriver::invalidateShadow( void )
+{
+	this->shadowValid = 0;
+}
+
+void uStepperDriver::restoreConfiguration( void )
+{
+	uint32_t valid = this->shadowValid;
+	uint8_t address;
+	uint8_t slot;
+	uint8_t timsk = TIMSK1;
+
+	TIMSK1 &= ~(1 << OCIE1A);
+
+	// Reading GSTAT clears the reset flag
+	this->readRegister(GSTAT);
+	this->resetDetected = 0;
+	this->invalidateShadow();
+
+	// The position counters are cleared by the reset. Restore them before the ramp settings, 
+	// so the ramp generator does not start towards a target of 0
+	this->writeRegister(XACTUAL, this->xActual);
+	this->writeRegister(XTARGET, this->xTarget + this->positionOffset);
+
+	for(address = 0; address < SHADOWADDRESSES; address++)
+	{
+		slot = this->shadowSlot(address);
+
+		if(slot != NOSHADOW && (valid & (1UL << slot)))
+		{
+			this->writeRegister(address, this->shadow[slot]);
+		}
+	}
+
+	TIMSK1 = timsk;
+}
+
+int32_t uStepperDriver::writeRegister( uint8_t address, uint32_t datagram ){
+
+	int32_t package = 0;
+	uint8_t timsk = TIMSK1;
+
+	// Disabled interrupts until write is complete. Restored as found, so callers can mask it around several accesses
+	//cli();
+	TIMSK1 &= ~(1 << OCIE1A);
+
+	// Skip the write if the driver already holds this value
+	if(this->shadowUpdate(address, datagram))
+	{
+		this->writePending();
+		// Add the value of WRITE_ACCESS to enable register write
+		package = this->transferFrame(address + WRITE_ACCESS, datagram);
+	}
 
 	//sei(); 
-	TIMSK1 |= (1 << OCIE1A);
+	TIMSK1 = timsk;
 	return package;
 }
 
 int32_t uStepperDriver::readRegister( uint8_t address )
 {
-	// Disabled interrupts until write is complete
+	int32_t value;
+	uint8_t slot = this->shadowSlot(address);
+	uint8_t timsk;
+
+	// Configuration registers only change when written, so serve them from the shadow
+	if(slot != NOSHADOW && (this->shadowValid & (1UL << slot)))
+	{
+		return this->shadow[slot];
+	}
+
+	// Disabled interrupts until write is complete. Restored as found, so callers can mask it around several accesses
 	//cli();
+	timsk = TIMSK1;
 	TIMSK1 &= ~(1 << OCIE1A);
 
-	// Enable SPI mode 3 to use TMC5130
-	this->pointer->setSPIMode(3);
-
 	// Request a reading on address
-	this->chipSelect(false);
-	this->status = this->pointer->SPI(address);
-	this->pointer->SPI(0x00);
-	this->pointer->SPI(0x00);
-	this->pointer->SPI(0x00);
-	this->pointer->SPI(0x00);
-	this->chipSelect(true);
+	this->transferFrame(address, 0);
 
 	// Read the actual value on second request
-	int32_t value = 0;
-
-	this->chipSelect(false);
-	this->status = this->pointer->SPI(address);
-	value |= this->pointer->SPI(0x00);
-	value <<= 8;
-	value |= this->pointer->SPI(0x00);
-	value <<= 8;
-	value |= this->pointer->SPI(0x00);
-	value <<= 8;
-	value |= this->pointer->SPI(0x00);
-	this->chipSelect(true);
+	value = this->transferFrame(address, 0);
 
 	//sei(); 
-	TIMSK1 |= (1 << OCIE1A);
+	TIMSK1 = timsk;
 
 	return value;
 }
 
+void uStepperDriver::readRegisters( const uint8_t *addresses, int32_t *values, uint8_t count )
+{
+	uint8_t i;
+	uint8_t timsk;
+
+	if(count == 0)
+	{
+		return;
+	}
+
+	// Disabled interrupts until read is complete. Restored as found, so callers can mask it around several accesses
+	timsk = TIMSK1;
+	TIMSK1 &= ~(1 << OCIE1A);
+
+	// Request the first register. The reply belongs to whatever was requested before
+	this->transferFrame(addresses[0], 0);
+
+	// Each following request clocks out the data of the previous one
+	for(i = 1; i < count; i++)
+	{
+		values[i - 1] = this->transferFrame(addresses[i], 0);
+	}
+
+	// Clock out the data of the last request
+	values[count - 1] = this->transferFrame(addresses[count - 1], 0);
+
+	TIMSK1 = timsk;
+}
+
 void uStepperDriver::chipSelect(bool state)
 {
 	if(state == false)
@@ -375,7 +707,7 @@ void uStepperDriver::enableStallguard( int8_t threshold, bool stopOnStall, float
 		rpm = 2;
 
 	/* Disable StealthChop for stallguard operation */
-	this->writeRegister( GCONF, EN_PWM_MODE(0) | I_SCALE_ANALOG(1) ); 
+	this->writeRegister( GCONF, EN_PWM_MODE(0) | I_SCALE_ANALOG(1) | DIRECT_MODE(this->directMode) ); 
 	this->setShaftDirection(pointer->shaftDir);
 
 	// Configure COOLCONF for stallguard
@@ -391,28 +723,47 @@ void uStepperDriver::enableStallguard( int8_t threshold, bool stopOnStall, float
 	
 	// Enable automatic stop on stall dectection
 	if( stopOnStall )
-		this->writeRegister( SW_MODE, SG_STOP(1) );
+		this->writeRegister( SW_MODE, SG_STOP(1) | this->latchConfig );
 	else
-		this->writeRegister( SW_MODE, SG_STOP(0) );
+		this->writeRegister( SW_MODE, SG_STOP(0) | this->latchConfig );
 }
 
 void uStepperDriver::disableStallguard( void )
 {
 	// Reenable stealthchop
-	this->writeRegister( GCONF, EN_PWM_MODE(1) | I_SCALE_ANALOG(1) );
+	this->writeRegister( GCONF, EN_PWM_MODE(1) | I_SCALE_ANALOG(1) | DIRECT_MODE(this->directMode) );
 	this->setShaftDirection(pointer->shaftDir);
 
 	// Disable all stallguard configuration
 	this->writeRegister( COOLCONF, 	0 );
 	this->writeRegister( TCOOLTHRS, 0 );
 	this->writeRegister( THIGH, 	0);
-	this->writeRegister( SW_MODE, 	0 );	
+	this->writeRegister( SW_MODE, 	this->latchConfig );	
+}
+
+void uStepperDriver::setLatch( bool rightInput, bool enable )
+{
+	uint32_t swMode = this->readRegister(SW_MODE) & SG_STOP(1);
+
+	// Reference inputs are active high, and never stop the ramp
+	if(!enable)
+		this->latchConfig = 0;
+	else if(rightInput)
+		this->latchConfig = LATCH_R_ACTIVE(1);
+	else
+		this->latchConfig = LATCH_L_ACTIVE(1);
+
+	this->writeRegister( SW_MODE, swMode | this->latchConfig );
 }
 
 void uStepperDriver::clearStall( void )
 {
 	// Reading the RAMP_STAT register clears the stallguard flag, telling the driver to continue. 
 	this->readRegister( RAMP_STAT );
+
+	// A stop event halts the ramp generator without changing VMAX or RAMPMODE. Make sure
+	// the next motion command is sent to the driver, so the motor can be restarted
+	this->shadowValid &= ~((1UL << this->shadowSlot(RAMPMODE)) | (1UL << this->shadowSlot(VMAX_REG)));
 }
 
 uint16_t uStepperDriver::getStallValue( void )
@@ -38,6 +38,7 @@
 
 #define GCONF				0x00 	/**< Please check datasheet for register description */
 
+#define DIRECT_MODE(n)		(((n)&0x1UL)<<16) /**< Please check datasheet for register description */
 #define DIRECTION(n)		(((n)&0x1)<<4) /**< Please check datasheet for register description */
 #define EN_PWM_MODE(n)		(((n)&0x1)<<2) /**< Please check datasheet for register description */
 #define I_SCALE_ANALOG(n)	(((n)&0x1)<<0) /**< Please check datasheet for register description */
@@ -65,9 +66,12 @@
 #define VSTOP_REG			0x2B	/**< Please check datasheet for register description */
 #define TZEROWAIT			0x2C	/**< Please check datasheet for register description */
 #define XTARGET				0x2D	/**< Please check datasheet for register description */
+#define XDIRECT				0x2D	/**< Coil currents in direct mode. Shares address with XTARGET. Please check datasheet for register description */
 #define VDCMIN				0x33	/**< Please check datasheet for register description */
 #define SW_MODE 			0x34	/**< Please check datasheet for register description */
 #define SG_STOP(n)			(((n)&0x1)<<10)	/**< Please check datasheet for register description */
+#define LATCH_L_ACTIVE(n)	(((n)&0x1)<<5)	/**< Please check datasheet for register description */
+#define LATCH_R_ACTIVE(n)	(((n)&0x1)<<7)	/**< Please check datasheet for register description */
 #define RAMP_STAT			0x35	/**< Please check datasheet for register description */
 #define XLATCH				0x36	/**< Please check datasheet for register description */
 
@@ -139,9 +143,28 @@
 #define DRIVER_VELOCITY 1	/**< Define label for indicating driver is in velocity mode */
 #define DRIVER_POSITION 2	/**< Define label for indicating driver is in position mode */
 
+#define DIRECTCURRENTMAX 248	/**< Largest coil current accepted in XDIRECT, for normal operation */
+
 #define ACCELERATIONCONVERSION 1.0/116.415321827	/**< page 74 datasheet*/
 #define VELOCITYCONVERSION 1.0/0.953674316	/**< page 74 datasheet*/
 
+#define SHADOWREGISTERS 22	/**< Number of write-only and configuration registers kept in the RAM shadow of the driver */
+#define SHADOWADDRESSES 0x71	/**< Register addresses below this value can be looked up in the shadow */
+#define NOSHADOW 0xFF			/**< Shadow slot value for registers that are not kept in the shadow */
+#define DRIVERRESETFLAG 0x01	/**< reset_flag bit of the SPI status byte, set from a reset of the driver until GSTAT is read */
+
+#define DRIVERASYNCFRAMES 4	/**< Number of register writes that can be in flight at the same time using writeRegisterAsync() */
+
+/**
+ * @brief      	Struct holding a single TMC5130 SPI frame, used for asynchronous register writes
+ */
+typedef struct
+{
+	spiTransaction_t transaction;	/**< SPI1 transaction of the frame	*/
+	uint8_t tx[5];					/**< Address byte followed by 32 bit datagram	*/
+	uint8_t rx[5];					/**< Status byte followed by 32 bit reply	*/
+}driverFrame_t;
+
 /**
  * @brief      Prototype of class for the TMC5130 Driver
  *
@@ -172,6 +195,7 @@ friend class uStepperS;
 		 * @brief		Set the motor position
 		 *
 		 *				This function tells the motor to go to an absolute position.
+		 *				The closed loop lead (positionOffset) is added before writing XTARGET.
 		 *
 		 * @param[in]	position - position the motor should move to, in micro steps (1/256th default)
 		 */
@@ -236,6 +260,26 @@ friend class uStepperS;
 		 */
 		void stop( void );
 
+		/**
+		 * @brief		Enable or disable direct mode
+		 *
+		 *				In direct mode the ramp generator does not drive the motor. Instead the
+		 *				coil currents are set with setCoilCurrents(). Since direct mode scales the 
+		 *				coil currents with IHOLD, IHOLD is set to the run current while enabled.
+		 *				setPosition() does not write XTARGET while direct mode is enabled.
+		 *
+		 * @param[in]	enable - 1 = direct mode, 0 = normal operation
+		 */
+		void setDirectMode( bool enable );
+
+		/**
+		 * @brief		Set the coil currents in direct mode
+		 *
+		 * @param[in]	coilA - signed current of coil A, -DIRECTCURRENTMAX to DIRECTCURRENTMAX
+		 * @param[in]	coilB - signed current of coil B, -DIRECTCURRENTMAX to DIRECTCURRENTMAX
+		 */
+		void setCoilCurrents( int16_t coilA, int16_t coilB );
+
 		/**
 		 * @brief		Returns the current speed of the motor driver
 		 *
@@ -252,7 +296,8 @@ friend class uStepperS;
 		 * @brief		Returns the current position of the motor driver
 		 *
 		 *				This function returns the position of the motor
-		 *				drivers internal position counter.
+		 *				drivers internal position counter, without the lead
+		 *				injected by the closed loop feedforward.
 		 *				unit is in microsteps (default 1/256th). 
 		 *
 		 * @return		microsteps (default 1/256th).
@@ -275,7 +320,11 @@ friend class uStepperS;
 		 *				
 		 *				When using this function you are on your own and expect you know what you are doing !
 		 *
-		 * @return 		Return data associated with last SPI command
+		 *				Write-only and configuration registers are kept in a RAM shadow, and a write
+		 *				is skipped if the register already holds the value. Position and status
+		 *				registers (e.g. XACTUAL and XTARGET) are always written.
+		 *
+		 * @return 		Return data associated with last SPI command. 0 if the write was skipped
 		 *
 		 * @param[in]	address - Register to write
 		 *
@@ -283,6 +332,21 @@ friend class uStepperS;
 		 */
 		int32_t writeRegister( uint8_t address, uint32_t datagram );
 
+		/**
+		 * @brief		Write a register of the motor driver without waiting for the SPI transfer
+		 *
+		 *				This function queues a register write on the interrupt driven SPI1 engine,
+		 *				and returns immediately. Up to DRIVERASYNCFRAMES writes can be in flight at
+		 *				the same time, after which the call waits for the oldest one to complete.
+		 *				Writes are performed in the order they are issued, also with respect to
+		 *				writeRegister() and readRegister().
+		 *
+		 * @param[in]	address - Register to write
+		 *
+		 * @param[in]	datagram - data to write into the register
+		 */
+		void writeRegisterAsync( uint8_t address, uint32_t datagram );
+
 		/**
 		 * @brief		Reads a register from the motor driver
 		 *
@@ -290,12 +354,83 @@ friend class uStepperS;
 		 *				a register in the TMC5130 motor driver. Please
 		 *				refer to datasheet for details.
 		 *
+		 *				Registers kept in the RAM shadow are returned from the shadow without
+		 *				SPI traffic. This includes write-only registers, which can not be read
+		 *				back from the driver.
+		 *
 		 * @return 		Return data of the read register
 		 *
 		 * @param[in]	address - Register to read
 		 */
 		int32_t readRegister( uint8_t address );
 
+		/**
+		 * @brief		Reads several registers from the motor driver in one pipelined burst
+		 *
+		 *				The TMC5130 returns the data of the previous request in each SPI
+		 *				frame. This function chains the requests, so reading N registers
+		 *				costs N+1 frames instead of the 2*N frames used by N calls to
+		 *				readRegister(). The last address is requested twice to clock out
+		 *				its data, so avoid placing a read-to-clear register (e.g. GSTAT)
+		 *				last if it should only be read once.
+		 *
+		 * @param[in]	addresses - Array of registers to read
+		 *
+		 * @param[out]	values - Array receiving the register contents, in the same order as addresses
+		 *
+		 * @param[in]	count - Number of registers to read
+		 */
+		void readRegisters( const uint8_t *addresses, int32_t *values, uint8_t count );
+
+		/**
+		 * @brief		Returns the last SPI status byte received from the driver
+		 *
+		 *				Every SPI frame exchanged with the TMC5130 returns its SPI_STATUS byte
+		 *				(see POSITION_REACHED, VELOCITY_REACHED, STANDSTILL and STALLGUARD2).
+		 *				The byte is captured from the regular traffic of the timer1 interrupt
+		 *				routine, so this function does not access the SPI bus.
+		 *
+		 * @param[out]	timestamp - if not NULL, receives the number of timer1 interrupts (control ticks)
+		 *				elapsed since startup, at the time the status was captured
+		 *
+		 * @return		SPI_STATUS byte
+		 */
+		uint8_t getLastStatus( uint32_t *timestamp = NULL );
+
+		/**
+		 * @brief		Checks if the last captured status byte can be trusted
+		 *
+		 *				The status is valid if it was captured after every register write issued
+		 *				so far has taken effect, and no more than maxAge control ticks ago.
+		 *
+		 * @param[in]	maxAge - Maximum age of the status, in control ticks
+		 *
+		 * @return		1 = valid, 0 = a fresh read is needed
+		 */
+		bool lastStatusValid( uint32_t maxAge = 1 );
+
+		/**
+		 * @brief		Discards the RAM shadow of the driver registers
+		 *
+		 *				Following writes are sent to the driver regardless of their value. Use this if
+		 *				the driver may have lost its configuration, e.g. after the motor supply was
+		 *				removed, or if registers were changed behind the back of the library.
+		 */
+		void invalidateShadow( void );
+
+		/**
+		 * @brief		Writes the configuration back to the driver after it has been reset
+		 *
+		 *				A brown-out of the motor supply resets the driver to its defaults, which is
+		 *				flagged in the status byte of every frame. The control interrupt then calls 
+		 *				this, which clears the flag, writes back the last known position and target, 
+		 *				and replays every register held in the RAM shadow.
+		 */
+		void restoreConfiguration( void );
+
+		/** Set when a status byte flagged a reset of the driver, cleared by restoreConfiguration() */
+		volatile bool resetDetected = 0;
+
 		/**
 		 * @brief		Returns the load measurement used for Stall detection
 		 */
@@ -307,10 +442,47 @@ friend class uStepperS;
 		/** current position in microsteps*/
 		volatile int32_t xActual = 0;
 
+		/** current velocity of the ramp generator, as last sampled by the timer1 interrupt routine*/
+		volatile int32_t vActual = 0;
+
+		/** XACTUAL latched when the encoder was sampled, as last read by the timer1 interrupt 
+		 * routine. Only updated while the synchronized capture is enabled */
+		volatile int32_t xLatch = 0;
+
+		/** Set while the driver is in direct mode */
+		volatile bool directMode = 0;
+
+		/** Lead of the driver position counter (XACTUAL, XTARGET) over the position of the ramp, in 
+		 * microsteps. Injected by the closed loop feedforward to compensate the lag of the rotor */
+		volatile int32_t positionOffset = 0;
+
 
 	protected:
 		/** Status bits from the driver */
-		uint8_t status; 
+		volatile uint8_t status; 
+
+		/** Control tick at which status was captured */
+		volatile uint32_t statusTick = 0;
+
+		/** Set when status was captured after all issued writes took effect */
+		volatile bool statusFresh = 0;
+
+		/** Number of register writes issued, but not yet completed on the SPI bus */
+		volatile uint8_t pendingWrites = 0;
+
+		/**
+		 * @brief		Stores the status byte returned by a SPI frame
+		 *
+		 * @param[in]	status - SPI_STATUS byte of the frame
+		 *
+		 * @param[in]	write - 1 if the frame was a register write
+		 */
+		void captureStatus( uint8_t status, bool write );
+
+		/**
+		 * @brief		Registers that a write is about to be issued, invalidating the current status
+		 */
+		void writePending( void );
 
 		/** STOP, VELOCITY, POSITION*/
 		uint8_t mode = DRIVER_STOP;
@@ -334,6 +506,54 @@ friend class uStepperS;
 
 		void chipSelect(bool state);
 
+		/**
+		 * @brief		Performs a single 40 bit SPI frame with the motor driver
+		 *
+		 * @param[in]	address - Address byte to send (including WRITE_ACCESS bit for writes)
+		 *
+		 * @param[in]	datagram - data to send
+		 *
+		 * @return		Data returned by the driver, belonging to the previous request
+		 */
+		int32_t transferFrame( uint8_t address, uint32_t datagram );
+
+		/**
+		 * @brief		Fills a SPI1 transaction with a 40 bit frame for the motor driver
+		 */
+		void prepareFrame( spiTransaction_t *transaction, uint8_t *tx, uint8_t *rx, uint8_t address, uint32_t datagram );
+
+		/**
+		 * @brief		Completion callback of writeRegisterAsync() frames, storing the returned status bits
+		 */
+		static void asyncFrameDone( spiTransaction_t *transaction );
+
+		/** Frames used by writeRegisterAsync() */
+		driverFrame_t asyncFrames[DRIVERASYNCFRAMES];
+
+		/** Next frame to use by writeRegisterAsync() */
+		uint8_t asyncFrameIndex = 0;
+
+		/** Last value written to each shadowed register */
+		uint32_t shadow[SHADOWREGISTERS];
+
+		/** Bit n is set when shadow[n] holds the value of the register in the driver */
+		uint32_t shadowValid = 0;
+
+		/** Latch bits kept in SW_MODE, see setLatch() */
+		uint16_t latchConfig = 0;
+
+		/**
+		 * @brief		Returns the shadow slot of a register, or NOSHADOW
+		 */
+		uint8_t shadowSlot( uint8_t address );
+
+		/**
+		 * @brief		Stores a value about to be written in the shadow
+		 *
+		 * @return		1 = value must be written to the driver, 0 = driver already holds the value
+		 */
+		bool shadowUpdate( uint8_t address, uint32_t datagram );
+
 		/**
 		 * @brief		Writes the current setting registers of the motor driver  
 		 */
@@ -356,6 +576,16 @@ friend class uStepperS;
 
 		void disableStallguard( void );
 
+		/**
+		 * @brief		Latch XACTUAL to XLATCH on the rising edge of a reference switch input
+		 *
+		 *				The reference inputs are only used for latching, they never stop the ramp.
+		 *
+		 * @param[in]	rightInput - 0 = REFL, 1 = REFR
+		 * @param[in]	enable - 1 = latch, 0 = do not latch
+		 */
+		void setLatch( bool rightInput, bool enable );
+
 		void clearStall( void );
 
 		void readMotorStatus(void);
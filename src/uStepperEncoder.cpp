@@ -56,16 +56,10 @@ void uStepperEncoder::init(uStepperS * _pointer)
 	TCCR1A = (1 << WGM11);
 	TCCR1B = (1 << WGM12) | (1 << WGM13) | (1 << CS10);
 
-	/* Reset Timer1 and set compare interrupt each: 62.5 ns * 16000 = 1 milliseconds */
+	/* Reset Timer1 and set compare interrupt each: 62.5 ns * 16000 = 1 milliseconds at 1kHz */
 	TCNT1 = 0;
-	if(pointer->mode == DROPIN)
-	{
-		ICR1 = 16000; 
-	}
-	else{
-		ICR1 = 8000;
-	}
-	
+	ICR1 = (uint16_t)(CLOCKFREQ / pointer->controlFrequency);
+
 
 	TIFR1 = 0;
 
@@ -75,6 +69,9 @@ void uStepperEncoder::init(uStepperS * _pointer)
 	/* As long as we only use SSI, the MOSI_ENC/DIN (NSL) should be pulled LOW  */
 	PORTC &= ~(1 << MOSI_ENC);  
 
+	this->loadCalibration();
+	this->findPosition(NULL);
+
 	/* Enable global interrupts */
 	sei();
 }
@@ -84,18 +81,25 @@ void uStepperEncoder::setHome(float initialAngle)
 	cli();
 	TCNT1 = 0;
 	this->encoderOffset = this->captureAngle();
+	this->home((int32_t)(ANGLETOENCODERDATA * initialAngle));
+	sei();
+}
+
+void uStepperEncoder::home(int64_t position)
+{
 	this->oldAngle = 0;
 	this->angle = 0;
-	this->angleMoved = ANGLETOENCODERDATA * initialAngle;
-	this->angleMovedRaw=this->angleMoved;
-	this->smoothValue = this->angleMoved;
-	pointer->driver.setHome(this->angleMoved * ENCODERDATATOSTEP);
+	this->angleMovedRaw = (int32_t)position;
+	this->angleMovedHigh = (int32_t)(position >> 32);
+	this->angleMoved = this->angleMovedRaw;
+	this->smoothLag = 0;
+	// 51200/65536 = 25/32. Only the lower 32 bits are kept, as in XACTUAL
+	pointer->driver.setHome((int32_t)((position * 25) >> 5));
 	this->encoderFilter.posError = 0.0;
 	this->encoderFilter.posEst = 0.0;
 	this->encoderFilter.velIntegrator = 0.0;
 	this->encoderFilter.velEst = 0.0;
-	this->speedSmoothValue = 0.0;
-	sei();
+	this->resetTracking();
 }
 
 bool uStepperEncoder::detectMagnet(void)
@@ -116,24 +120,40 @@ bool uStepperEncoder::detectMagnet(void)
 
 uint16_t uStepperEncoder::captureAngle(void)
 {
-	pointer->setSPIMode(2);
-
+	spiTransaction_t transaction;
+	uint8_t rx[3];
 	uint16_t value = 0;
 	int32_t deltaAngle;
 	uint16_t curAngle;
-
-	chipSelect(true);  // Set CS HIGH
-	
-	/* Write dummy and read the incoming 8 bits */
-	value = pointer->SPI(0x00);
+	int32_t previous;
+
+	/* SSI read is done with CS HIGH, writing dummy bytes in SPI mode 2 */
+	transaction.csPort = &PORTD;
+	transaction.csMask = (1 << CS_ENCODER);
+	transaction.csActiveHigh = 1;
+	transaction.spiMode = 2;
+	transaction.txBuffer = NULL;
+	transaction.rxBuffer = rx;
+	transaction.length = 3;
+	transaction.callback = NULL;
+	/* Latch the driver position together with the angle, if enabled */
+	transaction.strobePort = pointer->latchPort;
+	transaction.strobeMask = pointer->latchMask;
+	pointer->spiTransfer(&transaction);
+
+	/* The encoder latches the angle when selected */
+	this->sampleTime = transaction.selectTime;
+
+	/* 16 bit angle followed by 8 bit status */
+	value = rx[0];
 	value <<= 8;
+	value |= rx[1];
+	this->status = rx[2];
 
-	/* Write dummy and read the incoming 8 bits */
-	value |= pointer->SPI(0x00);
-	/* Write dummy and read the incoming 8 bits */
-	this->status = pointer->SPI(0x00);
-
-	chipSelect(false);  // Set CS LOW
+	if(this->calibrationEnabled)
+	{
+		value -= this->calibrationError(value);
+	}
 
 	curAngle = value;
 	curAngle -= this->encoderOffset;
@@ -151,69 +171,315 @@ uint16_t uStepperEncoder::captureAngle(void)
 		deltaAngle -= 65536;
 	}
 
-	angleMovedRaw += deltaAngle;
-	pointer->driver.readRegister(VACTUAL);
-	this->smoothValue = (this->smoothValue<< this->Beta)-this->smoothValue; 
-   	this->smoothValue += angleMovedRaw;
-   	this->smoothValue >>= this->Beta;
+	previous = this->angleMovedRaw;
+	this->angleMovedRaw = (int32_t)((uint32_t)previous + (uint32_t)deltaAngle);
+
+	// Carry into the upper half of the multi-turn position
+	if(deltaAngle > 0 && (uint32_t)this->angleMovedRaw < (uint32_t)previous)
+	{
+		this->angleMovedHigh++;
+	}
+	else if(deltaAngle < 0 && (uint32_t)this->angleMovedRaw > (uint32_t)previous)
+	{
+		this->angleMovedHigh--;
+	}
+
+	// Low pass filter, smooth = ((smooth << Beta) - smooth + angleMovedRaw) >> Beta. It is run on the 
+	// lag behind angleMovedRaw, which stays small, so it does not overflow at large positions
+	this->smoothLag = ((this->smoothLag - deltaAngle) * ((1L << this->Beta) - 1)) >> this->Beta;
 
 	if(pointer->mode != DROPIN)
 	{
-		this->speedSmoothValue *= 0.9;
-		this->speedSmoothValue += (this->smoothValue-this->angleMoved)*0.1;
-		pointer->encoder.encoderFilter.velIntegrator = this->speedSmoothValue*ENCODERINTFREQ*2.0f;
+		this->track();
 	}
 	
-	if(encoderStallDetectEnable)
+	this->angleMoved = (int32_t)((uint32_t)this->angleMovedRaw + (uint32_t)this->smoothLag);
+
+	return (uint16_t)value;
+	
+}
+
+float uStepperEncoder::getAngle(void)
+{
+	return (float)angle * 0.005493164;	//360/65536  0.087890625
+}
+
+void uStepperEncoder::setSpeedBandwidth(float bandwidth)
+{
+	cli();
+	this->speedBandwidth = bandwidth;
+	this->updateTrackingGains(pointer->controlFrequency);
+	sei();
+}
+
+float uStepperEncoder::getSpeedBandwidth(void)
+{
+	return this->speedBandwidth;
+}
+
+int32_t uStepperEncoder::getTrackedAngleMovedRaw(void)
+{
+	int32_t position;
+
+	cli();
+	position = this->trackingPosition;
+	sei();
+
+	return position;
+}
+
+void uStepperEncoder::updateTrackingGains(uint16_t controlFrequency)
+{
+	// Critically damped: Kp = 2*wn*T, Ki = (wn*T)^2. Limited, as the loop is unstable for Ki >= 4 - 2*Kp
+	float wnT = min(2.0 * M_PI * this->speedBandwidth / controlFrequency, ENCODERTRACKINGWNTMAX);
+
+	this->trackingKp = FLOATTOFIX(2.0 * wnT, 24);
+	this->trackingKi = FLOATTOFIX(wnT * wnT, 24);
+	this->cyclesToTick = (uint32_t)(4294967296.0 * controlFrequency / CLOCKFREQ);
+}
+
+void uStepperEncoder::resetTracking(void)
+{
+	this->trackingPosition = this->angleMovedRaw;
+	this->trackingFraction = 0;
+	this->trackingVelocity = 0;
+#if CONTROLFIXEDPOINT
+	this->velocityFixed = 0;
+#else
+	this->encoderFilter.velIntegrator = 0.0;
+#endif
+}
+
+void uStepperEncoder::trackAdvance(int32_t step)
+{
+	// Whole counts and fraction of the estimate, carrying between them
+	int32_t fraction = (int32_t)this->trackingFraction + (step & 0xFFFF);
+
+	this->trackingPosition += (step >> 16) + (fraction >> 16);
+	this->trackingFraction = fraction & 0xFFFF;
+}
+
+void uStepperEncoder::track(void)
+{
+	int32_t error;
+
+	// Predict the position, then correct prediction and speed with the error to the sample
+	this->trackAdvance(this->trackingVelocity);
+
+	// Error between sample and prediction, Q16.16 encoder counts. The sample is moved back 
+	// to the start of the control tick, with the speed of the previous tick
+	error = this->angleMovedRaw - this->trackingPosition;
+	error = constrain(error, -32767L, 32767L);
+	error = (error << 16) - this->trackingFraction;
+	error -= fixMul(this->trackingVelocity, (this->sampleTime * this->cyclesToTick) >> 16, 16);
+
+	this->trackingVelocity += fixMul(error, this->trackingKi, 24);
+	this->trackAdvance(fixMul(error, this->trackingKp, 24));
+
+#if CONTROLFIXEDPOINT
+	// Q16.16 counts per tick -> Q24.8 counts per second
+	this->velocityFixed = fixMul(this->trackingVelocity, pointer->controlFrequency, 8);
+#else
+	this->encoderFilter.velIntegrator = this->trackingVelocity * (pointer->controlFrequency / 65536.0);
+#endif
+}
+
+int16_t uStepperEncoder::calibrationError(uint16_t value)
+{
+	uint8_t point = value >> ENCODERCALSHIFT;
+	int16_t low = this->calibrationTable[point];
+	int16_t high = this->calibrationTable[(point + 1) & (ENCODERCALPOINTS - 1)];
+
+	return low + (int16_t)(((int32_t)(high - low) * (value & ((1 << ENCODERCALSHIFT) - 1))) >> ENCODERCALSHIFT);
+}
+
+uint8_t uStepperEncoder::calibrationChecksum(void)
+{
+	uint8_t i;
+	uint8_t checksum = 0xAA;
+	uint8_t *p = (uint8_t*)this->calibrationTable;
+
+	for(i = 0; i < sizeof(this->calibrationTable); i++)
+	{
+		checksum ^= *p++;
+	}
+
+	return checksum;
+}
+
+bool uStepperEncoder::loadCalibration(void)
+{
+	uint8_t checksum;
+
+	this->calibrationEnabled = 0;
+
+	if(EEPROM.read(ENCODERCALEEPROMADDRESS) != ENCODERCALMAGIC)
 	{
-		float driverSpeed = pointer->driver.getVelocity();
-		float encoderSpeed = pointer->encoder.encoderFilter.velIntegrator*ENCODERDATATOSTEP;
-		float stallSpeed = driverSpeed*this->encoderStallDetectSensitivity;
-		if (driverSpeed < 0)
+		return 0;
+	}
+
+	EEPROM.get(ENCODERCALEEPROMADDRESS + 1, this->calibrationTable);
+	EEPROM.get(ENCODERCALEEPROMADDRESS + 1 + sizeof(this->calibrationTable), checksum);
+
+	if(checksum != this->calibrationChecksum())
+	{
+		return 0;
+	}
+
+	this->calibrationEnabled = 1;
+	return 1;
+}
+
+void uStepperEncoder::saveCalibration(void)
+{
+	EEPROM.update(ENCODERCALEEPROMADDRESS, ENCODERCALMAGIC);
+	EEPROM.put(ENCODERCALEEPROMADDRESS + 1, this->calibrationTable);
+	EEPROM.put(ENCODERCALEEPROMADDRESS + 1 + sizeof(this->calibrationTable), this->calibrationChecksum());
+}
+
+void uStepperEncoder::clearCalibration(void)
+{
+	this->calibrationEnabled = 0;
+	EEPROM.update(ENCODERCALEEPROMADDRESS, 0xFF);
+}
+
+int16_t uStepperEncoder::getCalibration(uint8_t point)
+{
+	if(point >= ENCODERCALPOINTS)
+	{
+		return 0;
+	}
+
+	return this->calibrationTable[point];
+}
+
+uint8_t uStepperEncoder::positionChecksum(encoderPositionRecord_t *record)
+{
+	uint8_t i;
+	uint8_t checksum = 0xAA;
+	uint8_t *p = (uint8_t*)record;
+
+	// The checksum is the last byte of the record
+	for(i = 0; i < sizeof(encoderPositionRecord_t) - 1; i++)
+	{
+		checksum ^= *p++;
+	}
+
+	return checksum;
+}
+
+bool uStepperEncoder::findPosition(encoderPositionRecord_t *record)
+{
+	encoderPositionRecord_t slot;
+	uint8_t i;
+	bool found = 0;
+
+	for(i = 0; i < ENCODERPOSITIONSLOTS; i++)
+	{
+		EEPROM.get(ENCODERPOSITIONEEPROMADDRESS + i * sizeof(encoderPositionRecord_t), slot);
+
+		if(slot.checksum != this->positionChecksum(&slot))
 		{
-			if ((((driverSpeed+stallSpeed) < encoderSpeed) || (driverSpeed-stallSpeed) > encoderSpeed) && startDelay > 200)
-		    {
-		       errorCnt++;
-		    }
-		    else
-		    {
-		        errorCnt = 0;
-		    }
+			continue;
 		}
-		else
+
+		// Sequence numbers of the slots are at most ENCODERPOSITIONSLOTS apart, so the 
+		// difference tells which is newer, also when the sequence has wrapped
+		if(!found || (int16_t)(slot.sequence - this->positionSequence) > 0)
 		{
-		    if ((((driverSpeed+stallSpeed) > encoderSpeed) || (driverSpeed-stallSpeed) < encoderSpeed) && startDelay > 200)
-		    {
-		       errorCnt++;
-		    }
-		    else
-		    {
-		        errorCnt = 0;
-		    }
+			found = 1;
+			this->positionSlot = i;
+			this->positionSequence = slot.sequence;
+
+			if(record)
+			{
+				*record = slot;
+			}
 		}
-	    if(errorCnt > 5)
-	    {
-	        this->encoderStallDetect = 1;
-	    }
-	    else
-	    {
-	    	this->encoderStallDetect = 0;
-	    }
-	    startDelay++;
-	    if(startDelay > 200)
-	    {
-	    	startDelay = 201;
-	    }
 	}
-	this->angleMoved=this->smoothValue;
 
-	return (uint16_t)value;
-	
+	return found;
 }
 
-float uStepperEncoder::getAngle(void)
+void uStepperEncoder::savePosition(void)
 {
-	return (float)angle * 0.005493164;	//360/65536  0.087890625
+	encoderPositionRecord_t record;
+
+	cli();
+	record.position = ((int64_t)this->angleMovedHigh << 32) | (uint32_t)this->angleMovedRaw;
+	record.angle = this->angle + this->encoderOffset;
+	sei();
+
+	this->positionSlot++;
+	if(this->positionSlot >= ENCODERPOSITIONSLOTS)
+	{
+		this->positionSlot = 0;
+	}
+
+	this->positionSequence++;
+	record.sequence = this->positionSequence;
+	record.checksum = this->positionChecksum(&record);
+
+	EEPROM.put(ENCODERPOSITIONEEPROMADDRESS + this->positionSlot * sizeof(encoderPositionRecord_t), record);
+}
+
+bool uStepperEncoder::restorePosition(void)
+{
+	encoderPositionRecord_t record;
+	uint16_t value;
+
+	if(!this->findPosition(&record))
+	{
+		return 0;
+	}
+
+	cli();
+	TCNT1 = 0;
+	value = this->captureAngle();
+	this->encoderOffset = value;
+	// The angle moved increases when the raw angle decreases
+	this->home(record.position + (int16_t)(record.angle - value));
+	sei();
+
+	return 1;
+}
+
+void uStepperEncoder::clearSavedPosition(void)
+{
+	encoderPositionRecord_t record;
+	uint16_t address;
+	uint8_t i;
+
+	for(i = 0; i < ENCODERPOSITIONSLOTS; i++)
+	{
+		address = ENCODERPOSITIONEEPROMADDRESS + i * sizeof(encoderPositionRecord_t);
+		EEPROM.get(address, record);
+
+		if(record.checksum == this->positionChecksum(&record))
+		{
+			EEPROM.update(address + sizeof(encoderPositionRecord_t) - 1, record.checksum ^ 0xFF);
+		}
+	}
+}
+
+int64_t uStepperEncoder::getAngleMovedRaw64(void)
+{
+	int64_t position;
+
+	cli();
+	position = ((int64_t)this->angleMovedHigh << 32) | (uint32_t)this->angleMovedRaw;
+	sei();
+
+	return position;
+}
+
+float uStepperEncoder::getMultiTurnAngle(int32_t *revolutions)
+{
+	int64_t position = this->getAngleMovedRaw64();
+
+	*revolutions = (int32_t)(position >> 16);
+
+	return (uint16_t)position * 0.005493164;	//360/65536
 }
 
 uint16_t uStepperEncoder::getAngleRaw(void)
@@ -258,12 +524,20 @@ uint8_t uStepperEncoder::getStatus( void )
 
 float uStepperEncoder::getSpeed( void )
 {
+#if CONTROLFIXEDPOINT
+	return FIXTOFLOAT(this->velocityFixed, 8) * ENCODERDATATOSTEP;
+#else
 	return pointer->encoder.encoderFilter.velIntegrator * ENCODERDATATOSTEP;
+#endif
 }
 
 float uStepperEncoder::getRPM( void )
 {
+#if CONTROLFIXEDPOINT
+	return FIXTOFLOAT(this->velocityFixed, 8) * ENCODERDATATOREVOLUTIONS;
+#else
 	return pointer->encoder.encoderFilter.velIntegrator * ENCODERDATATOREVOLUTIONS;
+#endif
 }
 
 void uStepperEncoder::chipSelect(bool state)
@@ -42,6 +42,31 @@
 #define ENCODERDATATOREVOLUTIONS 60.0/65536.0 /**< Constant to convert raw encoder data to revolutions */
 #define ANGLETOENCODERDATA 65535.0/360.0 /**< Constant to convert angle to raw encoder data */
 
+#define ENCODERSPEEDBANDWIDTH 150.0	/**< Default bandwidth in Hz of the tracking loop estimating encoder position and speed */
+#define ENCODERTRACKINGWNTMAX 0.5	/**< Largest natural frequency of the tracking loop, in radians per control tick. Keeps Kp <= 1 and Ki <= 0.25, inside the stability limit Ki < 4 - 2*Kp */
+
+#define ENCODERCALSHIFT 10	/**< log2 of the number of encoder counts between points in the calibration table */
+#define ENCODERCALPOINTS (65536UL >> ENCODERCALSHIFT)	/**< Number of points in the calibration table, evenly spaced over one revolution */
+#define ENCODERCALEEPROMADDRESS 24	/**< EEPROM address of the calibration table, after the dropin settings */
+#define ENCODERCALEEPROMSIZE (2 * ENCODERCALPOINTS + 2)	/**< EEPROM bytes used by the calibration table, including the marker and checksum */
+#define ENCODERCALMAGIC 0x5A	/**< Marks a calibration table in EEPROM */
+
+#define ENCODERPOSITIONEEPROMADDRESS 160	/**< EEPROM address of the first slot of the saved multi-turn position */
+#define ENCODERPOSITIONSLOTS 16	/**< Number of EEPROM slots the saved position is rotated over, to spread wear */
+
+/**
+ * @brief	Multi-turn position as saved in EEPROM by uStepperEncoder::savePosition()
+ */
+typedef struct
+{
+	uint16_t sequence;		/**< Incremented on each save. The valid slot with the newest sequence is used */
+	int64_t position;		/**< Unfiltered angle moved, raw encoder counts */
+	uint16_t angle;			/**< Absolute encoder angle at position, raw encoder counts */
+	uint8_t checksum;		/**< Checksum of the preceding bytes */
+}encoderPositionRecord_t;
+
+#define ENCODERPOSITIONEEPROMSIZE (ENCODERPOSITIONSLOTS * sizeof(encoderPositionRecord_t))	/**< EEPROM bytes used by the saved multi-turn position */
+
 /**
  * @brief      Prototype of class for the AEAT8800-Q24 encoder
  *
@@ -50,6 +75,7 @@
  */
 class uStepperEncoder
 {
+friend class uStepperS;
 	public:
 		/**
 		 * @brief	Constructor of uStepperEncoder class
@@ -113,6 +139,10 @@ class uStepperEncoder
 		 *
 		 *             The reference position can be reset at any point in time, by
 		 *             use of the setHome() function.
+		 *
+		 *             The angle wraps after 32768 revolutions, and as a float its resolution 
+		 *             drops as it grows. For long running applications, use getAngleMovedRaw64() 
+		 *             or getMultiTurnAngle().
 		 * 
 		 * @param[in]  filtered - if true, the function returns the filtered angle. if false, the unfiltered angle is returned
 		 *
@@ -133,6 +163,8 @@ class uStepperEncoder
 		 *
 		 *             The reference position can be reset at any point in time, by
 		 *             use of the setHome() function.
+		 *
+		 *             The value wraps after 32768 revolutions, see getAngleMovedRaw64().
 		 * 
 		 * @param[in]  filtered - if true, the function returns the filtered angle. if false, the unfiltered angle is returned
 		 *
@@ -140,6 +172,55 @@ class uStepperEncoder
 		 */
 		int32_t getAngleMovedRaw( bool filtered = true );
 
+		/**
+		 * @brief      Returns the unfiltered angle moved from reference position, without overflow
+		 *
+		 *             getAngleMovedRaw() wraps after 32768 revolutions. This 64 bit position 
+		 *             does not wrap in practice.
+		 *
+		 * @return     The angle moved in raw encoder readings.
+		 */
+		int64_t getAngleMovedRaw64( void );
+
+		/**
+		 * @brief      Returns the unfiltered angle moved from reference position as whole 
+		 *             revolutions plus an angle
+		 *
+		 *             Unlike getAngleMoved(), the resolution does not drop at large positions.
+		 *
+		 * @param[out] revolutions - whole revolutions moved, rounded towards minus infinity
+		 *
+		 * @return     Angle in degrees moved on top of the whole revolutions, 0 to 360.
+		 */
+		float getMultiTurnAngle( int32_t *revolutions );
+
+		/**
+		 * @brief      Save the multi-turn position in EEPROM
+		 *
+		 *             Each save writes the next of ENCODERPOSITIONSLOTS slots, so the EEPROM endures 
+		 *             ENCODERPOSITIONSLOTS times as many saves. A save takes around 45 ms, and must 
+		 *             be done before power is removed, e.g. when a falling supply is detected. 
+		 *             Not to be called from interrupt context.
+		 */
+		void savePosition( void );
+
+		/**
+		 * @brief      Restore the multi-turn position saved in EEPROM
+		 *
+		 *             The position is restored with the movement since the save added, as measured 
+		 *             by the absolute encoder. This is correct as long as the shaft was moved less than
+		 *             half a revolution while the power was off. The driver position is set to match, 
+		 *             as by setHome(). Call after uStepperS::setup().
+		 *
+		 * @return     1 = position restored, 0 = no valid position in EEPROM
+		 */
+		bool restorePosition( void );
+
+		/**
+		 * @brief      Invalidate the multi-turn position saved in EEPROM
+		 */
+		void clearSavedPosition( void );
+
 		/**
 		 * @brief      Measure the current speed of the motor
 		 *
@@ -164,6 +245,39 @@ class uStepperEncoder
 		 */
 		float getRPM(void);
 
+		/**
+		 * @brief      Set the bandwidth of the speed estimation
+		 *
+		 *             Position and speed are estimated by a second order (type II) tracking loop
+		 *             following the encoder samples, which has no lag on constant speed. A higher 
+		 *             bandwidth gives faster response to speed changes, at the cost of more noise.
+		 *             Default is ENCODERSPEEDBANDWIDTH. The loop is only stable well below the control 
+		 *             frequency, so the bandwidth used is limited to control frequency / (4 * pi), 
+		 *             e.g. 39.8Hz at 500Hz and 79.6Hz at 1kHz. The limit follows setControlFrequency().
+		 *
+		 * @param[in]  bandwidth - natural frequency of the tracking loop in Hz
+		 */
+		void setSpeedBandwidth(float bandwidth);
+
+		/**
+		 * @brief      Get the bandwidth of the speed estimation
+		 *
+		 * @return     natural frequency of the tracking loop in Hz
+		 */
+		float getSpeedBandwidth(void);
+
+		/**
+		 * @brief      Returns the angle moved from reference position, as estimated by the tracking loop
+		 *
+		 *             Unlike getAngleMovedRaw(), this position has no lag on constant speed, and 
+		 *             matches the speed returned by getSpeed(). Samples are extrapolated to the start 
+		 *             of the control tick, so the position does not depend on when in the control 
+		 *             loop the encoder was read.
+		 *
+		 * @return     The angle moved in raw encoder readings.
+		 */
+		int32_t getTrackedAngleMovedRaw(void);
+
 		/**
 		 * @brief      Capture the current shaft angle
 		 *
@@ -174,6 +288,34 @@ class uStepperEncoder
 		 */
 		uint16_t captureAngle( void );
 
+		/**
+		 * @brief      	Load the nonlinearity calibration table from EEPROM
+		 *
+		 *				Called by init(). The table is applied by captureAngle() if valid.
+		 *
+		 * @return 		1 = valid table loaded, 0 = no valid table in EEPROM
+		 */
+		bool loadCalibration( void );
+
+		/**
+		 * @brief      	Store the nonlinearity calibration table in EEPROM
+		 */
+		void saveCalibration( void );
+
+		/**
+		 * @brief      	Stop applying the nonlinearity calibration, and remove it from EEPROM
+		 */
+		void clearCalibration( void );
+
+		/**
+		 * @brief      	Get a point of the nonlinearity calibration table
+		 *
+		 * @param[in]  	point - point in the table, 0 to ENCODERCALPOINTS - 1
+		 *
+		 * @return 		error of the encoder, in encoder counts, at raw angle point * 2^ENCODERCALSHIFT
+		 */
+		int16_t getCalibration( uint8_t point );
+
 		/**
 		 * @brief      	Get encoder status
 		 *
@@ -195,11 +337,20 @@ class uStepperEncoder
 		 */
 		bool detectMagnet(void);
 
-		/** variable used for filtering the encoder readings*/
-		volatile int32_t smoothValue;
+		/** Filtered angle moved minus angleMovedRaw, raw encoder counts */
+		volatile int32_t smoothLag = 0;
 		
-		/** variable used for filtering the encoder speed estimation*/
-		volatile float speedSmoothValue;
+		/** Position estimated by the tracking loop at the start of the control tick, whole encoder counts */
+		volatile int32_t trackingPosition = 0;
+
+		/** Fraction of the position estimated by the tracking loop, 1/65536th encoder counts */
+		volatile uint16_t trackingFraction = 0;
+
+		/** Speed estimated by the tracking loop, Q16.16 encoder counts per control tick */
+		volatile int32_t trackingVelocity = 0;
+
+		/** TCNT1 when the latest sample was taken. Timer1 restarts at the start of each control tick */
+		volatile uint16_t sampleTime = 0;
 
 		/** Angle of the shaft at the reference position. */
 		volatile uint16_t encoderOffset;
@@ -226,16 +377,25 @@ class uStepperEncoder
 		/** Object to hold speed filter */
 		volatile posFilter_t encoderFilter;
 
+#if CONTROLFIXEDPOINT
+		/** Fixed point version of encoderFilter.velIntegrator, Q24.8 encoder counts per second */
+		volatile int32_t velocityFixed = 0;
+#endif
+
 		/** Filter constant for encoder feedback **/
 		volatile  uint8_t Beta = 5;
 
-		/** Encoder stalldetect enable - enabled when set to 1 **/
+		/** Encoder stalldetect enable - enabled when set to 1. 
+		 * @deprecated Use uStepperS::enableEncoderStallDetect() and uStepperS::disableEncoderStallDetect() **/
 		volatile  bool encoderStallDetectEnable = 0;
 
-		/** Encoder stalldetect return value - stall = 1 **/
-		volatile  bool encoderStallDetect;
+		/** Encoder stalldetect return value - stall = 1. 
+		 * @deprecated Use uStepperS::isEncoderStalled() **/
+		volatile  bool encoderStallDetect = 0;
 
-		/** Encoder stalldetect sensitivity - From -10 to 1 where lower number is less sensitive and higher is more sensitive. **/
+		/** Encoder stalldetect sensitivity - From -10 to 1 where lower number is less sensitive and higher is more sensitive. 
+		 * Used as the tolerance -encoderStallDetectSensitivity of uStepperS::enableEncoderStallDetect(). 
+		 * @deprecated Use uStepperS::enableEncoderStallDetect() **/
 		volatile  float encoderStallDetectSensitivity = -0.5;
 
 	private:
@@ -254,13 +414,81 @@ class uStepperEncoder
 		uint8_t status; 
 		int32_t userAngleOffset = 0;	
 
-		/** Encoder stall detect counter - Delay start of the stalldetect to let the encoder velocity filter initialize properly */
-		volatile uint8_t startDelay = 0;
+		volatile int32_t angleMovedRaw = 0;
 
-		/** Encoder stall detect counter - Counter for number of consecutive samples that must show a stall */
-		volatile uint16_t errorCnt = 0;
+		/** Upper 32 bits of the multi-turn position. angleMovedRaw is the lower 32 bits */
+		volatile int32_t angleMovedHigh = 0;
 
-		volatile int32_t angleMovedRaw = 0;
+		/** EEPROM slot and sequence number of the newest saved position */
+		uint8_t positionSlot = ENCODERPOSITIONSLOTS - 1;
+		uint16_t positionSequence = 0;
+
+		/**
+		 * @brief      Set the angle moved, and home the driver and filters to it
+		 *
+		 *             encoderOffset must be set before. Interrupts must be disabled.
+		 *
+		 * @param[in]  position - unfiltered angle moved, raw encoder counts
+		 */
+		void home( int64_t position );
+
+		/**
+		 * @brief      Find the newest valid position in EEPROM
+		 *
+		 * @param[out] record - the newest position
+		 *
+		 * @return     1 = found, 0 = no valid position
+		 */
+		bool findPosition( encoderPositionRecord_t *record );
+
+		uint8_t positionChecksum( encoderPositionRecord_t *record );
+
+		/** Error of the encoder at evenly spaced raw angles, in encoder counts. Subtracted from the raw angle by captureAngle() */
+		int16_t calibrationTable[ENCODERCALPOINTS];
+
+		/** Bandwidth of the tracking loop in Hz */
+		float speedBandwidth = ENCODERSPEEDBANDWIDTH;
+
+		/** Tracking loop gains, Q8.24 per control tick */
+		int32_t trackingKp = 0;
+		int32_t trackingKi = 0;
+
+		/** Fraction of a control tick per timer1 cycle, Q0.32 */
+		uint32_t cyclesToTick = 0;
+
+		/**
+		 * @brief      Compute the tracking loop gains for the bandwidth and control frequency
+		 *
+		 * @param[in]  controlFrequency - control loop frequency in Hz
+		 */
+		void updateTrackingGains(uint16_t controlFrequency);
+
+		/**
+		 * @brief      Run one update of the tracking loop with the latest sample
+		 */
+		void track(void);
+
+		/**
+		 * @brief      Move the tracking loop position estimate
+		 *
+		 * @param[in]  step - Q16.16 encoder counts
+		 */
+		void trackAdvance(int32_t step);
+
+		/**
+		 * @brief      Set the tracking loop to the latest sample at standstill
+		 */
+		void resetTracking(void);
+
+		/** Set when calibrationTable holds a valid calibration */
+		volatile bool calibrationEnabled = 0;
+
+		/**
+		 * @brief      Interpolate the calibration table at a raw encoder angle
+		 */
+		int16_t calibrationError( uint16_t value );
+
+		uint8_t calibrationChecksum( void );
 
 };
 
@@ -33,11 +33,109 @@
 #include <uStepperS.h>
 uStepperS * pointer;
 
+/* EEPROM layout, see "EEPROM Usage information" in uStepperS.h */
+static_assert(DROPINEEPROMSIZE <= ENCODERCALEEPROMADDRESS, "Dropin settings overlap the encoder calibration table in EEPROM");
+static_assert(ENCODERCALEEPROMADDRESS + ENCODERCALEEPROMSIZE <= ENCODERPOSITIONEEPROMADDRESS, "Encoder calibration table overlaps the saved position in EEPROM");
+static_assert(ENCODERPOSITIONEEPROMADDRESS + ENCODERPOSITIONEEPROMSIZE <= E2END + 1, "Saved position does not fit in EEPROM");
+
+#if DROPINFASTSTEPISR
+volatile int32_t uStepperS::stepCnt = 0;
+volatile int32_t uStepperS::stepIncrement[2] = {0, 0};
+volatile uint16_t uStepperS::stepEdgeTimer = 0;
+volatile uint16_t uStepperS::stepCheckIsrEdges = 0;
+#endif
+
+/* dropinCli commands. A name must not be the start of a longer name listed after it */
+static const char dropinCliP[] PROGMEM = "P=";
+static const char dropinCliI[] PROGMEM = "I=";
+static const char dropinCliD[] PROGMEM = "D=";
+static const char dropinCliInvert[] PROGMEM = "invert";
+static const char dropinCliError[] PROGMEM = "error";
+static const char dropinCliCurrent[] PROGMEM = "current";
+static const char dropinCliParameters[] PROGMEM = "parameters";
+static const char dropinCliHelp[] PROGMEM = "help";
+static const char dropinCliRunCurrent[] PROGMEM = "runCurrent=";
+static const char dropinCliHoldCurrent[] PROGMEM = "holdCurrent=";
+
+static const dropinCliCommand_t dropinCliCommands[] PROGMEM = {
+	{dropinCliP, DROPINCLIP, 1, 1e9},
+	{dropinCliI, DROPINCLII, 1, 1e9},
+	{dropinCliD, DROPINCLID, 1, 1e9},
+	{dropinCliInvert, DROPINCLIINVERT, 0, 0.0},
+	{dropinCliError, DROPINCLIERROR, 0, 0.0},
+	{dropinCliCurrent, DROPINCLICURRENT, 0, 0.0},
+	{dropinCliParameters, DROPINCLIPARAMETERS, 0, 0.0},
+	{dropinCliHelp, DROPINCLIHELP, 0, 0.0},
+	{dropinCliRunCurrent, DROPINCLIRUNCURRENT, 1, 100.0},
+	{dropinCliHoldCurrent, DROPINCLIHOLDCURRENT, 1, 100.0},
+};
+
+static const char dropinHelp0[] PROGMEM = "uStepper S Dropin !";
+static const char dropinHelp1[] PROGMEM = "";
+static const char dropinHelp2[] PROGMEM = "Usage:";
+static const char dropinHelp3[] PROGMEM = "Show this command list: 'help;'";
+static const char dropinHelp4[] PROGMEM = "Get PID Parameters: 'parameters;'";
+static const char dropinHelp5[] PROGMEM = "Set Proportional constant: 'P=10.002;'";
+static const char dropinHelp6[] PROGMEM = "Set Integral constant: 'I=10.002;'";
+static const char dropinHelp7[] PROGMEM = "Set Differential constant: 'D=10.002;'";
+static const char dropinHelp8[] PROGMEM = "Invert Direction: 'invert;'";
+static const char dropinHelp9[] PROGMEM = "Get Current PID Error: 'error;'";
+static const char dropinHelp10[] PROGMEM = "Get Run/Hold Current Settings: 'current;'";
+static const char dropinHelp11[] PROGMEM = "Set Run Current (percent): 'runCurrent=50.0;'";
+static const char dropinHelp12[] PROGMEM = "Set Hold Current (percent): 'holdCurrent=50.0;'";
+
+static const char * const dropinHelpText[] PROGMEM = {
+	dropinHelp0, dropinHelp1, dropinHelp2, dropinHelp3, dropinHelp4, dropinHelp5, dropinHelp6,
+	dropinHelp7, dropinHelp8, dropinHelp9, dropinHelp10, dropinHelp11, dropinHelp12, dropinHelp1, dropinHelp1
+};
+
+/* First quarter of a sine wave, 255 * sin(i * 90 / 64 degrees), for coil current commutation */
+static const uint8_t sineTable[65] PROGMEM = {
+	0, 6, 13, 19, 25, 31, 37, 44, 50, 56, 62, 68, 74, 80, 86, 92,
+	98, 103, 109, 115, 120, 126, 131, 136, 142, 147, 152, 157, 162, 167, 171, 176,
+	180, 185, 189, 193, 197, 201, 205, 208, 212, 215, 219, 222, 225, 228, 231, 233,
+	236, 238, 240, 242, 244, 246, 247, 249, 250, 251, 252, 253, 254, 254, 255, 255,
+	255
+};
+
+/* Sine of angle (65536 = one revolution), scaled by magnitude */
+static int16_t directSine(uint16_t angle, uint8_t magnitude)
+{
+	uint8_t index = (uint16_t)(angle + 128) >> 8;
+	uint8_t i = index & 63;
+	int16_t value;
+
+	if(index & 64)
+	{
+		i = 64 - i;
+	}
+
+	value = ((uint16_t)magnitude * pgm_read_byte(&sineTable[i])) >> 8;
+
+	if(index & 128)
+	{
+		return -value;
+	}
+	return value;
+}
+
+/* Timer1 counts from 0 to ICR1, so an interval crossing the end of the period has wrapped around */
+static inline uint16_t timer1Elapsed(uint16_t from, uint16_t to)
+{
+	if(to >= from)
+	{
+		return to - from;
+	}
+	return to + ICR1 + 1 - from;
+}
+
 uStepperS::uStepperS()
 {
 	pointer = this;
 
+#if !MOTORFULLSTEPS
 	this->microSteps = 256;
+#endif
 	this->init();	
 
 	this->setMaxAcceleration(2000.0);
@@ -48,7 +146,9 @@ uStepperS::uStepperS()
 uStepperS::uStepperS(float acceleration, float velocity)
 {
 	pointer = this;
+#if !MOTORFULLSTEPS
 	this->microSteps = 256;
+#endif
 	this->init();
 
 	this->setMaxAcceleration(acceleration);
@@ -60,6 +160,9 @@ void uStepperS::init( void ){
 
 	
 	this->pidDisabled = 1;
+	this->updateControlGains();
+	this->resetIsrProfiler();
+
 	/* Set CS, MOSI, SCK and DRV_ENN as Output */
 	DDRC = (1<<SCK1)|(1<<MOSI_ENC);
 	DDRD = (1<<DRV_ENN)|(1<<SD_MODE)|(1<<CS_ENCODER);
@@ -83,8 +186,12 @@ void uStepperS::init( void ){
 
 bool uStepperS::getMotorState(uint8_t statusType)
 {
-	this->driver.readMotorStatus();
-	if(this->driver.status & statusType)
+	if(!this->driver.lastStatusValid())
+	{
+		this->driver.readMotorStatus();
+	}
+
+	if(this->driver.getLastStatus() & statusType)
 	{
 		return 0;
 	}
@@ -164,6 +271,146 @@ void uStepperS::checkOrientation(float distance)
 	this->enablePid();
 }
 
+uint16_t uStepperS::encoderCalibrationSample(void)
+{
+	uint16_t first;
+	int32_t sum = 0;
+	uint8_t i;
+
+	// Average around the first sample, so wrap around at 0 does not matter
+	cli();
+	first = this->encoder.angle + this->encoder.encoderOffset;
+	sei();
+
+	for(i = 0; i < ENCODERCALSAMPLES; i++)
+	{
+		delay(1);
+		cli();
+		sum += (int16_t)((uint16_t)(this->encoder.angle + this->encoder.encoderOffset) - first);
+		sei();
+	}
+
+	return first + sum / ENCODERCALSAMPLES;
+}
+
+bool uStepperS::calibrateEncoder(void)
+{
+	int16_t sum[ENCODERCALPOINTS];
+	uint8_t count[ENCODERCALPOINTS];
+	int16_t table[ENCODERCALPOINTS];
+	uint16_t start, raw, expected;
+	int32_t startPosition;
+	int32_t total = 0;
+	int16_t error;
+	int16_t step;
+	int16_t fullStep;
+	int16_t i;
+	int8_t dir;
+	uint8_t point;
+
+	if(this->directCurrent)
+	{
+		return 0;
+	}
+
+	this->disablePid();
+	this->encoder.calibrationEnabled = 0;
+
+	for(i = 0; i < (int16_t)ENCODERCALPOINTS; i++)
+	{
+		sum[i] = 0;
+		count[i] = 0;
+	}
+
+	// Encoder counts per full step
+	fullStep = 65536L / this->fullSteps;
+
+	startPosition = this->driver.getPosition();
+	delay(ENCODERCALSETTLE);
+	start = this->encoderCalibrationSample();
+
+	// Find the direction of the encoder, relative to the steps
+	this->driver.setPosition(startPosition + this->microSteps);
+	while(this->getMotorState());
+	delay(ENCODERCALSETTLE);
+	error = (int16_t)(this->encoderCalibrationSample() - start);
+	if(abs(error) < fullStep/2 || abs(error) > fullStep*2)
+	{
+		this->driver.setPosition(startPosition);
+		while(this->getMotorState());
+		this->encoder.loadCalibration();
+		this->enablePid();
+		return 0;
+	}
+	dir = (error > 0) ? 1 : -1;
+
+	// One revolution forward and back, to average out hysteresis
+	for(i = 1; i <= 2 * (int16_t)this->fullSteps; i++)
+	{
+		step = (i <= (int16_t)this->fullSteps) ? i : 2 * this->fullSteps - i;
+
+		this->driver.setPosition(startPosition + (int32_t)step * this->microSteps);
+		while(this->getMotorState());
+		delay(ENCODERCALSETTLE);
+		raw = this->encoderCalibrationSample();
+
+		expected = start + dir * (int32_t)step * 65536L / this->fullSteps;
+		error = (int16_t)(raw - expected);
+
+		// Lost steps
+		if(abs(error) > fullStep)
+		{
+			this->driver.setPosition(startPosition);
+			while(this->getMotorState());
+			this->encoder.loadCalibration();
+			this->enablePid();
+			return 0;
+		}
+
+		// Nearest point of the table
+		point = (uint16_t)(raw + (1 << (ENCODERCALSHIFT - 1))) >> ENCODERCALSHIFT;
+		point &= ENCODERCALPOINTS - 1;
+		sum[point] += error;
+		count[point]++;
+		total += error;
+	}
+
+	// The mean error is just an offset, which is not part of the nonlinearity
+	total /= 2 * (int32_t)this->fullSteps;
+
+	for(i = 0; i < (int16_t)ENCODERCALPOINTS; i++)
+	{
+		if(count[i])
+		{
+			table[i] = sum[i] / count[i] - total;
+		}
+	}
+
+	// Motors with few steps per revolution leave points without samples. Use the previous point
+	for(i = 0; i < 2 * (int16_t)ENCODERCALPOINTS; i++)
+	{
+		point = i & (ENCODERCALPOINTS - 1);
+		if(!count[point] && count[(point - 1) & (ENCODERCALPOINTS - 1)])
+		{
+			table[point] = table[(point - 1) & (ENCODERCALPOINTS - 1)];
+			count[point] = 1;
+		}
+	}
+
+	cli();
+	for(i = 0; i < (int16_t)ENCODERCALPOINTS; i++)
+	{
+		this->encoder.calibrationTable[i] = table[i];
+	}
+	this->encoder.calibrationEnabled = 1;
+	sei();
+	this->encoder.saveCalibration();
+
+	this->enablePid();
+
+	return 1;
+}
+
 void uStepperS::setup(	uint8_t mode, 
 						uint16_t stepsPerRevolution,
 						float pTerm, 
@@ -176,11 +423,15 @@ void uStepperS::setup(	uint8_t mode,
 						uint8_t holdCurrent)
 {
 	dropinCliSettings_t tempSettings;
+	uint16_t frequency = this->controlFrequencyRequest;
 	this->pidDisabled = 1;
 	// Should setup mode etc. later
 	this->mode = mode;
-	this->fullSteps = stepsPerRevolution;
+	this->controller.reset();
 	this->dropinStepSize = 256/dropinStepSize;
+	this->updateStepIncrement();
+#if !MOTORFULLSTEPS
+	this->fullSteps = stepsPerRevolution;
 	this->angleToStep = (float)this->fullSteps * (float)this->microSteps / 360.0;
 	this->rpmToVelocity = (float)(279620.267 * fullSteps * microSteps)/(CLOCKFREQ);
 	this->stepsPerSecondToRPM = 60.0/(this->microSteps*this->fullSteps);
@@ -190,7 +441,18 @@ void uStepperS::setup(	uint8_t mode,
 	this->stepTime = 16777216.0/CLOCKFREQ; // 2^24/CLOCKFREQ
 	this->rpmToVel = (this->fullSteps*this->microSteps)/(60.0/this->stepTime);
 	this->velToRpm = 1.0/this->rpmToVel;
+#endif
+
+	if(this->mode == DROPIN)
+	{
+		this->controlFrequencyBase = ENCODERINTFREQ;
+	}
+	else
+	{
+		this->controlFrequencyBase = ENCODERINTFREQ*2;
+	}
 
+	// Runs at the current rate until setControlFrequency() below, which rescales everything set meanwhile
 	this->init();
 
 	this->driver.setDeceleration( (uint32_t)( this->maxDeceleration ) );
@@ -202,13 +464,13 @@ void uStepperS::setup(	uint8_t mode,
 	this->setCurrent(40.0);
 	this->setHoldCurrent(0.0);	
 
-	this->encoder.Beta=5;
+	this->encoderBetaBase = 5;
 	if(this->mode)
 	{
 		if(this->mode == DROPIN)
 		{
 			//Set Enable, Step and Dir signal pins from 3dPrinter controller as inputs
-			this->encoder.Beta = 2;
+			this->encoderBetaBase = 2;
 			pinMode(2,INPUT);		
 			pinMode(3,INPUT);
 			pinMode(4,INPUT);
@@ -217,8 +479,20 @@ void uStepperS::setup(	uint8_t mode,
 			digitalWrite(3,HIGH);
 			digitalWrite(4,HIGH);
 			delay(10000);
+			//Timer3 runs free at CLOCKFREQ/8, to timestamp the step edges
+			TIMSK3 = 0;
+			TCCR3A = 0;
+			TCCR3C = 0;
+			TCCR3B = (1 << CS31);
+#if DROPINFASTSTEPISR
+			//INT0 on falling edges, INT1 on any change
+			EICRA = (1 << ISC01) | (1 << ISC10);
+			EIFR = (1 << INTF0) | (1 << INTF1);
+			EIMSK = (1 << INT0) | (1 << INT1);
+#else
 			attachInterrupt(0, interrupt0, FALLING);
 			attachInterrupt(1, interrupt1, CHANGE);
+#endif
 			this->driver.setDeceleration( 0xFFFE );
 			this->driver.setAcceleration( 0xFFFE );
 			Serial.begin(9600);
@@ -254,10 +528,14 @@ void uStepperS::setup(	uint8_t mode,
 		}		
 		else
 		{
-			this->encoder.Beta = 4; 
+			this->encoderBetaBase = 4; 
 		}
 	}
 
+	// A rate set before setup() is kept, otherwise the default rate of the mode is used
+	this->setControlFrequency(frequency ? frequency : this->controlFrequencyBase);
+	this->controlFrequencyRequest = frequency;
+
 	if(setHome == true){
 		encoder.setHome();
 	}
@@ -280,185 +558,957 @@ void uStepperS::moveSteps( int32_t steps )
 
 
 
-void uStepperS::moveAngle( float angle )
+bool uStepperS::queueMove( int32_t steps, bool blend )
 {
-	int32_t steps;
-
-	if(angle < 0.0)
-	{
-		steps = (int32_t)((angle * angleToStep) - 0.5);
-		this->moveSteps( steps ); 
-	}
-	else
-	{
-		steps = (int32_t)((angle * angleToStep) + 0.5);
-		this->moveSteps( steps );
-	}
+	return this->queueSegment(steps, this->maxVelocity, this->maxAcceleration, this->maxDeceleration, blend);
 }
 
-
-void uStepperS::moveToAngle( float angle )
+bool uStepperS::queueMove( int32_t steps, float velocity, float acceleration, float deceleration, bool blend )
 {
-	float diff;
-	int32_t steps;
+	velocity = abs(velocity) * ((float)this->microSteps * VELOCITYCONVERSION);
+	acceleration = abs(acceleration) * ((float)this->microSteps * ACCELERATIONCONVERSION);
+	deceleration = abs(deceleration) * ((float)this->microSteps * ACCELERATIONCONVERSION);
 
-	diff = angle - this->angleMoved();
-	steps = (int32_t)( (abs(diff) * angleToStep) + 0.5);
+	return this->queueSegment(steps, velocity, acceleration, deceleration, blend);
+}
 
-	if(diff < 0.0)
+bool uStepperS::queueSegment( int32_t steps, float velocity, float acceleration, float deceleration, bool blend )
+{
+	motionSegment_t *segment;
+	uint8_t sreg = SREG;
+
+	cli();
+	if(this->motionQueueCount >= MOTIONQUEUESIZE)
 	{
-		this->moveSteps( -steps );
+		SREG = sreg;
+		return 0;
 	}
-	else
+
+	// Relative to the last queued move, or to the current target when nothing is queued
+	if(!this->motionQueueBusy && this->motionQueueCount == 0)
 	{
-		this->moveSteps( steps );
+		this->motionQueueEnd = this->driver.xTarget;
 	}
+	this->motionQueueEnd += steps;
+
+	segment = &this->motionQueue[(this->motionQueueHead + this->motionQueueCount) % MOTIONQUEUESIZE];
+	segment->target = this->motionQueueEnd;
+	segment->velocity = constrain(velocity, 0.0, (float)0x7FFE00);
+	segment->acceleration = constrain(acceleration, 1.0, (float)0xFFFE);
+	segment->deceleration = constrain(deceleration, 1.0, (float)0xFFFE);
+	segment->blend = blend;
+	this->motionQueueCount++;
+	SREG = sreg;
+
+	return 1;
 }
 
-void uStepperS::enableStallguard( int8_t threshold, bool stopOnStall, float rpm )
+uint8_t uStepperS::getQueueLength( void )
 {
-	this->clearStall();
-	this->stallThreshold = threshold;
-	this->stallStop = stopOnStall;
+	uint8_t length;
+	uint8_t sreg = SREG;
 
-	pointer->driver.enableStallguard( threshold, stopOnStall, rpm);
+	cli();
+	length = this->motionQueueCount + this->motionQueueBusy;
+	SREG = sreg;
 
-	this->stallEnabled = true;
+	return length;
 }
 
-void uStepperS::disableStallguard( void )
+void uStepperS::clearQueue( void )
 {
-	pointer->driver.disableStallguard();
+	uint8_t sreg = SREG;
 
-	this->stallEnabled = false;
+	cli();
+	this->motionQueueCount = 0;
+	SREG = sreg;
 }
 
-void uStepperS::clearStall( void ) 
+void uStepperS::motionQueueService( int32_t position, int32_t velocity )
 {
-	pointer->driver.clearStall();
-}
+	motionSegment_t *segment;
+	int32_t remaining;
 
-bool uStepperS::isStalled( void )
-{
-	return this->isStalled( this->stallThreshold );
-}
+	if(this->motionQueueCount == 0)
+	{
+		if(this->motionQueueBusy && velocity == 0 && position == this->driver.xTarget)
+		{
+			this->motionQueueBusy = 0;
+		}
+		return;
+	}
 
-bool uStepperS::isStalled( int8_t threshold )
-{	
-	// If the threshold is different from what is configured..
-	if( threshold != this->stallThreshold || this->stallEnabled == false ){
-		// Reconfigure stallguard
-		this->enableStallguard( threshold, this->stallStop, 10 );
+	segment = &this->motionQueue[this->motionQueueHead];
+
+	if(this->motionQueueBusy)
+	{
+		remaining = this->driver.xTarget - position;
+
+		if(velocity == 0 && remaining == 0)
+		{
+			// Previous move completed
+		}
+		else if(segment->blend && velocity != 0 && ((velocity > 0) == (segment->target > this->driver.xTarget)) && ((velocity > 0) == (remaining > 0)))
+		{
+			// Start the next move before the ramp decelerates
+			if((uint32_t)abs(remaining) > this->brakingDistance(abs(velocity)))
+			{
+				return;
+			}
+		}
+		else
+		{
+			return;
+		}
 	}
 
-	int32_t stats = pointer->driver.readRegister(RAMP_STAT);
+	this->driver.setDeceleration(segment->deceleration);
+	this->driver.setAcceleration(segment->acceleration);
+	this->driver.setVelocity(segment->velocity);
+	this->driver.setPosition(segment->target);
 
-	// Only interested in 'status_sg', with bit position 13 (last bit in RAMP_STAT).
-	return ( stats >> 13 );
+	this->motionQueueHead = (this->motionQueueHead + 1) % MOTIONQUEUESIZE;
+	this->motionQueueCount--;
+	this->motionQueueBusy = 1;
 }
 
-void uStepperS::setBrakeMode( uint8_t mode, float brakeCurrent )
+int8_t uStepperS::pvtPush( int32_t position, float velocity, uint16_t time )
 {
-	int32_t registerContent = this->driver.readRegister(PWMCONF);
-	registerContent &= ~(3UL << 20);
-	if(mode == FREEWHEELBRAKE)
+	pvtPoint_t *point;
+	float ticks;
+	int32_t previousPosition;
+	int32_t previousVelocity;
+	int64_t span;
+	uint8_t sreg = SREG;
+
+	ticks = constrain((float)time * this->controlFrequency / 1000.0 + 0.5, 1.0, 65535.0);
+	velocity = constrain(velocity * this->controlPeriod * 65536.0, -2147483520.0, 2147483520.0);
+
+	cli();
+	if(this->pvtCount >= PVTBUFFERSIZE)
 	{
-		this->setHoldCurrent(0.0);
-		this->driver.writeRegister( PWMCONF, PWM_AUTOSCALE(1) | PWM_GRAD(1) | PWM_AMPL(128) | PWM_FREQ(0) | FREEWHEEL(1) ); 
+		SREG = sreg;
+		return 0;
 	}
-	else if(mode == COOLBRAKE)
+
+	// The segment starts at the last point, the end of the segment being executed, or the 
+	// current position at standstill
+	if(this->pvtCount)
 	{
-		this->setHoldCurrent(0.0);
-		this->driver.writeRegister( PWMCONF, PWM_AUTOSCALE(1) | PWM_GRAD(1) | PWM_AMPL(128) | PWM_FREQ(0) | FREEWHEEL(2) );  
+		point = &this->pvtBuffer[(this->pvtHead + this->pvtCount - 1) % PVTBUFFERSIZE];
+		previousPosition = point->position;
+		previousVelocity = point->velocity;
+	}
+	else if(this->pvtActive)
+	{
+		previousPosition = this->pvtStart + this->pvtDistance;
+		previousVelocity = this->pvtVelocity;
 	}
 	else
 	{
-		this->setHoldCurrent(brakeCurrent);
-		this->driver.writeRegister( PWMCONF, PWM_AUTOSCALE(1) | PWM_GRAD(1) | PWM_AMPL(128) | PWM_FREQ(0) | FREEWHEEL(0) ); 
+		previousPosition = this->driver.xActual - this->driver.positionOffset;
+		previousVelocity = 0;
 	}
-}
 
-void uStepperS::setRPM( float rpm)
-{
-	int32_t velocityDir = rpmToVelocity * rpm;
+	// The velocity terms of the Hermite curve reach at most 4/27 of velocity times duration
+	span = abs((int64_t)position - previousPosition);
+	span += ((abs((int64_t)previousVelocity * (uint16_t)ticks) + abs((int64_t)velocity * (uint16_t)ticks)) >> 16) / 6;
 
-	if(velocityDir > 0){
-		driver.setDirection(1);
-	}else{
-		driver.setDirection(0);
+	if(span > PVTSEGMENTMAX)
+	{
+		SREG = sreg;
+		return -1;
 	}
 
-	// The velocity cannot be signed
-	uint32_t velocity = abs(velocityDir);
+	point = &this->pvtBuffer[(this->pvtHead + this->pvtCount) % PVTBUFFERSIZE];
+	point->position = position;
+	point->velocity = (int32_t)velocity;
+	point->ticks = (uint16_t)ticks;
+	this->pvtCount++;
+	this->pvtCleared = 0;
+	SREG = sreg;
 
-	driver.setVelocity( (uint32_t)velocity );
+	return 1;
 }
 
+uint8_t uStepperS::getPvtLength( void )
+{
+	return this->pvtCount;
+}
 
-void uStepperS::setSPIMode( uint8_t mode ){
+uint16_t uStepperS::getPvtUnderruns( void )
+{
+	uint16_t underruns;
+	uint8_t sreg = SREG;
 
-	switch(mode){
-		case 2:
-			SPCR1 |= (1<<CPOL1);  // Set CPOL HIGH = 1
-			SPCR1 &= ~(1<<CPHA1);  // Set CPHA LOW = 0
-		break;
+	cli();
+	underruns = this->pvtUnderruns;
+	SREG = sreg;
 
-		case 3:
-			SPCR1 |= (1<<CPOL1);  // Set CPOL HIGH = 1
-			SPCR1 |= (1<<CPHA1);  // Set CPHA HIGH = 1
-		break;
-	}
+	return underruns;
 }
 
-uint8_t uStepperS::SPI(uint8_t data){
-
-	SPDR1 = data;
-
-	// Wait for transmission complete
-	while(!( SPSR1 & (1 << SPIF1) ));    
+bool uStepperS::isPvtRunning( void )
+{
+	return this->pvtActive;
+}
 
-	return SPDR1;
+void uStepperS::clearPvt( void )
+{
+	uint8_t sreg = SREG;
 
+	cli();
+	this->pvtCount = 0;
+	this->pvtCleared = 1;
+	SREG = sreg;
 }
 
-void uStepperS::setMaxVelocity( float velocity )
+void uStepperS::pvtService( int32_t position )
 {
-	velocity *= (float)this->microSteps;
-	velocity = abs(velocity)*VELOCITYCONVERSION;
+	pvtPoint_t *point;
+	int32_t s, s2, s3;
+	int32_t reference;
+	int32_t speed;
 
-	this->maxVelocity = velocity;
+	if(!this->pvtActive || this->pvtTick >= this->pvtTicks)
+	{
+		if(this->pvtActive)
+		{
+			// Continue from the end of the completed segment
+			this->pvtStart += this->pvtDistance;
+			this->pvtReference -= this->pvtDistance << 8;
 
-	// Steps per second, has to be converted to microsteps
-	this->driver.setVelocity( (uint32_t)( this->maxVelocity  ) );
-}
+			if(this->pvtCount == 0)
+			{
+				if(this->pvtVelocity != 0 && !this->pvtCleared)
+				{
+					this->pvtUnderruns++;
+				}
 
-void uStepperS::setMaxAcceleration( float acceleration )
-{
-	acceleration *= (float)this->microSteps;
-	acceleration = abs(acceleration) * ACCELERATIONCONVERSION;
+				// Hold the last point. The ramp generator brakes if the motor is still moving
+				this->pvtActive = 0;
+				this->driver.setPosition(this->pvtStart);
+				return;
+			}
+		}
+		else
+		{
+			// Start from standstill at the current position
+			this->pvtStart = position;
+			this->pvtReference = 0;
+			this->pvtVelocity = 0;
+			this->pvtActive = 1;
+		}
 
-	this->maxAcceleration = acceleration;
+		point = &this->pvtBuffer[this->pvtHead];
+		this->pvtTicks = point->ticks;
+		this->pvtTick = 0;
+		this->pvtDistance = point->position - this->pvtStart;
+		this->pvtSlopeStart = fixMul(this->pvtVelocity, this->pvtTicks, 16);
+		this->pvtSlopeEnd = fixMul(point->velocity, this->pvtTicks, 16);
+		this->pvtVelocity = point->velocity;
 
-	
-	// Steps per second, has to be converted to microsteps
-	this->driver.setAcceleration( (uint32_t)(this->maxAcceleration ) );
+		this->pvtHead = (this->pvtHead + 1) % PVTBUFFERSIZE;
+		this->pvtCount--;
+	}
+
+	// Reference at the end of this tick, from the Hermite basis functions of s = tick / ticks, Q16.16
+	this->pvtTick++;
+	s = ((uint32_t)this->pvtTick << 16) / this->pvtTicks;
+	s2 = fixMul(s, s, 16);
+	s3 = fixMul(s2, s, 16);
+
+	reference = fixMul(this->pvtDistance, 3 * s2 - 2 * s3, 8);
+	reference += fixMul(this->pvtSlopeStart, s3 - 2 * s2 + s, 8);
+	reference += fixMul(this->pvtSlopeEnd, s3 - s2, 8);
+
+	// Feedforward of the reference velocity, plus half of the position error at the start of the tick
+	speed = (reference - this->pvtReference) + ((this->pvtReference - ((position - this->pvtStart) << 8)) >> 1);
+	this->pvtReference = reference;
+
+	speed = fixMul(speed, this->pvtVelocityGain, 24);
+
+	this->driver.mode = DRIVER_VELOCITY;
+	this->driver.writeRegister(RAMPMODE, (speed >= 0) ? VELOCITY_MODE_POS : VELOCITY_MODE_NEG);
+	this->driver.writeRegister(VMAX_REG, min((uint32_t)abs(speed), 0x7FFE00UL));
 }
 
-void uStepperS::setMaxDeceleration( float deceleration )
+uint32_t uStepperS::stopDeceleration( uint32_t speed, uint32_t distance )
 {
-	deceleration *= (float)this->microSteps;
-	deceleration = abs(deceleration) * ACCELERATIONCONVERSION;
-	
-	this->maxDeceleration = deceleration;
-	
-	// Steps per second, has to be converted to microsteps
-	this->driver.setDeceleration( (uint32_t)(this->maxDeceleration ) );
+	uint32_t square;
+
+	// VACTUAL^2 / (256 * distance), rounded up. Full resolution while (VACTUAL / 256)^2 fits in 24 bits
+	square = ((speed >> 8) + 1) * ((speed >> 8) + 1);
+
+	if(square < (1UL << 24))
+	{
+		return (square << 8) / distance + 1;
+	}
+
+	return (square / distance + 1) << 8;
 }
 
-void uStepperS::setCurrent( double current )
+uint32_t uStepperS::brakingDistance( uint32_t speed )
 {
-	if( current <= 100.0 && current >= 0.0){
-		// The current needs to be in the range of 0-31
+	uint32_t distance;
+	uint32_t square;
+
+	// VACTUAL^2 / (256 * DMAX) microsteps at constant deceleration, rounded up
+	square = ((speed >> 8) + 1) * ((speed >> 8) + 1);
+
+	if(square < (1UL << 24))
+	{
+		distance = (square << 8) / this->driver.DMAX;
+	}
+	else
+	{
+		distance = (square / this->driver.DMAX) << 8;
+	}
+
+	if(this->jerkStep)
+	{
+		// Ramping the deceleration up and down at the jerk limit takes DMAX / jerk longer, 
+		// at half the speed on average
+		if(this->driver.DMAX != this->jerkDecelDmax)
+		{
+			this->jerkDecelDmax = this->driver.DMAX;
+			this->jerkDecelTicks = ((uint32_t)this->jerkDecelDmax << 15) / this->jerkStep;
+		}
+
+		distance += fixMul(fixMul(speed, ICR1, 24), this->jerkDecelTicks, 16);
+
+		// The shaped deceleration has no DMAX to spare for catching up, so start a bit early
+		distance += distance >> 4;
+	}
+
+	// Travel until the next control tick can react
+	distance += fixMul(speed, (int32_t)ICR1 * MOTIONBLENDTICKS, 24);
+
+	return distance;
+}
+
+uint16_t uStepperS::jerkShape( uint16_t accel, uint16_t limit, uint32_t speedChange )
+{
+	uint64_t threshold;
+	uint32_t next;
+	uint32_t stepChange;
+
+	// Ramping the acceleration from accel to zero at the jerk limit changes the speed by 
+	// (accel^2 + accel * jerk) / (2 * jerk) per tick, in register units. Only step up if 
+	// the speed change left allows ramping down from the next value
+	threshold = ((uint64_t)this->jerkStep * speedChange * this->jerkTaperGain) >> 16;
+
+	if(accel > (uint32_t)limit + this->jerkStep)
+	{
+		next = accel - this->jerkStep;
+	}
+	else
+	{
+		next = min((uint32_t)accel + this->jerkStep, (uint32_t)limit);
+	}
+
+	if((uint64_t)next * (next + this->jerkStep) > threshold)
+	{
+		next = accel;
+
+		if((uint64_t)accel * (accel + this->jerkStep) > threshold)
+		{
+			next = (accel > 2 * this->jerkStep) ? accel - this->jerkStep : this->jerkStep;
+		}
+	}
+
+	// Speed change of one jerk step within a tick, in VACTUAL units
+	stepChange = fixMul(this->jerkStep, ICR1, 17);
+
+	if((uint32_t)fixMul(next, ICR1, 17) >= speedChange && speedChange > stepChange)
+	{
+		// The ramp would reach the target within this tick, and the acceleration would drop 
+		// to zero by more than the limit at the next. Leave one jerk step for that tick
+		next = ((speedChange - stepChange) << 17) / ICR1;
+	}
+
+	return next;
+}
+
+void uStepperS::jerkUpdate( int32_t position, int32_t velocity )
+{
+	uint32_t speed = abs(velocity);
+	uint32_t target;
+	uint32_t peak;
+	uint32_t ticks;
+	uint32_t change;
+	int32_t remaining;
+	int32_t distance;
+	int32_t tail;
+	uint32_t required;
+	bool negative;
+	bool rising;
+
+	if(this->driver.mode == DRIVER_VELOCITY)
+	{
+		// AMAX is used for both speeding up and slowing down in velocity mode
+		negative = (this->driver.readRegister(RAMPMODE) == VELOCITY_MODE_NEG);
+
+		if(negative)
+		{
+			velocity = -velocity;
+		}
+
+		target = this->driver.VMAX;
+		change = (velocity >= 0 && (uint32_t)velocity > target) ? velocity - target : target - velocity;
+		rising = (velocity < (int32_t)target) != negative;
+
+		if(change == 0 || rising != this->jerkRising)
+		{
+			// The speed is at its target, or the acceleration changes sign. AMAX is 
+			// only a magnitude, so the shaped acceleration starts over from zero
+			this->jerkRising = rising;
+			this->jerkAccel = 0;
+		}
+
+		this->jerkAccel = this->jerkShape(this->jerkAccel, this->driver.AMAX, change);
+		this->driver.writeRegister(AMAX_REG, this->jerkAccel);
+		this->jerkDecelerating = 0;
+		return;
+	}
+
+	remaining = this->driver.xTarget - position;
+
+	if(this->driver.xTarget != this->jerkTarget)
+	{
+		this->jerkTarget = this->driver.xTarget;
+		this->jerkDecelerating = 0;
+	}
+
+	if(!this->jerkDecelerating)
+	{
+		if(speed == 0 || (velocity > 0) != (remaining > 0) || (uint32_t)abs(remaining) > this->brakingDistance(speed))
+		{
+			// Speeding up or cruising. The ramp generator brakes with the unshaped DMAX if it 
+			// has to, e.g. when the move is reversed
+			change = (speed > this->driver.VMAX) ? speed - this->driver.VMAX : this->driver.VMAX - speed;
+
+			if(speed == 0 || change == 0)
+			{
+				// Standing still or cruising, so the acceleration starts over from zero
+				this->jerkAccel = 0;
+			}
+
+			if(speed < this->driver.VMAX && (velocity > 0) == (remaining > 0))
+			{
+				// Ramping the acceleration down adds to the speed. On short moves, do that in 
+				// time for the deceleration to start from zero acceleration
+				ticks = ((uint32_t)this->jerkAccel << 8) / this->jerkStep;
+				peak = speed + fixMul(fixMul((uint32_t)this->jerkAccel + this->jerkStep, ticks, 8), ICR1, 18);
+
+				if((uint32_t)abs(remaining) <= this->brakingDistance(peak) + fixMul(fixMul(peak, ICR1, 24), ticks, 8))
+				{
+					change = 0;
+				}
+			}
+
+			this->jerkAccel = this->jerkShape(this->jerkAccel, this->driver.AMAX, change);
+			this->driver.writeRegister(AMAX_REG, this->jerkAccel);
+			this->driver.writeRegister(DMAX_REG, this->driver.DMAX);
+			this->driver.writeRegister(VMAX_REG, this->driver.VMAX);
+			return;
+		}
+
+		this->jerkDecelerating = 1;
+		this->jerkDecel = 0;
+	}
+
+	if(remaining == 0 || (velocity > 0) != (remaining > 0) || speed <= JERKMINVELOCITY)
+	{
+		// The ramp generator completes the move at the last DMAX
+		return;
+	}
+
+	// Deceleration needed to stop at the target from where the ramp is at the next tick. 
+	// DMAX never goes below this (with a margin), so the ramp generator can not overshoot
+	distance = abs(remaining) - fixMul(speed, ICR1, 24);
+
+	if(distance <= 0)
+	{
+		return;
+	}
+
+	required = this->stopDeceleration(speed, distance);
+	required = min(required + (required >> 3), 0xFFFEUL);
+
+	if(this->jerkAccel)
+	{
+		// Finish ramping the acceleration down before slowing down
+		this->jerkAccel = (this->jerkAccel > this->jerkStep) ? this->jerkAccel - this->jerkStep : 0;
+		this->driver.writeRegister(AMAX_REG, this->jerkAccel);
+		this->driver.writeRegister(DMAX_REG, required);
+		return;
+	}
+
+	// Ramping the deceleration to zero at the end takes decel^3 / (24 * jerk^2) further 
+	// than stopping at constant deceleration
+	ticks = min((uint32_t)(this->jerkDecel / this->jerkStep), 1023UL);
+	tail = fixMul((uint32_t)this->jerkDecel * ticks, ((uint32_t)ICR1 * ICR1) >> 8, 33) * ticks / 24;
+
+	target = (distance > tail) ? this->stopDeceleration(speed, distance - tail) : this->driver.DMAX;
+	target = constrain(target, (uint32_t)this->jerkStep, this->driver.DMAX);
+
+	// Only ramp the deceleration down when that does not fall behind the target
+	this->jerkDecel = this->jerkShape(this->jerkDecel, target, (target <= this->jerkDecel) ? speed : 0xFFFFFFFF);
+
+	// The speed of the next control tick is set by VMAX. DMAX only decides how quickly the 
+	// ramp generator gets there within the tick
+	target = speed - (uint32_t)fixMul(this->jerkDecel, ICR1, 17);
+
+	if((int32_t)target < JERKMINVELOCITY)
+	{
+		target = JERKMINVELOCITY;
+	}
+
+	this->driver.writeRegister(DMAX_REG, max(required, (uint32_t)this->jerkDecel));
+	this->driver.writeRegister(VMAX_REG, target);
+}
+
+void uStepperS::moveAngle( float angle )
+{
+	int32_t steps;
+
+	if(angle < 0.0)
+	{
+		steps = (int32_t)((angle * angleToStep) - 0.5);
+		this->moveSteps( steps ); 
+	}
+	else
+	{
+		steps = (int32_t)((angle * angleToStep) + 0.5);
+		this->moveSteps( steps );
+	}
+}
+
+
+void uStepperS::moveToAngle( float angle )
+{
+	float diff;
+	int32_t steps;
+
+	diff = angle - this->angleMoved();
+	steps = (int32_t)( (abs(diff) * angleToStep) + 0.5);
+
+	if(diff < 0.0)
+	{
+		this->moveSteps( -steps );
+	}
+	else
+	{
+		this->moveSteps( steps );
+	}
+}
+
+void uStepperS::enableStallguard( int8_t threshold, bool stopOnStall, float rpm )
+{
+	this->clearStall();
+	this->stallThreshold = threshold;
+	this->stallStop = stopOnStall;
+
+	pointer->driver.enableStallguard( threshold, stopOnStall, rpm);
+
+	this->stallEnabled = true;
+}
+
+void uStepperS::disableStallguard( void )
+{
+	pointer->driver.disableStallguard();
+
+	this->stallEnabled = false;
+}
+
+void uStepperS::clearStall( void ) 
+{
+	pointer->driver.clearStall();
+}
+
+bool uStepperS::isStalled( void )
+{
+	return this->isStalled( this->stallThreshold );
+}
+
+void uStepperS::enableEncoderStallDetect(float tolerance, float hysteresis, uint8_t window, float minimumRpm)
+{
+	tolerance = constrain(tolerance, 0.0, 255.0);
+	hysteresis = constrain(hysteresis, 0.0, tolerance);
+
+	this->stallDetectMinimumRpm = minimumRpm;
+	// Q16.16 encoder counts per control tick
+	this->stallDetector.configure(tolerance * 256.0, hysteresis * 256.0, window, FLOATTOFIX(minimumRpm * 65536.0 / 60.0 * this->controlPeriod, FIXSHIFT));
+}
+
+void uStepperS::disableEncoderStallDetect( void )
+{
+	this->stallDetector.disable();
+}
+
+void uStepperS::encoderStallDetectLegacy(void)
+{
+	float sensitivity;
+
+	// Maps the deprecated encoderStallDetect* fields of the encoder onto the stall detector
+	if(this->encoder.encoderStallDetectEnable)
+	{
+		sensitivity = this->encoder.encoderStallDetectSensitivity;
+		if(!this->stallDetectLegacyEnabled || sensitivity != this->stallDetectLegacySensitivity)
+		{
+			this->stallDetectLegacyEnabled = 1;
+			this->stallDetectLegacySensitivity = sensitivity;
+			this->enableEncoderStallDetect(-sensitivity, 0.0);
+		}
+		this->encoder.encoderStallDetect = this->stallDetector.isStalled();
+	}
+	else if(this->stallDetectLegacyEnabled)
+	{
+		this->stallDetectLegacyEnabled = 0;
+		this->encoder.encoderStallDetect = 0;
+		this->disableEncoderStallDetect();
+	}
+}
+
+bool uStepperS::isEncoderStalled( void )
+{
+	return this->stallDetector.isStalled();
+}
+
+void uStepperS::setEncoderStallCallback( void (*callback)(bool stalled) )
+{
+	this->stallDetector.setCallback(callback);
+}
+
+bool uStepperS::isStalled( int8_t threshold )
+{	
+	// If the threshold is different from what is configured..
+	if( threshold != this->stallThreshold || this->stallEnabled == false ){
+		// Reconfigure stallguard
+		this->enableStallguard( threshold, this->stallStop, 10 );
+	}
+
+	if(pointer->driver.lastStatusValid())
+	{
+		return (pointer->driver.getLastStatus() & STALLGUARD2) ? 1 : 0;
+	}
+
+	int32_t stats = pointer->driver.readRegister(RAMP_STAT);
+
+	// Only interested in 'status_sg', with bit position 13 (last bit in RAMP_STAT).
+	return ( stats >> 13 );
+}
+
+void uStepperS::setBrakeMode( uint8_t mode, float brakeCurrent )
+{
+	if(mode == FREEWHEELBRAKE)
+	{
+		this->setHoldCurrent(0.0);
+		this->driver.writeRegister( PWMCONF, PWM_AUTOSCALE(1) | PWM_GRAD(1) | PWM_AMPL(128) | PWM_FREQ(0) | FREEWHEEL(1) ); 
+	}
+	else if(mode == COOLBRAKE)
+	{
+		this->setHoldCurrent(0.0);
+		this->driver.writeRegister( PWMCONF, PWM_AUTOSCALE(1) | PWM_GRAD(1) | PWM_AMPL(128) | PWM_FREQ(0) | FREEWHEEL(2) );  
+	}
+	else
+	{
+		this->setHoldCurrent(brakeCurrent);
+		this->driver.writeRegister( PWMCONF, PWM_AUTOSCALE(1) | PWM_GRAD(1) | PWM_AMPL(128) | PWM_FREQ(0) | FREEWHEEL(0) ); 
+	}
+}
+
+void uStepperS::setRPM( float rpm)
+{
+	int32_t velocityDir = rpmToVelocity * rpm;
+
+	if(velocityDir > 0){
+		driver.setDirection(1);
+	}else{
+		driver.setDirection(0);
+	}
+
+	// The velocity cannot be signed
+	uint32_t velocity = abs(velocityDir);
+
+	driver.setVelocity( (uint32_t)velocity );
+}
+
+
+void uStepperS::setSPIMode( uint8_t mode ){
+
+	switch(mode){
+		case 2:
+			SPCR1 |= (1<<CPOL1);  // Set CPOL HIGH = 1
+			SPCR1 &= ~(1<<CPHA1);  // Set CPHA LOW = 0
+		break;
+
+		case 3:
+			SPCR1 |= (1<<CPOL1);  // Set CPOL HIGH = 1
+			SPCR1 |= (1<<CPHA1);  // Set CPHA HIGH = 1
+		break;
+	}
+}
+
+void uStepperS::spiSelect( spiTransaction_t *transaction, bool state )
+{
+	if(state)
+		transaction->selectTime = TCNT1;
+
+	if(state == transaction->csActiveHigh)
+		*transaction->csPort |= transaction->csMask;
+	else
+		*transaction->csPort &= ~transaction->csMask;
+
+	if(transaction->strobePort)
+	{
+		if(state)
+			*transaction->strobePort |= transaction->strobeMask;
+		else
+			*transaction->strobePort &= ~transaction->strobeMask;
+	}
+}
+
+void uStepperS::spiStart( spiTransaction_t *transaction )
+{
+	this->spiByteIndex = 0;
+	this->setSPIMode(transaction->spiMode);
+	this->spiSelect(transaction, true);
+
+	SPCR1 |= (1 << SPIE1);
+	SPDR1 = transaction->txBuffer ? transaction->txBuffer[0] : 0x00;
+}
+
+void uStepperS::spiService( void )
+{
+	spiTransaction_t *transaction = this->spiQueue[this->spiQueueHead];
+	uint8_t data = SPDR1;
+
+	if(transaction->rxBuffer)
+	{
+		transaction->rxBuffer[this->spiByteIndex] = data;
+	}
+
+	if(++this->spiByteIndex < transaction->length)
+	{
+		SPDR1 = transaction->txBuffer ? transaction->txBuffer[this->spiByteIndex] : 0x00;
+		return;
+	}
+
+	this->spiSelect(transaction, false);
+
+	this->spiQueueHead = (this->spiQueueHead + 1) % SPIQUEUESIZE;
+	this->spiQueueCount--;
+	transaction->done = 1;
+
+	if(transaction->callback)
+	{
+		transaction->callback(transaction);
+	}
+
+	if(this->spiQueueCount)
+	{
+		this->spiStart(this->spiQueue[this->spiQueueHead]);
+	}
+	else
+	{
+		SPCR1 &= ~(1 << SPIE1);
+		this->spiBusy = 0;
+	}
+}
+
+bool uStepperS::spiSubmit(spiTransaction_t *transaction)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	if(this->spiQueueCount >= SPIQUEUESIZE)
+	{
+		SREG = sreg;
+		return 0;
+	}
+
+	transaction->done = 0;
+	this->spiQueue[(this->spiQueueHead + this->spiQueueCount) % SPIQUEUESIZE] = transaction;
+	this->spiQueueCount++;
+
+	if(!this->spiBusy)
+	{
+		this->spiBusy = 1;
+		this->spiStart(transaction);
+	}
+	SREG = sreg;
+
+	return 1;
+}
+
+void uStepperS::spiPoll(void)
+{
+	// With interrupts disabled the SPI1 interrupt can not run, so service the engine from here
+	if(!(SREG & (1 << SREG_I)) && (SPSR1 & (1 << SPIF1)))
+	{
+		this->spiService();
+	}
+}
+
+void uStepperS::spiSubmitWait(spiTransaction_t *transaction)
+{
+	while(!this->spiSubmit(transaction))
+	{
+		this->spiPoll();
+	}
+}
+
+void uStepperS::spiWait(spiTransaction_t *transaction)
+{
+	while(!transaction->done)
+	{
+		this->spiPoll();
+	}
+}
+
+void uStepperS::spiTransfer(spiTransaction_t *transaction)
+{
+	uint8_t sreg = SREG;
+	uint8_t timsk;
+	uint8_t i;
+	uint8_t data;
+
+	cli();
+	if(this->spiBusy)
+	{
+		SREG = sreg;
+		this->spiSubmitWait(transaction);
+		this->spiWait(transaction);
+		return;
+	}
+
+	// Bus is idle. Claim it and clock the bytes directly, which is cheaper than an interrupt per byte.
+	// The control interrupt reads the encoder through here, so it is masked until the bus is handed
+	// back. Otherwise it would queue behind this transfer and wait for it forever
+	this->spiBusy = 1;
+	timsk = TIMSK1;
+	TIMSK1 &= ~(1 << OCIE1A);
+	SREG = sreg;
+
+	transaction->done = 0;
+	this->setSPIMode(transaction->spiMode);
+	this->spiSelect(transaction, true);
+
+	for(i = 0; i < transaction->length; i++)
+	{
+		SPDR1 = transaction->txBuffer ? transaction->txBuffer[i] : 0x00;
+
+		// Wait for transmission complete
+		while(!( SPSR1 & (1 << SPIF1) ));
+
+		data = SPDR1;
+		if(transaction->rxBuffer)
+		{
+			transaction->rxBuffer[i] = data;
+		}
+	}
+
+	this->spiSelect(transaction, false);
+	transaction->done = 1;
+
+	if(transaction->callback)
+	{
+		transaction->callback(transaction);
+	}
+
+	// Hand the bus to the engine, if transactions were queued while it was claimed
+	cli();
+	if(this->spiQueueCount)
+	{
+		this->spiStart(this->spiQueue[this->spiQueueHead]);
+	}
+	else
+	{
+		this->spiBusy = 0;
+	}
+	TIMSK1 = timsk;
+	SREG = sreg;
+}
+
+bool uStepperS::spiIdle(void)
+{
+	return !this->spiBusy;
+}
+
+void SPI1_STC_vect(void)
+{
+	pointer->spiService();
+}
+
+void uStepperS::setMaxVelocity( float velocity )
+{
+	velocity = abs(velocity) * ((float)this->microSteps * VELOCITYCONVERSION);
+
+	this->maxVelocity = velocity;
+
+	// Steps per second, has to be converted to microsteps
+	this->driver.setVelocity( (uint32_t)( this->maxVelocity  ) );
+}
+
+void uStepperS::setMaxAcceleration( float acceleration )
+{
+	acceleration = abs(acceleration) * ((float)this->microSteps * ACCELERATIONCONVERSION);
+
+	this->maxAcceleration = acceleration;
+
+	
+	// Steps per second, has to be converted to microsteps
+	this->driver.setAcceleration( (uint32_t)(this->maxAcceleration ) );
+}
+
+void uStepperS::setMaxDeceleration( float deceleration )
+{
+	deceleration = abs(deceleration) * ((float)this->microSteps * ACCELERATIONCONVERSION);
+	
+	this->maxDeceleration = deceleration;
+	
+	// Steps per second, has to be converted to microsteps
+	this->driver.setDeceleration( (uint32_t)(this->maxDeceleration ) );
+}
+
+void uStepperS::setMaxJerk( float jerk )
+{
+	uint8_t sreg = SREG;
+
+	this->maxJerk = abs(jerk);
+
+	cli();
+	this->updateJerk();
+	SREG = sreg;
+}
+
+void uStepperS::updateJerk( void )
+{
+	float step = this->maxJerk * ((float)this->microSteps * ACCELERATIONCONVERSION) * this->controlPeriod;
+
+	if(this->maxJerk == 0.0)
+	{
+		this->jerkStep = 0;
+	}
+	else
+	{
+		this->jerkStep = constrain(step, 1.0, (float)0xFFFE);
+	}
+
+	// 2^34 / ICR1
+	this->jerkTaperGain = 17179869184.0 * this->controlFrequency / CLOCKFREQ;
+	this->jerkAccel = 0;
+	this->jerkDecelerating = 0;
+	// Recompute jerkDecelTicks
+	this->jerkDecelDmax = 0;
+}
+
+void uStepperS::setCurrent( double current )
+{
+	if( current <= 100.0 && current >= 0.0){
+		// The current needs to be in the range of 0-31
 		this->driver.current = ceil(0.31 * current); 
 	}else{
 		// If value is out of range, set default
@@ -495,56 +1545,256 @@ void uStepperS::runContinous( bool direction )
 	this->driver.setDirection( direction );
 }
 
-float uStepperS::angleMoved ( void )
+float uStepperS::angleMoved ( void )
+{
+	return this->encoder.getAngleMoved();
+}
+
+void uStepperS::stop( bool mode){
+
+	uint16_t jerkStep = this->jerkStep;
+
+	this->clearQueue();
+	this->clearPvt();
+	cli();
+	this->pvtActive = 0;
+	sei();
+
+	if(mode == HARD)
+	{
+		// Stop without shaping the deceleration
+		cli();
+		this->jerkStep = 0;
+		sei();
+
+		this->driver.setDeceleration( 0xFFFE );
+		this->driver.setAcceleration( 0xFFFE );
+		this->setRPM(0);
+		while(this->driver.readRegister(VACTUAL) != 0);
+		this->driver.setDeceleration( (uint32_t)( this->maxDeceleration ) );
+		this->driver.setAcceleration( (uint32_t)(this->maxAcceleration ) );
+	}
+	else
+	{
+		this->setRPM(0);
+		while(this->driver.readRegister(VACTUAL) != 0);
+	}
+	// Get current position
+	int32_t current = this->driver.getPosition();
+	// Set new position
+	this->driver.setPosition( current );	
+
+	cli();
+	this->jerkStep = jerkStep;
+	sei();
+}
+
+void uStepperS::filterSpeedPos(posFilter_t *filter, int32_t steps)
+{
+	filter->posEst += filter->velEst * this->controlPeriod;
+	filter->posError = (float)steps - filter->posEst;
+	filter->velIntegrator += filter->posError * this->pulseFilterKi;
+	filter->velEst = (filter->posError * PULSEFILTERKP) + filter->velIntegrator;
+}
+
+void uStepperS::updateControlGains(void)
+{
+	int32_t minimumSpeed;
+	uint8_t sreg;
+
+	this->controlPeriod = 1.0/this->controlFrequency;
+
+	// PULSEFILTERKI is given for ENCODERINTFREQ
+	this->pulseFilterKi = PULSEFILTERKI * ENCODERINTFREQ * this->controlPeriod;
+
+	// Keep the time constant of the PID differential filter designed for 0.1 at 1kHz
+	this->controller.setDifferentialFilter(1.0 - pow(0.9, ENCODERINTFREQ * this->controlPeriod));
+	this->encoder.updateTrackingGains(this->controlFrequency);
+
+	// VACTUAL is in microsteps per 2^24 clock cycles
+	this->closedLoopKvFixed = FLOATTOFIX(this->closedLoopKv * CLOCKFREQ / 16777216.0, FIXSHIFT);
+	this->closedLoopKaFixed = FLOATTOFIX(this->closedLoopKa * CLOCKFREQ / 16777216.0 * this->controlFrequency, FIXSHIFT);
+	this->closedLoopKiFixed = FLOATTOFIX(this->closedLoopKi * this->controlPeriod, FIXSHIFT);
+	this->updateJerk();
+
+	// VACTUAL * period / 2^24 microsteps per tick, times 65536/(fullSteps * microSteps) encoder 
+	// counts per microstep, in Q16.16
+	this->stallSpeedGainFixed = FLOATTOFIX(CLOCKFREQ * 256.0 / ((float)this->fullSteps * (float)this->microSteps) * this->controlPeriod, FIXSHIFT);
+	minimumSpeed = FLOATTOFIX(this->stallDetectMinimumRpm * 65536.0 / 60.0 * this->controlPeriod, FIXSHIFT);
+	sreg = SREG;
+	cli();
+	this->stallDetector.minimumSpeed = minimumSpeed;
+	// 2^40 / ICR1. ICR1 is not set yet when this is called from setup()
+	this->pvtVelocityGain = 1099511627776.0 * this->controlFrequency / CLOCKFREQ;
+	SREG = sreg;
+
+#if CONTROLFIXEDPOINT
+	this->pulseFilterKpFixed = FLOATTOFIX(PULSEFILTERKP * this->controlPeriod, 24);
+	this->pulseFilterKiFixed = FLOATTOFIX(this->pulseFilterKi * this->controlPeriod, 24);
+	this->pidVelocityFactorFixed = FLOATTOFIX(this->stepsPerSecondToRPM * 16.0 * this->rpmToVelocity, FIXSHIFT);
+#endif
+}
+
+uint16_t uStepperS::setControlFrequency(uint16_t frequency)
+{
+	float ratio;
+	int8_t betaShift = 0;
+
+	frequency = constrain(frequency, CONTROLFREQMIN, CONTROLFREQMAX);
+	this->controlFrequencyRequest = frequency;
+	ratio = (float)frequency / (float)this->controlFrequency;
+
+	// Integral gain includes the sample period, differential gain the sample frequency
+	this->controller.rescale(ratio);
+
+	// The shift based encoder position filter can only be rescaled in powers of two. It is derived 
+	// from the value chosen by setup() for the default rate, so it does not drift when limited
+	ratio = (float)frequency / (float)this->controlFrequencyBase;
+	while(ratio >= 1.414 && betaShift < 4)
+	{
+		ratio *= 0.5;
+		betaShift++;
+	}
+	while(ratio <= 0.707 && betaShift > -4)
+	{
+		ratio *= 2.0;
+		betaShift--;
+	}
+	this->encoder.Beta = constrain((int8_t)this->encoderBetaBase + betaShift, 1, 5);
+
+	cli();
+	// Tracking loop speed is per control tick
+	this->encoder.trackingVelocity = fixMul(this->encoder.trackingVelocity, FLOATTOFIX((float)this->controlFrequency / frequency, FIXSHIFT), FIXSHIFT);
+	this->controlFrequency = frequency;
+	this->updateControlGains();
+	ICR1 = (uint16_t)(CLOCKFREQ / frequency);
+	TCNT1 = 0;
+	sei();
+
+	return frequency;
+}
+
+uint16_t uStepperS::getControlFrequency(void)
+{
+	return this->controlFrequency;
+}
+
+void uStepperS::enableIsrProfiler(void)
+{
+	this->isrProfilerEnabled = 1;
+}
+
+void uStepperS::disableIsrProfiler(void)
+{
+	this->isrProfilerEnabled = 0;
+}
+
+void uStepperS::resetIsrProfiler(void)
+{
+	uint8_t i;
+	uint8_t sreg = SREG;
+
+	cli();
+	for(i = 0; i < ISRPROFILEPHASES; i++)
+	{
+		this->isrProfile[i].min = 0xFFFF;
+		this->isrProfile[i].max = 0;
+		this->isrProfile[i].sum = 0;
+		this->isrProfile[i].count = 0;
+	}
+	this->isrOverruns = 0;
+	SREG = sreg;
+}
+
+bool uStepperS::getIsrProfile(uint8_t phase, isrProfile_t *profile)
+{
+	if(phase >= ISRPROFILEPHASES)
+	{
+		return 0;
+	}
+
+	cli();
+	profile->min = this->isrProfile[phase].min;
+	profile->max = this->isrProfile[phase].max;
+	profile->sum = this->isrProfile[phase].sum;
+	profile->count = this->isrProfile[phase].count;
+	sei();
+
+	if(!profile->count)
+	{
+		profile->min = 0;
+	}
+
+	return 1;
+}
+
+uint16_t uStepperS::getIsrMean(uint8_t phase)
+{
+	isrProfile_t profile;
+
+	if(!this->getIsrProfile(phase, &profile) || !profile.count)
+	{
+		return 0;
+	}
+
+	return (uint16_t)(profile.sum / profile.count);
+}
+
+uint32_t uStepperS::getIsrOverruns(void)
 {
-	return this->encoder.getAngleMoved();
-}
+	uint32_t overruns;
 
-void uStepperS::stop( bool mode){
+	cli();
+	overruns = this->isrOverruns;
+	sei();
 
-	if(mode == HARD)
-	{
-		this->driver.setDeceleration( 0xFFFE );
-		this->driver.setAcceleration( 0xFFFE );
-		this->setRPM(0);
-		while(this->driver.readRegister(VACTUAL) != 0);
-		this->driver.setDeceleration( (uint32_t)( this->maxDeceleration ) );
-		this->driver.setAcceleration( (uint32_t)(this->maxAcceleration ) );
-	}
-	else
-	{
-		this->setRPM(0);
-		while(this->driver.readRegister(VACTUAL) != 0);
-	}
-	// Get current position
-	int32_t current = this->driver.getPosition();
-	// Set new position
-	this->driver.setPosition( current );	
+	return overruns;
 }
 
-void uStepperS::filterSpeedPos(posFilter_t *filter, int32_t steps)
+void uStepperS::isrProfileAdd(uint8_t phase, uint16_t cycles)
 {
-	if(this->mode != DROPIN)
+	volatile isrProfile_t *profile = &this->isrProfile[phase];
+
+	if(cycles < profile->min)
 	{
-		filter->posEst += filter->velEst * ENCODERINTPERIOD * 0.5f;
+		profile->min = cycles;
 	}
-	else
+	if(cycles > profile->max)
 	{
-		filter->posEst += filter->velEst * ENCODERINTPERIOD;
+		profile->max = cycles;
 	}
-	
-	
-	filter->posError = (float)steps - filter->posEst;
-	if(this->mode != DROPIN)
+	if(profile->count >= ISRPROFILEMAXCOUNT)
 	{
-		filter->velIntegrator += filter->posError * PULSEFILTERKI * 0.5f;
+		profile->sum >>= 1;
+		profile->count >>= 1;
 	}
-	else
+	profile->sum += cycles;
+	profile->count++;
+}
+
+void uStepperS::isrProfileMark(uint8_t phase)
+{
+	uint16_t now;
+
+	if(!this->isrProfiling)
 	{
-		filter->velIntegrator += filter->posError * PULSEFILTERKI;
+		return;
 	}
-	filter->velEst = (filter->posError * PULSEFILTERKP) + filter->velIntegrator;
+
+	now = TCNT1;
+	this->isrProfileAdd(phase, timer1Elapsed(this->isrPhaseStart, now));
+	this->isrPhaseStart = now;
+}
+
+#if CONTROLFIXEDPOINT
+void uStepperS::filterSpeedPosFixed(volatile posFilterFixed_t *filter, int32_t steps)
+{
+	filter->posEst += filter->velEst;
+	filter->posError = (int32_t)(((uint32_t)steps << FIXSHIFT) - filter->posEst);
+	filter->velIntegrator += fixMul(filter->posError, this->pulseFilterKiFixed, 24);
+	filter->velEst = fixMul(filter->posError, this->pulseFilterKpFixed, 24) + filter->velIntegrator;
 }
+#endif
 
 void interrupt1(void)
 {
@@ -560,6 +1810,22 @@ void interrupt1(void)
 
 void interrupt0(void)
 {
+	uint16_t timer = TCNT3;
+	uint16_t backlog;
+
+	pointer->stepEdgeTimer = timer;
+
+	if(pointer->stepCheck)
+	{
+		pointer->stepCheckIsrEdges++;
+		// Edges counted by Timer4 that this call has not accounted for, e.g. during the latency
+		backlog = (uint16_t)TCNT4 - pointer->stepCheckIsrEdges - pointer->stepCheckMissed;
+		if(backlog < 0x8000 && backlog > pointer->stepCheckMaxBacklog)
+		{
+			pointer->stepCheckMaxBacklog = backlog;
+		}
+	}
+
 	if(PIND & 0x04)
 	{
 		PORTD |= (1 << 4);
@@ -568,80 +1834,612 @@ void interrupt0(void)
 	{
 		PORTD &= ~(1 << 4);
 	}
-	if((PINB & (0x08)))			//CCW
+	//DIR (PB3) selects the increment, positive values = number of steps in CW direction from initial postion
+	pointer->stepCnt += pointer->stepIncrement[(PINB >> 3) & 1];
+
+	if(pointer->stepCheck)
 	{
-		if(!pointer->invertPidDropinDirection)
+		// Timer3 counts every 8th clock cycle
+		timer = (TCNT3 - timer) << 3;
+		if(timer > pointer->stepCheckMaxServiceTime)
 		{
-			pointer->stepCnt-=pointer->dropinStepSize;				//DIR is set to CCW, therefore we subtract 1 step from step count (negative values = number of steps in CCW direction from initial postion)
+			pointer->stepCheckMaxServiceTime = timer;
 		}
-		else
+	}
+}
+
+#if DROPINFASTSTEPISR
+void INT0_vect(void)
+{
+	// Same as interrupt0, which is kept for reference. Only r24, r25 and Z are used, and no
+	// instruction between the first add and the last adc changes the carry flag
+	asm volatile(
+		"push r24"							"\n\t"
+		"in r24, __SREG__"					"\n\t"
+		"push r24"							"\n\t"
+		"push r25"							"\n\t"
+		"push r30"							"\n\t"
+		"push r31"							"\n\t"
+		// Mirror PD2 to PD4
+		"sbic %[pind], 2"					"\n\t"
+		"sbi %[portd], 4"					"\n\t"
+		"sbis %[pind], 2"					"\n\t"
+		"cbi %[portd], 4"					"\n\t"
+		// Edge timestamp, low byte first
+		"lds r24, %[tcnt3]"					"\n\t"
+		"lds r25, %[tcnt3]+1"				"\n\t"
+		"sts %[edge]+1, r25"				"\n\t"
+		"sts %[edge], r24"					"\n\t"
+		// Z = &stepIncrement[DIR]
+		"in r30, %[pinb]"					"\n\t"
+		"andi r30, 0x08"					"\n\t"
+		"lsr r30"							"\n\t"
+		"ldi r31, 0"						"\n\t"
+		"subi r30, lo8(-(%[inc]))"			"\n\t"
+		"sbci r31, hi8(-(%[inc]))"			"\n\t"
+		// stepCnt += *Z
+		"lds r24, %[cnt]"					"\n\t"
+		"ld r25, Z+"						"\n\t"
+		"add r24, r25"						"\n\t"
+		"sts %[cnt], r24"					"\n\t"
+		"lds r24, %[cnt]+1"					"\n\t"
+		"ld r25, Z+"						"\n\t"
+		"adc r24, r25"						"\n\t"
+		"sts %[cnt]+1, r24"					"\n\t"
+		"lds r24, %[cnt]+2"					"\n\t"
+		"ld r25, Z+"						"\n\t"
+		"adc r24, r25"						"\n\t"
+		"sts %[cnt]+2, r24"					"\n\t"
+		"lds r24, %[cnt]+3"					"\n\t"
+		"ld r25, Z"							"\n\t"
+		"adc r24, r25"						"\n\t"
+		"sts %[cnt]+3, r24"					"\n\t"
+		// stepCheckIsrEdges++
+		"lds r24, %[edges]"					"\n\t"
+		"lds r25, %[edges]+1"				"\n\t"
+		"adiw r24, 1"						"\n\t"
+		"sts %[edges]+1, r25"				"\n\t"
+		"sts %[edges], r24"					"\n\t"
+		"pop r31"							"\n\t"
+		"pop r30"							"\n\t"
+		"pop r25"							"\n\t"
+		"pop r24"							"\n\t"
+		"out __SREG__, r24"					"\n\t"
+		"pop r24"							"\n\t"
+		"reti"								"\n\t"
+		::
+		[pind] "I" (_SFR_IO_ADDR(PIND)),
+		[portd] "I" (_SFR_IO_ADDR(PORTD)),
+		[pinb] "I" (_SFR_IO_ADDR(PINB)),
+		[tcnt3] "n" (_SFR_MEM_ADDR(TCNT3)),
+		[edge] "i" (&uStepperS::stepEdgeTimer),
+		[inc] "i" (uStepperS::stepIncrement),
+		[cnt] "i" (&uStepperS::stepCnt),
+		[edges] "i" (&uStepperS::stepCheckIsrEdges)
+	);
+}
+
+void INT1_vect(void)
+{
+	interrupt1();
+}
+#endif
+
+#if DROPINHARDWARESTEPCOUNTER
+void PCINT0_vect(void)
+{
+	if(!pointer->hardwareStepCounter)
+	{
+		return;
+	}
+
+	pointer->stepCounterUpdate();
+	pointer->stepCounterDirection = (PINB & (1 << PB3)) ? 1 : 0;
+}
+#endif
+
+void TIMER1_COMPA_vect(void)
+{
+	
+	static const uint8_t driverRegisters[3] = {XACTUAL, VACTUAL, XLATCH};
+	int32_t driverValues[3];
+	int32_t stepsMoved;
+	int32_t stepCntTemp;
+	uint16_t driverTime;
+	uint16_t edgeTimer;
+	uint16_t checkTimerEdges, checkIsrEdges;
+	bool checkPending;
+	uint16_t edgeElapsed;
+	bool latched;
+#if CONTROLFIXEDPOINT
+	int32_t errorSteps;
+#else
+	float error;
+#endif
+
+	uint16_t isrEntry = TCNT1;
+	bool nested = pointer->isrActive;
+	bool outerProfiling = pointer->isrProfiling;
+
+	pointer->controlTicks++;
+	pointer->isrActive = 1;
+	// A nested interrupt means the previous one overran its period. Its timing would 
+	// corrupt the phase being measured by the interrupted routine, so it is not profiled
+	pointer->isrProfiling = pointer->isrProfilerEnabled && !nested;
+	sei();
+
+	if(nested)
+	{
+		pointer->isrOverruns++;
+	}
+
+	// Compare match happens at TCNT1 = OCR1A = 0, so TCNT1 at entry is the interrupt latency
+	pointer->isrPhaseStart = 0;
+	pointer->isrProfileMark(ISRPROFILELATENCY);
+
+	// The strobe is pulsed by the encoder read, so this is decided before it
+	latched = pointer->latchPort != NULL;
+	pointer->encoder.captureAngle();
+	pointer->isrProfileMark(ISRPROFILEENCODER);
+
+	// Pipelined read of position and velocity: 3 SPI frames instead of 4
+	driverTime = TCNT1;
+	pointer->driver.readRegisters(driverRegisters, driverValues, latched ? 3 : 2);
+	pointer->isrProfileMark(ISRPROFILEDRIVERREAD);
+	stepsMoved = driverValues[0];
+	pointer->driver.xActual = stepsMoved;
+	if(latched)
+	{
+		pointer->driver.xLatch = driverValues[2];
+	}
+
+	// VACTUAL is 24bit two's compliment
+	if (driverValues[1] & 0x00800000)
+		driverValues[1] |= 0xFF000000;
+	pointer->driver.vActual = driverValues[1];
+
+	if(pointer->driver.resetDetected)
+	{
+		// The driver lost its configuration, e.g. by a brown-out of the motor supply
+		pointer->driver.restoreConfiguration();
+	}
+
+	// The ramp generator does not drive the motor in direct current mode, and the encoder 
+	// speed is not tracked in DROPIN
+	if(!pointer->directCurrent && pointer->mode != DROPIN)
+	{
+		if(pointer->stallDetector.isEnabled())
+		{
+			pointer->stallDetector.update(fixMul(driverValues[1], pointer->stallSpeedGainFixed, FIXSHIFT), pointer->encoder.trackingVelocity, pointer->controlTicks);
+		}
+
+		if(pointer->encoder.encoderStallDetectEnable || pointer->stallDetectLegacyEnabled)
+		{
+			pointer->encoderStallDetectLegacy();
+		}
+
+		if(pointer->motionQueueBusy || pointer->motionQueueCount)
+		{
+			pointer->motionQueueService(stepsMoved - pointer->driver.positionOffset, driverValues[1]);
+		}
+
+		if(pointer->pvtActive || pointer->pvtCount)
+		{
+			// The trajectory is already smooth, so it is not jerk limited
+			pointer->pvtService(stepsMoved - pointer->driver.positionOffset);
+		}
+		else if(pointer->jerkStep)
 		{
-			pointer->stepCnt+=pointer->dropinStepSize;			//DIR is set to CW, therefore we add 1 step to step count (positive values = number of steps in CW direction from initial postion)	
+			pointer->jerkUpdate(stepsMoved - pointer->driver.positionOffset, driverValues[1]);
 		}
-		
 	}
-	else						//CW
+	if(pointer->directCurrent)
 	{
-		if(!pointer->invertPidDropinDirection)
+		// The ramp generator does not drive the motor in direct mode
+		pointer->directCurrentUpdate();
+	}
+	else if(pointer->mode == DROPIN)
+	{	
+		cli();
+			if(pointer->hardwareStepCounter)
+			{
+				pointer->stepCounterUpdate();
+			}
+			stepCntTemp = pointer->stepCnt;
+			edgeTimer = pointer->stepEdgeTimer;
+			edgeElapsed = TCNT3 - edgeTimer;
+			if(pointer->stepCheck)
+			{
+				// The timer is read before the flag, so an edge in between is never taken as missed
+				checkTimerEdges = TCNT4;
+				checkIsrEdges = pointer->stepCheckIsrEdges;
+				checkPending = (EIFR & (1 << INTF0)) ? 1 : 0;
+			}
+		sei();
+
+		if(pointer->stepCheck)
 		{
-			pointer->stepCnt+=pointer->dropinStepSize;			//DIR is set to CW, therefore we add 1 step to step count (positive values = number of steps in CW direction from initial postion)	
+			pointer->stepCheckUpdate(checkTimerEdges, checkIsrEdges, checkPending);
 		}
-		else
+
+		if(!pointer->hardwareStepCounter)
+		{
+			pointer->stepRateUpdate(stepCntTemp, edgeTimer, edgeElapsed);
+		}
+
+#if CONTROLFIXEDPOINT
+		pointer->filterSpeedPosFixed(&pointer->externalStepInputFilterFixed, stepCntTemp/16);
+
+		if(!pointer->pidDisabled)
+		{
+			errorSteps = (stepCntTemp - encoderToSteps(pointer->encoder.angleMoved))/16;
+			errorSteps = constrain(errorSteps, -32767L, 32767L);
+			if(pointer->hardwareStepCounter)
+			{
+				pointer->currentPidSpeedFixed = fixMul(pointer->externalStepInputFilterFixed.velIntegrator, pointer->controlFrequency, 8);
+			}
+			else
+			{
+				pointer->currentPidSpeedFixed = pointer->stepRate;
+			}
+			pointer->isrProfileMark(ISRPROFILEFILTER);
+			pointer->pidFixed(errorSteps << FIXSHIFT);
+			pointer->isrProfileMark(ISRPROFILEWRITE);
+		}
+#else
+		pointer->filterSpeedPos(&pointer->externalStepInputFilter, stepCntTemp/16);
+
+		if(!pointer->pidDisabled)
+		{
+			error = (stepCntTemp - (int32_t)(pointer->encoder.angleMoved * ENCODERDATATOSTEP))/16;
+			if(pointer->hardwareStepCounter)
+			{
+				pointer->currentPidSpeed = pointer->externalStepInputFilter.velIntegrator;
+			}
+			else
+			{
+				pointer->currentPidSpeed = FIXTOFLOAT(pointer->stepRate, 8);
+			}
+			pointer->isrProfileMark(ISRPROFILEFILTER);
+			pointer->pid(error);
+			pointer->isrProfileMark(ISRPROFILEWRITE);
+		}
+#endif
+	}
+	else if(pointer->mode == CLOSEDLOOP)
+	{
+		if(!pointer->pidDisabled)
 		{
-			pointer->stepCnt-=pointer->dropinStepSize;				//DIR is set to CCW, therefore we subtract 1 step from step count (negative values = number of steps in CCW direction from initial postion)
+			pointer->closedLoopUpdate(stepsMoved, encoderToSteps(pointer->encoder.trackingPosition), driverTime);
+#if CONTROLFIXEDPOINT
+			pointer->currentPidSpeedFixed = fixMul(pointer->encoder.velocityFixed, FLOATTOFIX(ENCODERDATATOSTEP, FIXSHIFT), FIXSHIFT);
+#else
+			pointer->currentPidSpeed = pointer->encoder.encoderFilter.velIntegrator * ENCODERDATATOSTEP;
+#endif
 		}
 	}
+
+	if(pointer->isrProfiling)
+	{
+		pointer->isrProfileAdd(ISRPROFILETOTAL, isrEntry + timer1Elapsed(isrEntry, TCNT1));
+	}
+
+	// A compare match while the interrupt was masked (during driver access) also means the period was overrun
+	if(!nested && (TIFR1 & (1 << OCF1A)))
+	{
+		pointer->isrOverruns++;
+	}
+
+	cli();
+	pointer->isrProfiling = outerProfiling;
+	pointer->isrActive = nested;
+}
+
+void uStepperS::setClosedLoopFeedforward(float kv, float ka, float ki)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->closedLoopKv = kv;
+	this->closedLoopKa = ka;
+	this->closedLoopKi = ki;
+	this->updateControlGains();
+	SREG = sreg;
+}
+
+void uStepperS::closedLoopReset(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->closedLoopTrim = 0;
+	this->closedLoopAccel = 0;
+	this->closedLoopVOld = this->driver.vActual;
+	SREG = sreg;
+}
+
+void uStepperS::closedLoopUpdate(int32_t stepsMoved, int32_t encoderSteps, uint16_t driverTime)
+{
+	int32_t vActual = this->driver.vActual;
+	int32_t offset = this->driver.positionOffset;
+	int32_t xActual;
+	int32_t error;
+	int32_t lead;
+	int32_t delta;
+
+	// Driver position at the start of the control tick, where the tracked encoder position 
+	// is also taken. VACTUAL is in microsteps per 2^24 clock cycles
+	if(this->latchPort)
+	{
+		// Latched by the driver when the encoder was selected
+		xActual = this->driver.xLatch - fixMul(vActual, this->encoder.sampleTime, 24);
+	}
+	else
+	{
+		xActual = stepsMoved - fixMul(vActual, driverTime, 24);
+	}
+
+	// Following error of the rotor behind the ramp
+	error = xActual - offset - encoderSteps;
+#if CONTROLFIXEDPOINT
+	this->currentPidErrorFixed = constrain(error, -32767L, 32767L) << FIXSHIFT;
+#else
+	this->currentPidError = error;
+#endif
+
+	if(abs(error) >= CLOSEDLOOPSNAPLIMIT)
+	{
+		// Steps were lost, so continue the ramp from where the rotor is
+		this->closedLoopTrim = 0;
+		this->isrProfileMark(ISRPROFILEFILTER);
+		xActual = encoderSteps + offset + fixMul(vActual, TCNT1, 24);
+		this->driver.writeRegister(XACTUAL, xActual);
+		this->driver.writeRegister(XTARGET, this->driver.xTarget + offset);
+		this->isrProfileMark(ISRPROFILEWRITE);
+		return;
+	}
+
+	// Errors outside the control threshold slowly trim the lead
+#if CONTROLFIXEDPOINT
+	if(abs(error) >= this->controlThresholdFixed)
+#else
+	if(abs(error) >= this->controlThreshold)
+#endif
+	{
+		this->closedLoopTrim += error * this->closedLoopKiFixed;
+		this->closedLoopTrim = constrain(this->closedLoopTrim, -((int32_t)CLOSEDLOOPMAXLEAD << FIXSHIFT), ((int32_t)CLOSEDLOOPMAXLEAD << FIXSHIFT));
+	}
+
+	// Acceleration of the ramp, low pass filtered over 8 ticks
+	delta = constrain(vActual - this->closedLoopVOld, -32767L, 32767L);
+	this->closedLoopVOld = vActual;
+	this->closedLoopAccel += ((delta << FIXSHIFT) - this->closedLoopAccel) >> 3;
+
+	// Expected lag of the rotor, plus trim
+	lead = fixMul(vActual, this->closedLoopKvFixed, FIXSHIFT) + fixMul(this->closedLoopAccel, this->closedLoopKaFixed, 2*FIXSHIFT) + (this->closedLoopTrim >> FIXSHIFT);
+	lead = constrain(lead, -CLOSEDLOOPMAXLEAD, CLOSEDLOOPMAXLEAD);
+
+	delta = constrain(lead - offset, -CLOSEDLOOPMAXSLEW, CLOSEDLOOPMAXSLEW);
+	this->isrProfileMark(ISRPROFILEFILTER);
+
+	if(abs(delta) >= CLOSEDLOOPMINTRIM)
+	{
+		// Move position counter and target together, relative to where the ramp is now
+		xActual = stepsMoved + fixMul(vActual, timer1Elapsed(driverTime, TCNT1), 24) + delta;
+		this->driver.writeRegister(XACTUAL, xActual);
+		this->driver.positionOffset = offset + delta;
+		this->driver.writeRegister(XTARGET, this->driver.xTarget + offset + delta);
+		this->isrProfileMark(ISRPROFILEWRITE);
+	}
+}
+
+bool uStepperS::enableSynchronizedCapture(uint8_t strobePin, bool rightInput)
+{
+	uint8_t port = digitalPinToPort(strobePin);
+	uint8_t sreg;
+
+	if(port == NOT_A_PIN)
+	{
+		return 0;
+	}
+
+	pinMode(strobePin, OUTPUT);
+	digitalWrite(strobePin, LOW);
+	this->driver.setLatch(rightInput, 1);
+
+	sreg = SREG;
+	cli();
+	this->latchMask = digitalPinToBitMask(strobePin);
+	this->latchPort = portOutputRegister(port);
+	SREG = sreg;
+
+	return 1;
+}
+
+void uStepperS::disableSynchronizedCapture(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->latchPort = NULL;
+	this->latchMask = 0;
+	SREG = sreg;
+
+	this->driver.setLatch(0, 0);
+}
+
+bool uStepperS::enableDirectCurrent(void)
+{
+	uint16_t first, second;
+	int16_t moved, expected;
+
+	if(this->mode == DROPIN)
+	{
+		return 0;
+	}
+
+	if(this->directCurrent)
+	{
+		return 1;
+	}
+
+	this->disablePid();
+	this->stop(HARD);
+	this->directPolePairs = this->fullSteps >> 2;
+	this->driver.setDirectMode(1);
+
+	// Align the rotor to electrical angle 0 and 90 degrees
+	this->driver.setCoilCurrents(DIRECTALIGNCURRENT, 0);
+	delay(DIRECTALIGNTIME);
+	cli();
+	first = this->directEncoderAngle();
+	sei();
+
+	this->driver.setCoilCurrents(0, DIRECTALIGNCURRENT);
+	delay(DIRECTALIGNTIME);
+	cli();
+	second = this->directEncoderAngle();
+	sei();
+
+	// 90 electrical degrees is one full step
+	moved = (int16_t)(second - first);
+	expected = 16384 / this->directPolePairs;
+	if(abs(moved) < expected/2 || abs(moved) > expected*2)
+	{
+		this->driver.setDirectMode(0);
+		this->enablePid();
+		return 0;
+	}
+
+	this->directDir = (moved > 0) ? 1 : -1;
+	if(this->directDir < 0)
+	{
+		second = -second;
+	}
+	this->directAngleOffset = 16384 - second * this->directPolePairs;
+
+	cli();
+	this->directTarget = encoderToSteps(this->encoder.angleMoved);
+	this->directTorque = 0;
+	this->directServo = 1;
+	this->directCurrent = 1;
+	sei();
+	this->enablePid();
+
+	return 1;
+}
+
+void uStepperS::disableDirectCurrent(void)
+{
+	int32_t steps;
+
+	if(!this->directCurrent)
+	{
+		return;
+	}
+
+	this->disablePid();
+	cli();
+	this->directCurrent = 0;
+	sei();
+	this->driver.setDirectMode(0);
+
+	// Continue the ramp from where the rotor is
+	cli();
+	steps = encoderToSteps(this->encoder.angleMoved);
+	this->driver.positionOffset = 0;
+	this->driver.xTarget = steps;
+	sei();
+	this->driver.writeRegister(XACTUAL, steps);
+	this->driver.writeRegister(XTARGET, steps);
+	this->enablePid();
+}
+
+void uStepperS::setTorque(float torque)
+{
+	torque = constrain(torque, -100.0, 100.0);
+
+	cli();
+	this->directTorque = (int16_t)(torque * (DIRECTCURRENTMAX / 100.0));
+	this->directServo = 0;
+	sei();
 }
 
-void TIMER1_COMPA_vect(void)
+void uStepperS::setDirectTarget(float angle)
 {
-	
-	int32_t stepsMoved;
-	int32_t stepCntTemp;
-	float error;
-	float output;
+	int32_t target = (int32_t)(angle * this->angleToStep);
+
+	cli();
+	this->directTarget = target;
+	this->directServo = 1;
 	sei();
+}
 
-	pointer->encoder.captureAngle();
-	stepsMoved = pointer->driver.getPosition();
-	if(pointer->mode == DROPIN)
-	{	
-		cli();
-			stepCntTemp = pointer->stepCnt;
-		sei();
+uint16_t uStepperS::directEncoderAngle(void)
+{
+	// Same direction as angleMoved, which decreases with the raw encoder angle
+	return -(uint16_t)(this->encoder.angle + this->encoder.encoderOffset);
+}
 
-		pointer->filterSpeedPos(&pointer->externalStepInputFilter, stepCntTemp/16);
+void uStepperS::directCurrentUpdate(void)
+{
+	int32_t error;
+	int16_t torque;
+	uint16_t electrical;
 
-		if(!pointer->pidDisabled)
-		{
-			error = (stepCntTemp - (int32_t)(pointer->encoder.angleMoved * ENCODERDATATOSTEP))/16;
-			pointer->currentPidSpeed = pointer->externalStepInputFilter.velIntegrator;
-			pointer->pid(error);
-		}
-		return;
+	if(this->directServo)
+	{
+		error = this->directTarget - encoderToSteps(this->encoder.angleMoved);
+#if CONTROLFIXEDPOINT
+		this->currentPidErrorFixed = constrain(error, -32767L, 32767L) << FIXSHIFT;
+		// Q24.8 percent -> coil current
+		torque = fixMul(this->controller.updateFixed(this->currentPidErrorFixed, 100L << 8), FLOATTOFIX(DIRECTCURRENTMAX / 100.0, FIXSHIFT), 24);
+#else
+		this->currentPidError = error;
+		torque = (int16_t)(this->controller.update(error, 100.0) * (DIRECTCURRENTMAX / 100.0));
+#endif
+		torque = constrain(torque, -DIRECTCURRENTMAX, DIRECTCURRENTMAX);
 	}
-	else if(pointer->mode == CLOSEDLOOP)
+	else
 	{
-		if(!pointer->pidDisabled)
-		{
-			pointer->currentPidError = stepsMoved - pointer->encoder.angleMoved * ENCODERDATATOSTEP;
-			if(abs(pointer->currentPidError) >= pointer->controlThreshold)
-			{
-				pointer->driver.writeRegister(XACTUAL,pointer->encoder.angleMoved * ENCODERDATATOSTEP);
-				pointer->driver.writeRegister(XTARGET,pointer->driver.xTarget);
-			}
-			
-			pointer->currentPidSpeed = pointer->encoder.encoderFilter.velIntegrator * ENCODERDATATOSTEP;
-		}
+		torque = this->directTorque;
+	}
+
+	electrical = this->directEncoderAngle();
+	if(this->directDir < 0)
+	{
+		electrical = -electrical;
+	}
+	electrical = electrical * this->directPolePairs + this->directAngleOffset;
+
+	// Place the current 90 electrical degrees ahead of the rotor, in the direction of the torque
+	if((torque >= 0) == (this->directDir > 0))
+	{
+		electrical += 16384;
+	}
+	else
+	{
+		electrical -= 16384;
 	}
+	torque = abs(torque);
+	this->isrProfileMark(ISRPROFILEPID);
+
+	this->driver.setCoilCurrents(directSine(electrical + 16384, torque), directSine(electrical, torque));
+	this->isrProfileMark(ISRPROFILEWRITE);
 }
 
 void uStepperS::setControlThreshold(float threshold)
 {
 	this->controlThreshold = threshold;
+#if CONTROLFIXEDPOINT
+	this->controlThresholdFixed = (int32_t)(threshold + 0.5);
+#endif
 }
 void uStepperS::enablePid(void)
 {
+	// Start from a known controller state, instead of what was left when the PID was disabled
+	this->controller.reset();
+	this->closedLoopReset();
 	cli();
 	this->pidDisabled = 0;
 	sei();
@@ -704,543 +2502,594 @@ float uStepperS::moveToEnd(bool dir, float rpm, int8_t threshold, uint32_t timeO
 
 float uStepperS::getPidError(void)
 {
+#if CONTROLFIXEDPOINT
+	return FIXTOFLOAT(this->currentPidErrorFixed, FIXSHIFT);
+#else
 	return this->currentPidError;
+#endif
 }
 
 float uStepperS::pid(float error)
 {
 	float u;
-	float limit = abs(this->currentPidSpeed) + 10000.0;
-	static float integral;
-	static bool integralReset = 0;
-	static float errorOld, differential = 0.0;
 
 	this->currentPidError = error;
 
-	u = error*this->pTerm;
+	// Current speed as feedforward, used if the controller law is CONTROLLAWPIDFF
+	u = this->controller.update(error, abs(this->currentPidSpeed) + CONTROLLEROUTPUTMARGIN, this->currentPidSpeed);
+
+	u *= this->stepsPerSecondToRPM * 16.0;
+	this->isrProfileMark(ISRPROFILEPID);
+	this->setRPM(u);
+	this->driver.setDeceleration( 0xFFFE );
+	this->driver.setAcceleration( 0xFFFE );
+
+	return u;
+}
+
+#if CONTROLFIXEDPOINT
+void uStepperS::pidFixed(int32_t error)
+{
+	int32_t u;
+	int32_t velocity;
+
+	this->currentPidErrorFixed = error;
+
+	u = this->controller.updateFixed(error, abs(this->currentPidSpeedFixed) + FLOATTOFIX(CONTROLLEROUTPUTMARGIN, 8), this->currentPidSpeedFixed);
+
+	// Q24.8 * Q16.16 -> driver velocity
+	velocity = fixMul(u, this->pidVelocityFactorFixed, 24);
+	this->isrProfileMark(ISRPROFILEPID);
+
+	if(velocity > 0){
+		this->driver.setDirection(1);
+	}else{
+		this->driver.setDirection(0);
+	}
+
+	this->driver.setVelocity( (uint32_t)abs(velocity) );
+	this->driver.setDeceleration( 0xFFFE );
+	this->driver.setAcceleration( 0xFFFE );
+}
+#endif
+
+void uStepperS::setProportional(float P)
+{
+	this->controller.setGains(P, this->controller.iTerm, this->controller.dTerm);
+}
+
+void uStepperS::setIntegral(float I)
+{
+	this->controller.setGains(this->controller.pTerm, I * this->controlPeriod, this->controller.dTerm);
+}
+
+void uStepperS::setDifferential(float D)
+{
+	this->controller.setGains(this->controller.pTerm, this->controller.iTerm, D * this->controlFrequency);
+}
+
+void uStepperS::invertDropinDir(bool invert)
+{
+	this->invertPidDropinDirection = invert;
+	this->updateStepIncrement();
+}
+
+void uStepperS::updateStepIncrement(void)
+{
+	uint8_t sreg = SREG;
+	int32_t increment = this->dropinStepSize;
 
-	if(u > 0.0)
+	//DIR high is CCW, so it counts down unless the direction is inverted
+	if(this->invertPidDropinDirection)
 	{
-		if(u > limit)
-		{
-			u = limit;
-		}
+		increment = -increment;
+	}
+
+	cli();
+	this->stepIncrement[0] = increment;
+	this->stepIncrement[1] = -increment;
+	SREG = sreg;
+}
+
+bool uStepperS::enableHardwareStepCounter(void)
+{
+#if DROPINHARDWARESTEPCOUNTER
+	uint8_t sreg = SREG;
+
+	if(this->mode != DROPIN)
+	{
+		return 0;
 	}
-	else if(u < 0.0)
+
+	if(this->stepCheck)
 	{
-		if(u < -limit)
-		{
-			u = -limit;
-		}
+		this->disableStepInputCheck();
 	}
 
-	integral += error*this->iTerm;
+#if DROPINFASTSTEPISR
+	EIMSK &= ~(1 << INT0);
+#else
+	detachInterrupt(0);
+#endif
 
-	if(integral > 200000.0)
+	cli();
+	this->startStepTimer();
+	this->stepCounterLast = 0;
+	this->stepCounterDirection = (PINB & (1 << PB3)) ? 1 : 0;
+	//Pin change interrupt on DIR (PB3)
+	PCMSK0 |= (1 << PCINT3);
+	PCIFR = (1 << PCIF0);
+	PCICR |= (1 << PCIE0);
+	this->hardwareStepCounter = 1;
+	SREG = sreg;
+
+	return 1;
+#else
+	// Without the DIR pin change interrupt the counter can not follow direction changes
+	return 0;
+#endif
+}
+
+void uStepperS::disableHardwareStepCounter(void)
+{
+	uint8_t sreg = SREG;
+
+	if(!this->hardwareStepCounter)
 	{
-		integral = 200000.0;
+		return;
 	}
-	else if(integral < -200000.0)
+
+	cli();
+	this->stepCounterUpdate();
+	this->hardwareStepCounter = 0;
+	// The last edge timestamps are from before the counter was enabled
+	this->stepRateValid = 0;
+	this->stepRate = 0;
+	TCCR4B = 0;
+	PCMSK0 &= ~(1 << PCINT3);
+	if(!PCMSK0)
 	{
-		integral = -200000.0;
+		PCICR &= ~(1 << PCIE0);
 	}
+	SREG = sreg;
+
+#if DROPINFASTSTEPISR
+	EIFR = (1 << INTF0);
+	EIMSK |= (1 << INT0);
+#else
+	attachInterrupt(0, interrupt0, FALLING);
+#endif
+}
+
+void uStepperS::startStepTimer(void)
+{
+	//T4 (PE1) as input with pull-up, like the other DROPIN inputs
+	DDRE &= ~(1 << PE1);
+	PORTE |= (1 << PE1);
+
+	TIMSK4 = 0;
+	TCCR4A = 0;
+	TCCR4C = 0;
+	TCNT4 = 0;
+	//Normal mode, clocked by falling edges on T4
+	TCCR4B = (1 << CS42) | (1 << CS41);
+}
+
+bool uStepperS::enableStepInputCheck(void)
+{
+	uint8_t sreg = SREG;
 
-	if(error > -10 && error < 10)
+	if(this->mode != DROPIN || this->hardwareStepCounter)
 	{
-		if(!integralReset)
-		{
-			integralReset = 1;
-			integral = 0;
-		}
+		return 0;
 	}
-	else
+
+	cli();
+	this->startStepTimer();
+	this->stepCheckIsrEdges = 0;
+	this->stepCheckLastTimer = 0;
+	this->stepCheckLastIsr = 0;
+	this->stepCheckMissed = 0;
+	this->stepCheckReset = 1;
+	this->stepCheck = 1;
+	SREG = sreg;
+
+	return 1;
+}
+
+void uStepperS::disableStepInputCheck(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	if(this->stepCheck)
 	{
-		integralReset = 0;
+		this->stepCheck = 0;
+		TCCR4B = 0;
 	}
+	SREG = sreg;
+}
 
-	u += integral;
-	
-	differential *= 0.9;
-	differential += 0.1*((error - errorOld)*this->dTerm);
+void uStepperS::resetStepInputCheck(void)
+{
+	uint8_t sreg = SREG;
 
-	errorOld = error;
+	cli();
+	this->stepCheckReset = 1;
+	SREG = sreg;
+}
 
-	u += differential;
+void uStepperS::getStepInputCheck(stepInputCheck_t *result)
+{
+	uint8_t sreg = SREG;
 
-	u *= this->stepsPerSecondToRPM * 16.0;
-	this->setRPM(u);
-	this->driver.setDeceleration( 0xFFFE );
-	this->driver.setAcceleration( 0xFFFE );
+	cli();
+	*result = this->stepCheckResult;
+	SREG = sreg;
 }
 
-void uStepperS::setProportional(float P)
+void uStepperS::stepCheckUpdate(uint16_t timerEdges, uint16_t isrEdges, bool pending)
 {
-	this->pTerm = P;
+	uint16_t timerDelta = timerEdges - this->stepCheckLastTimer;
+	uint16_t isrDelta = isrEdges - this->stepCheckLastIsr;
+	uint32_t missed;
+	uint32_t frequency;
+
+	this->stepCheckLastTimer = timerEdges;
+	this->stepCheckLastIsr = isrEdges;
+	this->stepCheckMissed = timerEdges - isrEdges;
+	if(this->stepCheckMissed && pending)
+	{
+		this->stepCheckMissed--;
+	}
+
+	if(this->stepCheckReset)
+	{
+		this->stepCheckReset = 0;
+		this->stepCheckResult.timerEdges = 0;
+		this->stepCheckResult.isrEdges = 0;
+		this->stepCheckResult.missedSteps = 0;
+		this->stepCheckResult.maxFrequency = 0;
+		this->stepCheckResult.maxBacklog = 0;
+		this->stepCheckResult.maxServiceTime = 0;
+		cli();
+		this->stepCheckMaxBacklog = 0;
+		this->stepCheckMaxServiceTime = 0;
+		sei();
+		return;
+	}
+
+	this->stepCheckResult.timerEdges += timerDelta;
+	this->stepCheckResult.isrEdges += isrDelta;
+
+	// An edge already counted by the timer, but waiting for interrupt0, is not missed yet
+	missed = this->stepCheckResult.timerEdges - this->stepCheckResult.isrEdges;
+	if(missed && pending)
+	{
+		missed--;
+	}
+
+	if((int32_t)missed > (int32_t)this->stepCheckResult.missedSteps)
+	{
+		this->stepCheckResult.missedSteps = missed;
+	}
+	else
+	{
+		// Only ticks without missed edges count towards the maximum frequency
+		frequency = (uint32_t)timerDelta * this->controlFrequency;
+		if(frequency > this->stepCheckResult.maxFrequency)
+		{
+			this->stepCheckResult.maxFrequency = frequency;
+		}
+	}
+
+	this->stepCheckResult.maxBacklog = this->stepCheckMaxBacklog;
+	this->stepCheckResult.maxServiceTime = this->stepCheckMaxServiceTime;
 }
 
-void uStepperS::setIntegral(float I)
+void uStepperS::stepRateUpdate(int32_t steps, uint16_t timer, uint16_t elapsed)
 {
-	this->iTerm = I * ENCODERINTPERIOD; 
+	uint16_t period;
+	int32_t limit;
+
+	if(steps != this->stepRateCnt)
+	{
+		if(this->stepRateValid)
+		{
+			period = timer - this->stepRateTimer;
+			if(period)
+			{
+				// (stepCnt/16) * (CLOCKFREQ/8) / period in Q24.8
+				this->stepRate = (steps - this->stepRateCnt) * (int32_t)((uint32_t)(CLOCKFREQ * 2.0) / period);
+			}
+		}
+		this->stepRateCnt = steps;
+		this->stepRateTimer = timer;
+		this->stepRateValid = 1;
+		return;
+	}
+
+	if(!this->stepRateValid)
+	{
+		return;
+	}
+
+	// Timer3 wraps after 65536 counts, so the timeout must come well before that
+	if(elapsed > (uint16_t)(CLOCKFREQ / 8.0 * STEPRATETIMEOUT))
+	{
+		this->stepRate = 0;
+		this->stepRateValid = 0;
+		return;
+	}
+
+	// No edge since the last one, so the rate is at most one step since then
+	limit = this->dropinStepSize * (int32_t)((uint32_t)(CLOCKFREQ * 2.0) / (elapsed + 1));
+	this->stepRate = constrain(this->stepRate, -limit, limit);
 }
 
-void uStepperS::setDifferential(float D)
+void uStepperS::stepCounterUpdate(void)
 {
-	this->dTerm = D * ENCODERINTFREQ;
+	uint16_t count = TCNT4;
+
+	this->stepCnt += (int32_t)(uint16_t)(count - this->stepCounterLast) * this->stepIncrement[this->stepCounterDirection];
+	this->stepCounterLast = count;
 }
 
-void uStepperS::invertDropinDir(bool invert)
+void uStepperS::parseCommand(const char *cmd)
 {
-	this->invertPidDropinDirection = invert;
+	dropinCliCommand_t command;
+	uint8_t i;
+	uint8_t length;
+	float value = 0.0;
+
+	for(i = 0; i < sizeof(dropinCliCommands)/sizeof(dropinCliCommand_t); i++)
+	{
+		memcpy_P(&command, &dropinCliCommands[i], sizeof(dropinCliCommand_t));
+		length = strlen_P(command.name);
+
+		if(strncmp_P(cmd, command.name, length) == 0)
+		{
+			break;
+		}
+	}
+
+	if(i == sizeof(dropinCliCommands)/sizeof(dropinCliCommand_t))
+	{
+		Serial.println(F("COMMAND NOT ACCEPTED"));
+		return;
+	}
+
+	if(command.value)
+	{
+		if(!this->dropinParseNumber(cmd + length, &value) || value > command.maximum)
+		{
+			Serial.println(F("COMMAND NOT ACCEPTED"));
+			return;
+		}
+	}
+	else if(cmd[length] != '\0')
+	{
+		Serial.println(F("COMMAND NOT ACCEPTED"));
+		return;
+	}
+
+	switch(command.command)
+	{
+		case DROPINCLIP:
+			Serial.print(F("COMMAND ACCEPTED. P = "));
+			Serial.println(value,4);
+			this->dropinSettings.P.f = value;
+			this->saveDropinSettings();
+			this->setProportional(value);
+			break;
+
+		case DROPINCLII:
+			Serial.print(F("COMMAND ACCEPTED. I = "));
+			Serial.println(value,4);
+			this->dropinSettings.I.f = value;
+			this->saveDropinSettings();
+			this->setIntegral(value);
+			break;
+
+		case DROPINCLID:
+			Serial.print(F("COMMAND ACCEPTED. D = "));
+			Serial.println(value,4);
+			this->dropinSettings.D.f = value;
+			this->saveDropinSettings();
+			this->setDifferential(value);
+			break;
+
+		case DROPINCLIINVERT:
+			Serial.println(this->invertPidDropinDirection ? F("Direction normal!") : F("Direction inverted!"));
+			this->dropinSettings.invert = !this->invertPidDropinDirection;
+			this->saveDropinSettings();
+			this->invertDropinDir(this->dropinSettings.invert);
+			break;
+
+		case DROPINCLIERROR:
+			Serial.print(F("Current Error: "));
+			Serial.print(this->getPidError());
+			Serial.println(F(" Steps"));
+			break;
+
+		case DROPINCLICURRENT:
+			Serial.print(F("Run Current: "));
+			Serial.print(ceil(((float)this->driver.current)/0.31));
+			Serial.println(F(" %"));
+			Serial.print(F("Hold Current: "));
+			Serial.print(ceil(((float)this->driver.holdCurrent)/0.31));
+			Serial.println(F(" %"));
+			break;
+
+		case DROPINCLIPARAMETERS:
+			// Up to 63 characters, so it is printed by dropinCli one parameter at a time
+			this->dropinCliParameter = 0;
+			break;
+
+		case DROPINCLIHELP:
+			// Printed by dropinCli as room in the transmit buffer allows
+			this->dropinCliHelpLine = 0;
+			break;
+
+		case DROPINCLIRUNCURRENT:
+			i = (uint8_t)value;
+			Serial.print(F("COMMAND ACCEPTED. runCurrent = "));
+			Serial.print(i);
+			Serial.println(F(" %"));
+			this->dropinSettings.runCurrent = i;
+			this->saveDropinSettings();
+			this->setCurrent(i);
+			break;
+
+		case DROPINCLIHOLDCURRENT:
+			i = (uint8_t)value;
+			Serial.print(F("COMMAND ACCEPTED. holdCurrent = "));
+			Serial.print(i);
+			Serial.println(F(" %"));
+			this->dropinSettings.holdCurrent = i;
+			this->saveDropinSettings();
+			this->setHoldCurrent(i);
+			break;
+	}
 }
 
-void uStepperS::parseCommand(String *cmd)
-{
-  uint8_t i = 0;
-  String value;
-
-  if(cmd->charAt(2) == ';')
-  {
-    Serial.println("COMMAND NOT ACCEPTED");
-    return;
-  }
-
-  value.remove(0);
-  /****************** SET P Parameter ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  if(cmd->substring(0,2) == String("P="))
-  {
-    for(i = 2;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        Serial.print("COMMAND ACCEPTED. P = ");
-        Serial.println(value.toFloat(),4);
-        this->dropinSettings.P.f = value.toFloat();
-    	this->saveDropinSettings();
-        this->setProportional(value.toFloat());
-        return;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-  }
-
-/****************** SET I Parameter ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,2) == String("I="))
-  {
-    for(i = 2;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        Serial.print("COMMAND ACCEPTED. I = ");
-        Serial.println(value.toFloat(),4);
-        this->dropinSettings.I.f = value.toFloat();
-    	this->saveDropinSettings();
-        this->setIntegral(value.toFloat());
-        return;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-  }
-
-/****************** SET D Parameter ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,2) == String("D="))
-  {
-    for(i = 2;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        Serial.print("COMMAND ACCEPTED. D = ");
-        Serial.println(value.toFloat(),4);
-        this->dropinSettings.D.f = value.toFloat();
-    	this->saveDropinSettings();
-        this->setDifferential(value.toFloat());
-        return;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-  }
-
-/****************** invert Direction ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,6) == String("invert"))
-  {
-      if(cmd->charAt(6) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-      if(this->invertPidDropinDirection)
-      {
-      	Serial.println(F("Direction normal!"));
-      	this->dropinSettings.invert = 0;
-    	this->saveDropinSettings();
-        this->invertDropinDir(0);
-        return;
-      }
-      else
-      {
-      	Serial.println(F("Direction inverted!"));
-      	this->dropinSettings.invert = 1;
-    	this->saveDropinSettings();
-        this->invertDropinDir(1);
-        return;
-      }
-  }
-
-  /****************** get Current Pid Error ********************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,5) == String("error"))
-  {
-      if(cmd->charAt(5) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-      Serial.print(F("Current Error: "));
-      Serial.print(this->getPidError());
-      Serial.println(F(" Steps"));
-  }
-
-  /****************** Get run/hold current settings ************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,7) == String("current"))
-  {
-      if(cmd->charAt(7) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-      Serial.print(F("Run Current: "));
-      Serial.print(ceil(((float)this->driver.current)/0.31));
-      Serial.println(F(" %"));
-      Serial.print(F("Hold Current: "));
-      Serial.print(ceil(((float)this->driver.holdCurrent)/0.31));
-      Serial.println(F(" %"));
-  }
-  
-  /****************** Get PID Parameters ***********************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,10) == String("parameters"))
-  {
-      if(cmd->charAt(10) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-      Serial.print(F("P: "));
-      Serial.print(this->dropinSettings.P.f,4);
-      Serial.print(F(", "));
-      Serial.print(F("I: "));
-      Serial.print(this->dropinSettings.I.f,4);
-      Serial.print(F(", "));
-      Serial.print(F("D: "));
-      Serial.println(this->dropinSettings.D.f,4);
-  }
-
-  /****************** Help menu ********************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,4) == String("help"))
-  {
-      if(cmd->charAt(4) != ';')
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-      this->dropinPrintHelp();
-  }
-
-/****************** SET run current ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,11) == String("runCurrent="))
-  {
-    for(i = 11;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-      	if(value.toFloat() >= 0.0 && value.toFloat() <= 100.0)
-      	{
-      		i = (uint8_t)value.toFloat();
-    		break;	
-      	}
-      	else
-      	{
-      		Serial.println("COMMAND NOT ACCEPTED");
-        	return;
-      	}
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-
-    Serial.print("COMMAND ACCEPTED. runCurrent = ");
-    Serial.print(i);
-    Serial.println(F(" %"));
-    this->dropinSettings.runCurrent = i;
-    this->saveDropinSettings();
-    this->setCurrent(i);
-  }
-
-  /****************** SET run current ***************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else if(cmd->substring(0,12) == String("holdCurrent="))
-  {
-    for(i = 12;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == '.')
-      {
-        value.concat(cmd->charAt(i));
-        i++;
-        break;
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-        break;
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-    
-    for(;;i++)
-    {
-      if(cmd->charAt(i) >= '0' && cmd->charAt(i) <= '9')
-      {
-        value.concat(cmd->charAt(i));
-      }
-      else if(cmd->charAt(i) == ';')
-      {
-      	if(value.toFloat() >= 0.0 && value.toFloat() <= 100.0)
-      	{
-      		i = (uint8_t)value.toFloat();
-    		break;	
-      	}
-      	else
-      	{
-      		Serial.println("COMMAND NOT ACCEPTED");
-        	return;
-      	}
-      }
-      else
-      {
-        Serial.println("COMMAND NOT ACCEPTED");
-        return;
-      }
-    }
-
-    Serial.print("COMMAND ACCEPTED. holdCurrent = ");
-    Serial.print(i);
-    Serial.println(F(" %"));
-    this->dropinSettings.holdCurrent = i;
-    this->saveDropinSettings();
-    this->setHoldCurrent(i);
-  }
-
-  /****************** DEFAULT (Reject!) ************************
-  *                                                            *
-  *                                                            *
-  **************************************************************/
-  else
-  {
-    Serial.println("COMMAND NOT ACCEPTED");
-    return;
-  }
-  
+bool uStepperS::dropinParseNumber(const char *text, float *value)
+{
+	uint32_t mantissa = 0;
+	float scale = 1.0;
+	uint8_t digits = 0;
+	bool fraction = 0;
+
+	for(; *text != '\0'; text++)
+	{
+		if(*text >= '0' && *text <= '9')
+		{
+			// Digits beyond the precision of a float are ignored, unless they are in the integer part
+			if(digits < 9)
+			{
+				mantissa = mantissa * 10 + (*text - '0');
+				if(fraction)
+				{
+					scale *= 10.0;
+				}
+			}
+			else if(!fraction)
+			{
+				return 0;
+			}
+			digits++;
+		}
+		else if(*text == '.' && !fraction)
+		{
+			fraction = 1;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+
+	if(!digits)
+	{
+		return 0;
+	}
+
+	*value = mantissa / scale;
+
+	return 1;
 }
 
 void uStepperS::dropinCli()
 {
-	static String stringInput;
-	static uint32_t t = millis();
+	char c;
+
+	if(this->dropinCliHelpLine != 0xFF)
+	{
+		if(Serial.availableForWrite() > (int)strlen_P((const char *)pgm_read_ptr(&dropinHelpText[this->dropinCliHelpLine])) + 2)
+		{
+			Serial.println((const __FlashStringHelper *)pgm_read_ptr(&dropinHelpText[this->dropinCliHelpLine]));
+			this->dropinCliHelpLine++;
+			if(this->dropinCliHelpLine == sizeof(dropinHelpText)/sizeof(dropinHelpText[0]))
+			{
+				this->dropinCliHelpLine = 0xFF;
+			}
+		}
+		return;
+	}
+
+	if(this->dropinCliParameter != 0xFF)
+	{
+		if(Serial.availableForWrite() >= DROPINCLIPARAMETERSIZE)
+		{
+			switch(this->dropinCliParameter)
+			{
+				case 0:
+					Serial.print(F("P: "));
+					Serial.print(this->dropinSettings.P.f,4);
+					Serial.print(F(", "));
+					break;
+
+				case 1:
+					Serial.print(F("I: "));
+					Serial.print(this->dropinSettings.I.f,4);
+					Serial.print(F(", "));
+					break;
+
+				default:
+					Serial.print(F("D: "));
+					Serial.println(this->dropinSettings.D.f,4);
+					break;
+			}
+			this->dropinCliParameter = this->dropinCliParameter < 2 ? this->dropinCliParameter + 1 : 0xFF;
+		}
+		return;
+	}
+
+	if(this->dropinCliLength && (millis() - this->dropinCliTime) >= DROPINCLITIMEOUT)
+	{
+		this->dropinCliLength = 0;
+		this->dropinCliOverflow = 0;
+	}
 
-	while(1)
+	// Input is left in the receive buffer until there is room for the reply to a command
+	while(Serial.available() && Serial.availableForWrite() >= DROPINCLIREPLYSIZE && this->dropinCliHelpLine == 0xFF && this->dropinCliParameter == 0xFF)
 	{
-		while(!Serial.available())
+		c = (char)Serial.read();
+		this->dropinCliTime = millis();
+
+		if(c == ';')
 		{
-			delay(1);
-			if((millis() - t) >= 500)
+			this->dropinCliBuffer[this->dropinCliLength] = '\0';
+			if(this->dropinCliOverflow)
+			{
+				Serial.println(F("COMMAND NOT ACCEPTED"));
+			}
+			else
 			{
-				stringInput.remove(0);
-				t = millis();
+				this->parseCommand(this->dropinCliBuffer);
 			}
+			this->dropinCliLength = 0;
+			this->dropinCliOverflow = 0;
+		}
+		else if(this->dropinCliLength < DROPINCLIBUFFERSIZE - 1)
+		{
+			this->dropinCliBuffer[this->dropinCliLength++] = c;
 		}
-		t = millis();
-		stringInput += (char)Serial.read();
-		if(stringInput.lastIndexOf(';') > -1)
+		else
 		{
-		  this->parseCommand(&stringInput);
-		  stringInput.remove(0);
+			this->dropinCliOverflow = 1;
 		}
 	}
 }
 
 void uStepperS::dropinPrintHelp()
 {
-	Serial.println(F("uStepper S Dropin !"));
-	Serial.println(F(""));
-	Serial.println(F("Usage:"));
-	Serial.println(F("Show this command list: 'help;'"));
-	Serial.println(F("Get PID Parameters: 'parameters;'"));
-	Serial.println(F("Set Proportional constant: 'P=10.002;'"));
-	Serial.println(F("Set Integral constant: 'I=10.002;'"));
-	Serial.println(F("Set Differential constant: 'D=10.002;'"));
-	Serial.println(F("Invert Direction: 'invert;'"));
-	Serial.println(F("Get Current PID Error: 'error;'"));
-	Serial.println(F("Get Run/Hold Current Settings: 'current;'"));
-	Serial.println(F("Set Run Current (percent): 'runCurrent=50.0;'"));
-	Serial.println(F("Set Hold Current (percent): 'holdCurrent=50.0;'"));
-	Serial.println(F(""));
-	Serial.println(F(""));
+	uint8_t i;
+
+	for(i = 0; i < sizeof(dropinHelpText)/sizeof(dropinHelpText[0]); i++)
+	{
+		Serial.println((const __FlashStringHelper *)pgm_read_ptr(&dropinHelpText[i]));
+	}
 }
 
 bool uStepperS::loadDropinSettings(void)
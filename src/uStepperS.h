@@ -58,8 +58,11 @@
 *	\warning Please be aware that the uStepper uses the EEPROM to store settings related to the Dropin application.
 *	\warning If you are not using this, then this has no impact for your application, and you can ignore this section !
 *	\warning
-*	\warning EEPROM address 0 to 15 contains the different settings for dropin. If your application uses the EEPROM,
+*	\warning EEPROM address 0 to 16 contains the different settings for dropin. If your application uses the EEPROM,
 *	\warning Please use another location than these !
+*	\warning EEPROM address 24 to 153 contains the encoder calibration table, if calibrateEncoder() has been used.
+*	\warning EEPROM address 160 to 367 contains the saved multi-turn position, if encoder.savePosition() has been used.
+*	\warning The layout is checked at compile time in uStepperS.cpp.
 *
 *	\par Installation
 *	To install the uStepper S library into the Arduino IDE, perform the following steps:
@@ -194,6 +197,22 @@ typedef struct
 	uint8_t checksum;			/**< Checksum	*/
 }dropinCliSettings_t;
 
+#define DROPINEEPROMSIZE (sizeof(dropinCliSettings_t) + 1)	/**< EEPROM bytes used by the dropin settings, which are followed by a copy of their checksum */
+
+/**
+ * @brief      	Struct describing one command of the dropinCli
+ *
+ *				The command table is kept in flash. A command with a value is matched on its name 
+ *				followed by a number, other commands must match the whole input.
+ */
+typedef struct
+{
+	const char *name;			/**< Name of the command, including '=' for commands with a value. Stored in flash	*/
+	uint8_t command;			/**< DROPINCLI... label of the command	*/
+	bool value;					/**< 1 = the name is followed by a number	*/
+	float maximum;				/**< Highest accepted value	*/
+}dropinCliCommand_t;
+
 /**
  * @brief      	Struct for encoder velocity estimator
  *
@@ -208,9 +227,200 @@ typedef struct
 }posFilter_t;
 
 
+/**
+ * @brief      	Struct describing a single SPI1 transaction
+ *
+ *				A transaction is a number of bytes exchanged with one chip while its chip select
+ *				is asserted. Transactions are owned by the caller, and must stay valid until the
+ *				"done" flag is set by the SPI1 engine. No memory is allocated by the engine.
+ */
+typedef struct spiTransaction_s
+{
+	volatile uint8_t *csPort;			/**< PORT register of the chip select pin	*/
+	uint8_t csMask;						/**< Bit mask of the chip select pin in csPort	*/
+	bool csActiveHigh;					/**< 1 = chip is selected with chip select HIGH, 0 = chip is selected with chip select LOW	*/
+	uint8_t spiMode;					/**< SPI mode to use for the transaction (2 or 3)	*/
+	const uint8_t *txBuffer;			/**< Bytes to send. If NULL, zeros are sent	*/
+	uint8_t *rxBuffer;					/**< Buffer for received bytes. If NULL, received bytes are discarded	*/
+	uint8_t length;						/**< Number of bytes to exchange	*/
+	volatile bool done;					/**< Set by the engine when the transaction has completed	*/
+	void (*callback)(struct spiTransaction_s *transaction);	/**< Called from interrupt context when the transaction has completed. Can be NULL	*/
+	volatile uint8_t *strobePort;		/**< PORT register of a pin set HIGH together with the chip select, or NULL	*/
+	uint8_t strobeMask;					/**< Bit mask of the strobe pin in strobePort	*/
+	uint16_t selectTime;				/**< Set by the engine to TCNT1 when the chip is selected	*/
+}spiTransaction_t;
+
+#define SPIQUEUESIZE 8	/**< Maximum number of SPI1 transactions waiting to be processed */
+
+/**
+ * @brief      	Struct describing one move in the motion queue
+ *
+ *				Speeds are kept in driver register units, so the control interrupt can load the 
+ *				segment without conversions.
+ */
+typedef struct
+{
+	int32_t target;						/**< Target position, microsteps	*/
+	uint32_t velocity;					/**< VMAX of the move	*/
+	uint16_t acceleration;				/**< AMAX of the move	*/
+	uint16_t deceleration;				/**< DMAX of the move	*/
+	bool blend;							/**< 1 = start the move without stopping at the end of the previous one	*/
+}motionSegment_t;
+
+#define MOTIONQUEUESIZE 8	/**< Maximum number of moves waiting in the motion queue */
+
+/**
+ * @brief      	Struct describing one point of a PVT (position, velocity, time) trajectory
+ *
+ *				The velocity is stored per control tick, so the control interrupt can interpolate 
+ *				the segment without conversions.
+ */
+typedef struct
+{
+	int32_t position;					/**< Position at the end of the segment, microsteps	*/
+	int32_t velocity;					/**< Velocity at the end of the segment, microsteps per control tick, Q16.16	*/
+	uint16_t ticks;						/**< Duration of the segment, control ticks	*/
+}pvtPoint_t;
+
+/**
+ * @brief      	Struct holding the result of the DROPIN step input check
+ *
+ *				The counts start when the check is enabled or reset. Times are in MCU clock cycles.
+ */
+typedef struct
+{
+	uint32_t timerEdges;				/**< Step edges counted by Timer4	*/
+	uint32_t isrEdges;					/**< Step edges counted by interrupt0	*/
+	uint32_t missedSteps;				/**< Largest number of edges counted by Timer4 but not by interrupt0	*/
+	uint32_t maxFrequency;				/**< Highest step frequency over a control tick without missed steps, steps/s	*/
+	uint16_t maxBacklog;				/**< Most edges arriving while interrupt0 waited for or served an edge	*/
+	uint16_t maxServiceTime;			/**< Longest time from interrupt0 reading the timestamp to returning	*/
+}stepInputCheck_t;
+
+#define PVTBUFFERSIZE 16	/**< Maximum number of PVT points waiting to be executed */
+#define PVTSEGMENTMAX 8388607L	/**< Largest span of a PVT segment in microsteps, as the interpolated reference is Q24.8 in an int32 */
+#define MOTIONBLENDTICKS 2	/**< Control ticks of travel added to the braking distance when deciding to load a blended move */
+#define JERKMINVELOCITY 1000	/**< VMAX, in VACTUAL units, below which a jerk limited deceleration is completed by the ramp generator */
+
+/**
+ * @brief      	Struct holding execution time statistics of one phase of the timer1 interrupt
+ *
+ *				Times are measured with timer1, which runs at the CPU clock, so all values are in
+ *				CPU cycles (62.5 ns). The mean is sum/count. When count reaches ISRPROFILEMAXCOUNT,
+ *				sum and count are halved, so the mean follows slow changes in the load.
+ */
+typedef struct 
+{
+	uint16_t min;		/**< Shortest execution time seen, in CPU cycles */
+	uint16_t max;		/**< Longest execution time seen, in CPU cycles */
+	uint32_t sum;		/**< Sum of execution times, in CPU cycles */
+	uint16_t count;		/**< Number of measurements in sum */
+}isrProfile_t;
+
+#define ISRPROFILELATENCY 0		/**< Time from timer1 compare match to entry of the interrupt routine */
+#define ISRPROFILEENCODER 1		/**< Encoder capture, speed filter and stall detection */
+#define ISRPROFILEDRIVERREAD 2	/**< Reading XACTUAL and VACTUAL from the driver */
+#define ISRPROFILEFILTER 3		/**< Step input filter and control error calculation */
+#define ISRPROFILEPID 4			/**< PID controller calculation */
+#define ISRPROFILEWRITE 5		/**< Writing controller output to the driver */
+#define ISRPROFILETOTAL 6		/**< Entire interrupt routine, from compare match to exit */
+#define ISRPROFILEPHASES 7		/**< Number of profiled phases */
+#define ISRPROFILEMAXCOUNT 0x8000	/**< Number of measurements after which sum and count of a phase are halved */
+
+/** 
+ * Set to 1 to run the timer1 control path (encoder speed filter, step input filter, DROPIN PID
+ * and CLOSEDLOOP error) in fixed point arithmetic instead of software float, which frees up
+ * CPU time for the control loop and the application. Positions and errors are kept in Q16.16,
+ * speeds and controller outputs in Q24.8, and filter gains in Q8.24. Compared to the float
+ * path, gains are rounded to 2^-24 (PID differential gain to 2^-8), and positions derived from
+ * the encoder to 1/256th step. PID errors are saturated at +/-32767 steps.
+ */
+#ifndef CONTROLFIXEDPOINT
+	#define CONTROLFIXEDPOINT 0
+#endif
+
+/**
+ * Set MOTORFULLSTEPS to the number of full steps per revolution of the motor (e.g. 200) to fix 
+ * the motor geometry at compile time. The factors converting between steps, angles, RPM and 
+ * driver velocities then become constants: chains of them are folded by the compiler into a 
+ * single multiplication, scaling of integers by the number of microsteps becomes a shift, and 
+ * the RAM holding the factors is freed. The stepsPerRevolution argument of setup() is ignored. 
+ * Must be given as a compiler flag (-DMOTORFULLSTEPS=200), so the library is built with it. 
+ * 0 (default) = the number of full steps is given to setup() at runtime.
+ */
+#ifndef MOTORFULLSTEPS
+	#define MOTORFULLSTEPS 0
+#endif
+
+/**
+ * Set to 1 to let the library own the INT0 and INT1 vectors in DROPIN mode, instead of going
+ * through attachInterrupt(). The step interrupt is then a naked ISR, which saves only the
+ * registers it uses and adds the precomputed step increment to the step count, so the cost of a
+ * step pulse is less than half of the attachInterrupt() path. The step input check only counts
+ * the edges, it does not record backlog and service time. attachInterrupt() can not be used in
+ * the sketch, as the Arduino core defines the same vectors. Must be given as a compiler flag
+ * (-DDROPINFASTSTEPISR=1), so the library is built with it.
+ */
+#ifndef DROPINFASTSTEPISR
+	#define DROPINFASTSTEPISR 0
+#endif
+
+/**
+ * Set to 1 to build the DROPIN hardware step counter, see uStepperS::enableHardwareStepCounter().
+ * The library then owns the PCINT0 vector, for the pin change interrupt on DIR, so SoftwareSerial, 
+ * PinChangeInterrupt and other libraries using PCINT0 can not be linked into the sketch. The STEP 
+ * signal must be wired to PE1 (T4) for the counter to see it. Must be given as a compiler flag 
+ * (-DDROPINHARDWARESTEPCOUNTER=1), so the library is built with it.
+ */
+#ifndef DROPINHARDWARESTEPCOUNTER
+	#define DROPINHARDWARESTEPCOUNTER 0
+#endif
+
+#define FIXSHIFT 16	/**< Number of fractional bits of a Q16.16 fixed point number */
+#define FLOATTOFIX(x, shift) ((int32_t)((x) * (float)(1UL << (shift)) + ((x) < 0 ? -0.5 : 0.5)))	/**< Convert float to fixed point with "shift" fractional bits */
+#define FIXTOFLOAT(x, shift) ((float)(x) / (float)(1UL << (shift)))	/**< Convert fixed point with "shift" fractional bits to float */
+
+/**
+ * @brief      	Multiply two fixed point numbers
+ *
+ *				The full 64 bit product is shifted right by "shift", so the fractional bits of
+ *				the result are the sum of the fractional bits of a and b, minus shift.
+ */
+static inline int32_t fixMul(int32_t a, int32_t b, uint8_t shift)
+{
+	return (int32_t)(((int64_t)a * b) >> shift);
+}
+
+/**
+ * @brief      	Convert raw encoder data to 1/256th steps in integer arithmetic
+ *
+ *				Same as multiplying by ENCODERDATATOSTEP (51200/65536 = 25/32), rounded towards
+ *				minus infinity, without overflowing for large angles.
+ */
+static inline int32_t encoderToSteps(int32_t data)
+{
+	return (data >> 5) * 25 + (((data & 31) * 25) >> 5);
+}
+
+/**
+ * @brief      	Struct for fixed point velocity estimator
+ *
+ *				Fixed point version of posFilter_t. Position and velocities are kept in steps
+ *				and steps per control tick, so no multiplication by the sample period is needed.
+ */
+typedef struct 
+{
+	int32_t posError = 0;			/**< Position estimation error, Q16.16 steps*/
+	uint32_t posEst = 0;			/**< Position Estimation (Filtered Position), Q16.16 steps. Wraps around, only differences are used*/
+	int32_t velIntegrator = 0;		/**< Velocity integrator output (Filtered velocity), Q16.16 steps per control tick*/
+	int32_t velEst = 0;				/**< Estimated Velocity, Q16.16 steps per control tick*/
+}posFilterFixed_t;
+
 class uStepperS;
 #include <uStepperEncoder.h>
 #include <uStepperDriver.h>
+#include <uStepperController.h>
+#include <uStepperStallDetector.h>
 
 #define HARD 0	/**< Define label users can use as argument for stop() function to specify that the motor should stop immediately (without decelerating) */
 #define SOFT 1	/**< Define label users can use as argument for stop() function to specify that the motor should decelerate before stopping */
@@ -235,14 +445,47 @@ class uStepperS;
 
 #define CLOCKFREQ 16000000.0	/**< MCU Clock frequency */
 
-/** Frequency at which the encoder is sampled, for keeping track of angle moved and current speed 
- * 	Frequency is 1kHz in dropin and 2kHz for all other modes. base define is 1kHz, and if the mode
- * is not dropin, it is multiplied by 2 in the relevant places of the code 
+/** Default frequency at which the encoder is sampled, for keeping track of angle moved and current speed 
+ * 	Frequency is 1kHz in dropin and 2kHz for all other modes by default. base define is 1kHz, and if the mode
+ * is not dropin, it is multiplied by 2 in setup(). The frequency can be changed at runtime with 
+ * setControlFrequency(), in which case filter and PID gains are rescaled automatically
 */
 #define ENCODERINTFREQ 1000	
+#define CONTROLFREQMIN 500		/**< Lowest control loop frequency accepted by setControlFrequency() */
+#define CONTROLFREQMAX 8000		/**< Highest control loop frequency accepted by setControlFrequency() */
 #define ENCODERINTPERIOD 1.0/ENCODERINTFREQ		 /**< Frequency at which the encoder is sampled, for keeping track of angle moved and current speed */
+#define CLOSEDLOOPTRIMKI 20.0		/**< Default integral gain (1/s) of the closed loop trim on the following error */
+#define CLOSEDLOOPMAXLEAD 512		/**< Largest lead of the driver over the ramp injected by the closed loop, in microsteps */
+#define CLOSEDLOOPMAXSLEW 32		/**< Largest change of the closed loop lead per control tick, in microsteps */
+#define CLOSEDLOOPMINTRIM 4			/**< Smallest change of the closed loop lead written to the driver, in microsteps */
+#define CLOSEDLOOPSNAPLIMIT 512		/**< Following error, in microsteps, at which steps are considered lost, and the ramp position is moved to the encoder position */
+#define DIRECTALIGNCURRENT 160		/**< Coil current (of DIRECTCURRENTMAX) used to align the rotor when enabling direct current mode */
+#define DIRECTALIGNTIME 250			/**< Time in ms to let the rotor settle at each alignment position */
+#define STALLDETECTTOLERANCE 0.25	/**< Default deviation of the encoder speed from the driver speed, as a fraction of the driver speed, considered a stall */
+#define STALLDETECTHYSTERESIS 0.1	/**< Default hysteresis of the encoder stall detector, as a fraction of the driver speed */
+#define STALLDETECTWINDOW 6			/**< Default number of consecutive control ticks needed to detect or clear an encoder stall */
+#define STALLDETECTMINRPM 10.0		/**< Default driver speed in RPM below which the encoder stall detector makes no decision */
+#define ENCODERCALSETTLE 20			/**< Time in ms to let the rotor settle at each position during encoder calibration */
+#define ENCODERCALSAMPLES 8			/**< Number of encoder samples averaged at each position during encoder calibration */
 #define PULSEFILTERKP 120.0	/**< P term in the PI filter estimating the step rate of incomming pulsetrain in DROPIN mode*/
 #define PULSEFILTERKI 1900.0*ENCODERINTPERIOD /**< I term in the PI filter estimating the step rate of incomming pulsetrain in DROPIN mode*/
+#define DROPINCLIBUFFERSIZE 24	/**< Longest dropinCli command, including the terminating ';' */
+#define DROPINCLITIMEOUT 500	/**< Time in ms without input, after which a partial dropinCli command is discarded */
+#define DROPINCLIREPLYSIZE 48	/**< Free space needed in the serial transmit buffer, before the next dropinCli command is executed. The longest reply printed at once is the 47 characters of 'current;' */
+#define DROPINCLIPARAMETERSIZE 24	/**< Free space needed in the serial transmit buffer, before the next parameter of the 'parameters;' reply is printed. A part is at most 21 characters, as a float with 4 decimals is printed as at most 16 characters, or "ovf" */
+
+#define DROPINCLIP 0			/**< dropinCli command 'P=' */
+#define DROPINCLII 1			/**< dropinCli command 'I=' */
+#define DROPINCLID 2			/**< dropinCli command 'D=' */
+#define DROPINCLIINVERT 3		/**< dropinCli command 'invert' */
+#define DROPINCLIERROR 4		/**< dropinCli command 'error' */
+#define DROPINCLICURRENT 5		/**< dropinCli command 'current' */
+#define DROPINCLIPARAMETERS 6	/**< dropinCli command 'parameters' */
+#define DROPINCLIHELP 7			/**< dropinCli command 'help' */
+#define DROPINCLIRUNCURRENT 8	/**< dropinCli command 'runCurrent=' */
+#define DROPINCLIHOLDCURRENT 9	/**< dropinCli command 'holdCurrent=' */
+
+#define STEPRATETIMEOUT 0.025	/**< Time in seconds without step pulses, after which the measured DROPIN step rate is taken as zero. Must be below 32 ms */
 
 /**
  * @brief	Interrupt routine for critical tasks.
@@ -251,6 +494,38 @@ class uStepperS;
  */
 extern "C" void TIMER1_COMPA_vect(void) __attribute__ ((signal,used));
 
+/**
+ * @brief	Interrupt routine for the SPI1 transaction engine.
+ *
+ *			This interrupt routine clocks queued SPI1 transactions byte by byte, and starts
+ *			the next queued transaction when the current one completes.
+ */
+extern "C" void SPI1_STC_vect(void) __attribute__ ((signal,used));
+
+#if DROPINHARDWARESTEPCOUNTER
+/**
+ * @brief	Interrupt routine for the DIR input of the hardware step counter.
+ *
+ *			This interrupt routine books the steps counted in the old direction, when
+ *			the DIR pin changes while the hardware step counter is enabled.
+ */
+extern "C" void PCINT0_vect(void) __attribute__ ((signal,used));
+#endif
+
+#if DROPINFASTSTEPISR
+/**
+ * @brief	Interrupt routine for the DROPIN step input.
+ *
+ *			Naked version of interrupt0, written in assembly.
+ */
+extern "C" void INT0_vect(void) __attribute__ ((signal,naked,used));
+
+/**
+ * @brief	Interrupt routine for the DROPIN enable input. Calls interrupt1
+ */
+extern "C" void INT1_vect(void) __attribute__ ((signal,used));
+#endif
+
 /**
  * @brief      Used by dropin feature to take in step pulses
  *
@@ -282,6 +557,13 @@ friend class uStepperDriver;
 friend class uStepperEncoder;
 friend void interrupt0(void);
 friend void TIMER1_COMPA_vect(void) __attribute__ ((signal,used));
+friend void SPI1_STC_vect(void) __attribute__ ((signal,used));
+#if DROPINHARDWARESTEPCOUNTER
+friend void PCINT0_vect(void) __attribute__ ((signal,used));
+#endif
+#if DROPINFASTSTEPISR
+friend void INT0_vect(void) __attribute__ ((signal,naked,used));
+#endif
 public:			
 
 	/** Instantiate object for the driver */
@@ -290,6 +572,12 @@ public:
 	/** Instantiate object for the Encoder */
 	uStepperEncoder encoder;
 
+	/** Instantiate object for the DROPIN controller */
+	uStepperController controller;
+
+	/** Instantiate object for the encoder stall detector */
+	uStepperStallDetector stallDetector;
+
 	/**
 	 * @brief	Constructor of uStepper class
 	 */
@@ -321,7 +609,7 @@ public:
 	 *                              	constant "PID", to enable closed loop feature for
 	 *                              	regular movement functions, such as
 	 *                              	moveSteps()
-	 * @param[in]  stepsPerRevolution   Number of fullsteps per revolution
+	 * @param[in]  stepsPerRevolution   Number of fullsteps per revolution. Ignored if MOTORFULLSTEPS is set
 	 *
 	 * @param[in]  pTerm            	The proportional coefficent of the DROPIN PID
 	 *                              	controller
@@ -390,6 +678,25 @@ public:
 	 */
 	void setMaxDeceleration ( float deceleration );
 
+	/**
+	 * @brief      Set the maximum jerk of the stepper motor
+	 *
+	 *             With a jerk limit, the acceleration is not switched on and off instantly, but 
+	 *             ramped at the jerk rate by the control interrupt, which updates AMAX, DMAX and 
+	 *             VMAX of the driver each control tick. This gives S-shaped velocity profiles, 
+	 *             exciting less resonance in the load. In velocity mode both speeding up and slowing 
+	 *             down are shaped. In positioning mode the deceleration starts earlier, so it can be 
+	 *             shaped as well, and the last JERKMINVELOCITY of speed is removed by the ramp 
+	 *             generator. Not used in DROPIN mode. stop( HARD ) is never shaped.
+	 *
+	 *             The driver speed is an integer (VACTUAL), set once per control tick, so the jerk 
+	 *             is kept within one VACTUAL unit per tick squared of the limit. That is 
+	 *             CLOCKFREQ / 2^24 * controlFrequency^2 / 256 steps/s^3, 3725 steps/s^3 at 1 kHz.
+	 *
+	 * @param[in]      jerk  - Maximum jerk in steps/s^3. 0 = no jerk limit (trapezoidal profiles)
+	 */
+	void setMaxJerk ( float jerk );
+
 	/**
 	 * @brief      Set the maximum velocity of the stepper motor.
 	 *
@@ -481,6 +788,8 @@ public:
 	/**
 	 * @brief      Get the angle moved from reference position in degrees
 	 *
+	 *             Wraps after 32768 revolutions, see encoder.getMultiTurnAngle() for long running applications.
+	 *
 	 * @return     The angle moved in degrees.
 	 */
 	float angleMoved( void );
@@ -497,8 +806,10 @@ public:
 	 *					STANDSTILL - Are the motor currently stopped?
 	 *					STALLGUARD2 - Has the stallguard been trickered?
 	 *					
+	 *				The status captured by the timer1 interrupt routine is used when it is
+	 *				newer than the last register write, in which case no SPI traffic is needed.
 	 *
-	 * @return     The angle moved.
+	 * @return     0 if the flag is set, 1 if not.
 	 */
 	bool getMotorState(uint8_t statusType = POSITION_REACHED);
 
@@ -514,6 +825,106 @@ public:
 	 */
 	void stop( bool mode = HARD );
 
+	/**
+	 * @brief      	Add a move to the motion queue
+	 *
+	 *				The control interrupt starts each move the moment the previous one completes, so no
+	 *				polling of getMotorState() is needed between moves. A blended move is started when the 
+	 *				previous move is about to decelerate, so the motor continues at speed if the blended 
+	 *				move is in the same direction. The move is relative to the end of the last queued 
+	 *				move, or to the current target if the queue is empty. Uses the velocity, acceleration 
+	 *				and deceleration set by setMaxVelocity(), setMaxAcceleration() and setMaxDeceleration().
+	 *				Other move commands should not be issued while the queue is running. stop() clears the queue.
+	 *
+	 * @param[in]  	steps - number of microsteps to move, as moveSteps()
+	 * @param[in]  	blend - 1 = do not stop between the previous move and this one
+	 *
+	 * @return 		1 = queued, 0 = the queue is full
+	 */
+	bool queueMove( int32_t steps, bool blend = 0 );
+
+	/**
+	 * @brief      	Add a move with its own velocity, acceleration and deceleration to the motion queue
+	 *
+	 *				See queueMove( int32_t steps, bool blend ).
+	 *
+	 * @param[in]  	steps - number of microsteps to move, as moveSteps()
+	 * @param[in]  	velocity - maximum velocity of the move, as setMaxVelocity()
+	 * @param[in]  	acceleration - acceleration of the move, as setMaxAcceleration()
+	 * @param[in]  	deceleration - deceleration of the move, as setMaxDeceleration()
+	 * @param[in]  	blend - 1 = do not stop between the previous move and this one
+	 *
+	 * @return 		1 = queued, 0 = the queue is full
+	 */
+	bool queueMove( int32_t steps, float velocity, float acceleration, float deceleration, bool blend = 0 );
+
+	/**
+	 * @brief      	Get the number of moves not completed, including the one being executed
+	 *
+	 * @return 		number of moves. 0 = the queue has completed
+	 */
+	uint8_t getQueueLength( void );
+
+	/**
+	 * @brief      	Discard the moves waiting in the motion queue. The move being executed is completed
+	 */
+	void clearQueue( void );
+
+	/**
+	 * @brief      	Add a point to the PVT trajectory buffer
+	 *
+	 *				Each point ends a segment of the given duration, which starts at the previous 
+	 *				point, or at the current position with zero velocity when the trajectory starts. 
+	 *				The control interrupt interpolates the segment as a cubic (Hermite) curve matching 
+	 *				both positions and velocities, and makes the motor follow it in velocity mode, 
+	 *				with the acceleration set by setMaxAcceleration(). The trajectory starts as soon as 
+	 *				the first point is added. A host streaming points at a fixed rate gets a latency 
+	 *				of getPvtLength() segments. If the buffer runs empty while the last point has a 
+	 *				velocity, an underrun is counted and the motor decelerates and returns to the last 
+	 *				point. The trajectory should be started from standstill, and other move commands 
+	 *				should not be issued while it is running. Not used in DROPIN mode. stop() clears 
+	 *				the buffer.
+	 *
+	 *				The curve of a segment is limited to PVTSEGMENTMAX (2^23 - 1) microsteps from its 
+	 *				start: the distance to the previous point, plus a sixth of the start and end 
+	 *				velocities times the duration, must not exceed it. Longer segments are rejected, 
+	 *				and must be split into more points.
+	 *
+	 * @param[in]  	position - position at the end of the segment, microsteps, as driver.getPosition()
+	 * @param[in]  	velocity - velocity at the end of the segment, microsteps/s
+	 * @param[in]  	time - duration of the segment, ms. At least one control tick is used
+	 *
+	 * @return 		1 = added, 0 = the buffer is full, -1 = the segment is longer than PVTSEGMENTMAX
+	 */
+	int8_t pvtPush( int32_t position, float velocity, uint16_t time );
+
+	/**
+	 * @brief      	Get the number of PVT points waiting, not including the segment being executed
+	 *
+	 * @return 		0 - PVTBUFFERSIZE
+	 */
+	uint8_t getPvtLength( void );
+
+	/**
+	 * @brief      	Get the number of times the PVT buffer has run empty with the motor in motion
+	 *
+	 * @return 		number of underruns since startup
+	 */
+	uint16_t getPvtUnderruns( void );
+
+	/**
+	 * @brief      	Check if a PVT trajectory is being executed
+	 *
+	 * @return 		1 = a segment is being executed
+	 */
+	bool isPvtRunning( void );
+
+	/**
+	 * @brief      	Discard the PVT points waiting in the buffer. The segment being executed is completed, 
+	 *				and the motor stops at its end without counting an underrun
+	 */
+	void clearPvt( void );
+
 	/**
 	 * @brief      Enable TMC5130 StallGuard 
 	 *
@@ -558,6 +969,44 @@ public:
 	*/
 	bool isStalled( int8_t threshold );
 
+	/**
+	 * @brief      	Enable detection of stalls from the encoder
+	 *
+	 *				Each control tick the encoder speed is compared with the speed of the driver, as 
+	 *				already read by the control interrupt. Unlike stallguard, this works at any speed 
+	 *				above minimumRpm, and with any load. The detector runs on integer arithmetic, 
+	 *				see uStepperStallDetector. Not available in DROPIN mode and direct current mode. 
+	 *				The stall state is cleared.
+	 *
+	 * @param[in]   tolerance - deviation of the encoder speed, as a fraction of the driver speed, considered a stall. 0.0 - 255.0
+	 * @param[in]   hysteresis - the deviation must drop this much below tolerance to clear the stall
+	 * @param[in]   window - number of consecutive control ticks needed to detect or clear a stall
+	 * @param[in]   minimumRpm - below this driver speed no decision is made
+	 */
+	void enableEncoderStallDetect(float tolerance = STALLDETECTTOLERANCE, float hysteresis = STALLDETECTHYSTERESIS, uint8_t window = STALLDETECTWINDOW, float minimumRpm = STALLDETECTMINRPM);
+
+	/**
+	 * @brief      	Disable detection of stalls from the encoder
+	 */
+	void disableEncoderStallDetect( void );
+
+	/**
+	 * @brief      	Check if a stall is detected from the encoder
+	 *
+	 * @return     	0 = not stalled, 1 = stalled
+	 */
+	bool isEncoderStalled( void );
+
+	/**
+	 * @brief      	Set a function to be called when an encoder stall is detected or cleared
+	 *
+	 *				The function is called from interrupt context, and must return quickly. The 
+	 *				latest stalls are logged in stallDetector, see uStepperStallDetector::getEvent().
+	 *
+	 * @param[in]   callback - function called with 1 on stall and 0 when cleared. NULL = no function
+	 */
+	void setEncoderStallCallback( void (*callback)(bool stalled) );
+
 	/**
 	 * @brief      	
 	 *
@@ -599,9 +1048,94 @@ public:
 	/**
 	 * @brief      	This method sets the control threshold for the closed loop position control in microsteps - i.e. it is the allowed control error. 10 microsteps is suitable in most applications.
 	 *
+	 *				Following errors within the threshold are not trimmed by the closed loop.
 	 */
 	void setControlThreshold(float threshold);
 
+	/**
+	 * @brief      	Set the feedforward gains of the closed loop position control
+	 *
+	 *				In CLOSEDLOOP mode the driver is commanded ahead of the ramp by the expected lag of 
+	 *				the rotor, kv * velocity + ka * acceleration of the ramp, so the rotor follows the ramp. 
+	 *				The remaining following error (ramp position - encoder position) is integrated with 
+	 *				gain ki into a slowly changing trim of the lead. The lead is changed by at most 
+	 *				CLOSEDLOOPMAXSLEW microsteps per control tick, so the motor never snaps. Only if the 
+	 *				following error exceeds CLOSEDLOOPSNAPLIMIT (lost steps), the ramp position is moved 
+	 *				to the encoder position. With all gains 0, the following error is only corrected on lost steps.
+	 *
+	 * @param[in]  	kv - velocity feedforward gain, seconds (lag in microsteps per microstep/s)
+	 * @param[in]  	ka - acceleration feedforward gain, seconds^2 (lag in microsteps per microstep/s^2)
+	 * @param[in]  	ki - integral gain of the trim, 1/s. Default is CLOSEDLOOPTRIMKI
+	 */
+	void setClosedLoopFeedforward(float kv, float ka, float ki = CLOSEDLOOPTRIMKI);
+
+	/**
+	 * @brief      	Latch the driver position in hardware when the encoder is sampled
+	 *
+	 *				The strobe pin is set HIGH in the same instant the encoder is selected, and LOW 
+	 *				again when the encoder has been read. The pin must be wired to the REFL (or REFR) 
+	 *				input of the TMC5130, which copies XACTUAL to XLATCH on the rising edge. The 
+	 *				closed loop then compares encoder and driver positions taken at the same instant, 
+	 *				instead of positions taken several SPI transactions apart, so the following error 
+	 *				at speed is the true lag of the rotor. Costs one extra SPI frame per control tick.
+	 *
+	 * @param[in]  	strobePin - Arduino pin number wired to the reference switch input
+	 * @param[in]  	rightInput - 0 = strobe is wired to REFL, 1 = strobe is wired to REFR
+	 *
+	 * @return 		1 = enabled, 0 = strobePin is not a valid pin
+	 */
+	bool enableSynchronizedCapture(uint8_t strobePin, bool rightInput = 0);
+
+	/**
+	 * @brief      	Stop latching the driver position. The strobe pin is left LOW
+	 */
+	void disableSynchronizedCapture(void);
+
+	/**
+	 * @brief      	Switch to encoder commutated direct coil current control
+	 *
+	 *				The ramp generator of the driver is stopped, and each control tick the coil currents 
+	 *				are computed from the electrical angle of the rotor, measured by the encoder, and a 
+	 *				torque command. The current is placed 90 electrical degrees from the rotor, so steps 
+	 *				can not be lost, and the current follows the load instead of always being the run 
+	 *				current. The relation between encoder and coils is found by aligning the rotor to two
+	 *				coil positions, which moves the shaft up to two full steps and takes 2*DIRECTALIGNTIME ms.
+	 *				After enabling, the current position is held with the controller (see setDirectTarget()).
+	 *				Not available in DROPIN mode.
+	 *
+	 * @return 		1 = enabled, 0 = alignment failed (motor did not move as expected) or DROPIN mode
+	 */
+	bool enableDirectCurrent(void);
+
+	/**
+	 * @brief      	Return to normal operation using the ramp generator of the driver
+	 *
+	 *				The driver position counter is set to the encoder position. Since the microstep 
+	 *				position of the driver is not updated in direct mode, the rotor may jump up to two 
+	 *				full steps when the ramp generator takes over.
+	 */
+	void disableDirectCurrent(void);
+
+	/**
+	 * @brief      	Set the torque command in direct current mode
+	 *
+	 *				Also stops holding the target position set by setDirectTarget().
+	 *
+	 * @param[in]  	torque - percent of the run current, -100.0 to 100.0. Positive torque increases the encoder angle
+	 */
+	void setTorque(float torque);
+
+	/**
+	 * @brief      	Hold a position in direct current mode
+	 *
+	 *				The torque is computed by the controller (see controller and setProportional(), 
+	 *				setIntegral() and setDifferential()) from the error between target and encoder 
+	 *				position in microsteps, with the output in percent of the run current.
+	 *
+	 * @param[in]  	angle - target position in degrees, relative to home
+	 */
+	void setDirectTarget(float angle);
+
 	/**
 	 * @brief      	Moves the motor to its physical limit, without limit switch
 	 *
@@ -659,9 +1193,72 @@ public:
 	 */
 	void invertDropinDir(bool invert);
 
+	/**
+	 * @brief      	Count DROPIN step pulses in hardware instead of in the INT0 interrupt
+	 *
+	 *				Timer4 is clocked by the falling edges on its external clock input T4 (PE1),
+	 *				so no interrupt is taken per step and step rates above 200k steps/s can be
+	 *				followed. The counter is read by the control interrupt, and a pin change
+	 *				interrupt on DIR books the steps counted so far in the old direction.
+	 *				Timer4 is also used by uStepperServo, so the two can not be used at the same
+	 *				time. Steps arriving during the DIR interrupt latency can be booked in the
+	 *				wrong direction, so the controller should respect the usual DIR to STEP
+	 *				setup time.
+	 *
+	 *				Only built when the library is compiled with -DDROPINHARDWARESTEPCOUNTER=1, as
+	 *				the library then owns the PCINT0 vector. Otherwise this returns 0.
+	 *
+	 * @warning		The STEP signal must be wired to PE1 (T4) of the uStepper S, as well as or
+	 *				instead of the usual step input. The Timer3 clock input is shared with the
+	 *				SPI1 bus, so Timer4 is the only counter that can be used. With STEP on the
+	 *				usual input only, the counter sees no steps and the motor does not move.
+	 *
+	 * @return		1 if enabled, 0 if the uStepper is not in DROPIN mode or the counter is not built
+	 */
+	bool enableHardwareStepCounter(void);
+
+	/**
+	 * @brief      	Return to counting DROPIN step pulses in the INT0 interrupt
+	 */
+	void disableHardwareStepCounter(void);
+
+	/**
+	 * @brief      	Start checking the DROPIN step input for missed pulses
+	 *
+	 *				Step pulses are counted both by interrupt0 and by Timer4, clocked from T4 (PE1)
+	 *				in the same way as the hardware step counter, so STEP has to be wired to both D2
+	 *				and PE1. The control interrupt compares the two counts every tick. Can not be used
+	 *				together with the hardware step counter or uStepperServo.
+	 *
+	 * @return		1 if enabled, 0 if not in DROPIN mode or the hardware step counter is enabled
+	 */
+	bool enableStepInputCheck(void);
+
+	/**
+	 * @brief      	Stop checking the DROPIN step input
+	 */
+	void disableStepInputCheck(void);
+
+	/**
+	 * @brief      	Clear the counts and maximums of the step input check
+	 */
+	void resetStepInputCheck(void);
+
+	/**
+	 * @brief      	Get the result of the step input check
+	 *
+	 * @param[out]  result - counts, missed steps, highest step frequency without missed steps,
+	 *				largest edge backlog and longest interrupt0 service time
+	 */
+	void getStepInputCheck(stepInputCheck_t *result);
+
 	/**
 	 * @brief      	This method is used to tune Drop-in parameters.
 	 *				After tuning uStepper S, the parameters are saved in EEPROM
+	 *
+	 *				Call it from loop(). It reads the available input into a fixed buffer and
+	 *				returns without waiting. A command is only executed when the serial transmit
+	 *				buffer has room for its reply, so replies do not block either.
 	 *				
 	 * 				Usage:
 	 *				Set Proportional constant: 'P=10.002;'
@@ -679,10 +1276,10 @@ public:
 	/**
 	 * @brief      	This method is used for the dropinCli to take in user commands.
 	 *
-	 * @param[in]  	cmd - input from terminal for dropinCli
+	 * @param[in]  	cmd - input from terminal for dropinCli, without the terminating ';'
 	 *			
 	 */
-	void parseCommand(String *cmd);
+	void parseCommand(const char *cmd);
 	
 	/**
 	 * @brief      	This method is used to print the dropinCli menu explainer:
@@ -710,12 +1307,172 @@ public:
 	 */
 
 	void checkOrientation(float distance = 10);
+
+	/**
+	 * @brief      	Calibrate the nonlinearity of the encoder
+	 *
+	 *				The motor is stepped open loop through one revolution forward and back, stopping at 
+	 *				every full step. The difference between encoder angle and step position, caused by
+	 *				e.g. magnet eccentricity, is averaged into a table of ENCODERCALPOINTS points, which
+	 *				is stored in EEPROM, loaded at startup and applied each time the encoder is sampled.
+	 *				The motor must be free to rotate one revolution in both directions, and the load must 
+	 *				be light enough not to lose steps. Takes around 2 * fullSteps * (ENCODERCALSETTLE + 
+	 *				ENCODERCALSAMPLES) ms plus the moves. Not available in direct current mode.
+	 *
+	 * @return 		1 = calibration stored, 0 = calibration failed (motor did not follow the steps)
+	 */
+	bool calibrateEncoder(void);
+
+	/**
+	 * @brief      	Set the frequency of the control loop
+	 *
+	 *				This method changes the rate of the timer1 interrupt, which samples the encoder and 
+	 *				runs the DROPIN and closed loop controllers. The step input filter, the encoder speed
+	 *				filters and the integral and differential PID gains are rescaled, so the loop keeps its 
+	 *				time constants. A higher rate gives more bandwidth at the cost of more CPU time.
+	 *				Default is 1kHz in DROPIN and 2kHz in all other modes. A rate set before setup() is 
+	 *				kept by setup().
+	 *
+	 * @param[in]  	frequency - control loop frequency in Hz, between CONTROLFREQMIN and CONTROLFREQMAX
+	 *
+	 * @return 		the frequency actually used, after limiting
+	 */
+	uint16_t setControlFrequency(uint16_t frequency);
+
+	/**
+	 * @brief      	Get the frequency of the control loop
+	 *
+	 * @return 		control loop frequency in Hz
+	 */
+	uint16_t getControlFrequency(void);
+
+	/**
+	 * @brief      	Queue a transaction on the SPI1 bus without waiting for it
+	 *
+	 *				The transaction is appended to the queue of the interrupt driven SPI1 engine,
+	 *				and the function returns immediately. Completion is signalled by the "done"
+	 *				flag of the transaction, and by calling its callback (if any) from interrupt context.
+	 *
+	 * @param[in]  	transaction - transaction to queue. Must stay valid until completed
+	 *
+	 * @return 		1 = transaction queued, 0 = queue is full
+	 */
+	bool spiSubmit(spiTransaction_t *transaction);
+
+	/**
+	 * @brief      	Queue a transaction on the SPI1 bus, waiting for room in the queue if it is full
+	 *
+	 *				With interrupts disabled, e.g. in the control interrupt before it enables 
+	 *				interrupts, the queue is drained from here, as the SPI1 interrupt can not run.
+	 *
+	 * @param[in]  	transaction - transaction to queue. Must stay valid until completed
+	 */
+	void spiSubmitWait(spiTransaction_t *transaction);
+
+	/**
+	 * @brief      	Perform a transaction on the SPI1 bus and wait for it to complete
+	 *
+	 *				If the bus is idle, the transaction is clocked out directly, without the overhead
+	 *				of the SPI1 interrupt, and the control interrupt is masked meanwhile. Otherwise it
+	 *				is queued behind the transactions already in flight. May be called from loop(),
+	 *				with interrupts disabled, and from the control interrupt. It must not be called
+	 *				from other interrupt routines, as these can interrupt a transfer in progress.
+	 *
+	 * @param[in]  	transaction - transaction to perform
+	 */
+	void spiTransfer(spiTransaction_t *transaction);
+
+	/**
+	 * @brief      	Wait for a previously queued transaction to complete
+	 *
+	 * @param[in]  	transaction - transaction to wait for
+	 */
+	void spiWait(spiTransaction_t *transaction);
+
+	/**
+	 * @brief      	Check if the SPI1 engine has no transactions in flight
+	 *
+	 * @return 		1 = idle, 0 = transactions in flight
+	 */
+	bool spiIdle(void);
+
+	/**
+	 * @brief      	Enable execution time profiling of the control loop interrupt
+	 *
+	 *				While enabled, each phase of the timer1 interrupt is timed with TCNT1, and 
+	 *				statistics are collected, which can be read with getIsrProfile(). Profiling 
+	 *				adds a few microseconds to the interrupt. Overruns are counted even when 
+	 *				profiling is disabled.
+	 */
+	void enableIsrProfiler(void);
+
+	/**
+	 * @brief      	Disable execution time profiling of the control loop interrupt
+	 */
+	void disableIsrProfiler(void);
+
+	/**
+	 * @brief      	Clear all control loop interrupt timing statistics and the overrun counter
+	 */
+	void resetIsrProfiler(void);
+
+	/**
+	 * @brief      	Get execution time statistics of one phase of the control loop interrupt
+	 *
+	 * @param[in]  	phase - ISRPROFILELATENCY, ISRPROFILEENCODER, ISRPROFILEDRIVERREAD, ISRPROFILEFILTER,
+	 *				ISRPROFILEPID, ISRPROFILEWRITE or ISRPROFILETOTAL
+	 * @param[out] 	profile - statistics of the phase, in CPU cycles
+	 *
+	 * @return 		1 = statistics copied, 0 = invalid phase
+	 */
+	bool getIsrProfile(uint8_t phase, isrProfile_t *profile);
+
+	/**
+	 * @brief      	Get the mean execution time of one phase of the control loop interrupt
+	 *
+	 * @param[in]  	phase - see getIsrProfile()
+	 *
+	 * @return 		mean execution time in CPU cycles. 0 if the phase has not been measured
+	 */
+	uint16_t getIsrMean(uint8_t phase);
+
+	/**
+	 * @brief      	Get the number of control loop interrupts that did not finish within their period
+	 *
+	 *				An overrun is counted when the next compare match occurs before the interrupt
+	 *				routine has returned. The available budget per interrupt is 16000000/getControlFrequency() cycles.
+	 *
+	 * @return 		number of overruns since startup or last resetIsrProfiler()
+	 */
+	uint32_t getIsrOverruns(void);
 	
 private: 
 
+#if MOTORFULLSTEPS
+	/** Motor geometry and unit conversion factors, fixed at compile time */
+	static const uint16_t microSteps = 256;
+	static const uint16_t fullSteps = MOTORFULLSTEPS;
+	static constexpr float stepTime = 16777216.0/CLOCKFREQ;
+	static constexpr float rpmToVel = (MOTORFULLSTEPS * 256.0)/(60.0/(16777216.0/CLOCKFREQ));
+	static constexpr float velToRpm = (60.0/(16777216.0/CLOCKFREQ))/(MOTORFULLSTEPS * 256.0);
+	static constexpr float rpmToVelocity = (279620.267 * MOTORFULLSTEPS * 256.0)/(CLOCKFREQ);
+	static constexpr float angleToStep = MOTORFULLSTEPS * 256.0 / 360.0;
+	static constexpr float stepsPerSecondToRPM = 60.0/(256.0 * MOTORFULLSTEPS);
+	static constexpr float RPMToStepsPerSecond = (256.0 * MOTORFULLSTEPS)/60.0;
+#else
 	float stepTime;
 	float rpmToVel;
 	float velToRpm;
+	float rpmToVelocity;
+	float angleToStep;
+
+	uint16_t microSteps;
+	/** Set by setup(). The default keeps the gains computed before it finite */
+	uint16_t fullSteps = 200;
+
+	float stepsPerSecondToRPM;
+	float RPMToStepsPerSecond;
+#endif
 
 	/** This variable contains the maximum velocity in steps/s, the motor is
 	 * allowed to reach at any given point. The user of the library can
@@ -730,34 +1487,170 @@ private:
 	float maxAcceleration;
 	float maxDeceleration;
 	bool invertPidDropinDirection;
-	float rpmToVelocity;
-	float angleToStep;
-
-	uint16_t microSteps;
-	uint16_t fullSteps;
 	
 	uint16_t dropinStepSize;
 
+#if DROPINFASTSTEPISR
+	/** Static, so the naked step interrupt can address them directly */
+	static volatile int32_t stepCnt;
+	static volatile int32_t stepIncrement[2];
+	static volatile uint16_t stepEdgeTimer;
+	static volatile uint16_t stepCheckIsrEdges;
+#else
 	int32_t stepCnt;
+	/** Added to stepCnt per step pulse, indexed by the level of the DIR pin */
+	volatile int32_t stepIncrement[2] = {0, 0};
+	/** Timer3 count at the latest step edge, set by interrupt0. Timer3 runs free at CLOCKFREQ/8 in DROPIN */
+	volatile uint16_t stepEdgeTimer = 0;
+	/** Step edges counted by interrupt0 for the step input check */
+	volatile uint16_t stepCheckIsrEdges = 0;
+#endif
 
-	float stepsPerSecondToRPM;
-	float RPMToStepsPerSecond;
+	/**
+	 * @brief      	Precompute stepIncrement from dropinStepSize and invertPidDropinDirection
+	 */
+	void updateStepIncrement(void);
+
+	/** Set while DROPIN steps are counted by Timer4 */
+	volatile bool hardwareStepCounter = 0;
+	/** Timer4 count at the latest update of stepCnt */
+	uint16_t stepCounterLast = 0;
+	/** DIR pin level the steps counted since stepCounterLast were taken in */
+	bool stepCounterDirection = 0;
+
+	/**
+	 * @brief      	Add the steps counted by Timer4 since the last update to stepCnt. Must be called with interrupts disabled
+	 */
+	void stepCounterUpdate(void);
+
+	/** Step count and time of the edge the step rate was last measured to */
+	int32_t stepRateCnt = 0;
+	uint16_t stepRateTimer = 0;
+	bool stepRateValid = 0;
+	/** Step rate measured between step edges, Q24.8 in units of stepCnt/16 per second */
+	int32_t stepRate = 0;
+
+	/**
+	 * @brief      	Measure the DROPIN step rate from the step edge timestamps. Called by the control interrupt
+	 *
+	 *				The rate is the steps counted between the last edges of two control ticks, divided by
+	 *				the time between those edges. While no edges arrive, the rate is limited to one step
+	 *				over the time since the last edge.
+	 *
+	 * @param[in]  	steps - stepCnt sampled together with the edge timestamp
+	 * @param[in]  	timer - stepEdgeTimer sampled together with steps
+	 * @param[in]  	elapsed - Timer3 counts from the edge to now
+	 */
+	void stepRateUpdate(int32_t steps, uint16_t timer, uint16_t elapsed);
+
+	/** Set while the step input check is enabled */
+	volatile bool stepCheck = 0;
+	/** Set to clear the step input check result at the next control tick */
+	volatile bool stepCheckReset = 0;
+	/** Edges counted by Timer4 but never by interrupt0, so interrupt0 can tell its backlog */
+	volatile uint16_t stepCheckMissed = 0;
+	volatile uint16_t stepCheckMaxBacklog = 0;
+	volatile uint16_t stepCheckMaxServiceTime = 0;
+	/** Counts at the previous control tick */
+	uint16_t stepCheckLastTimer = 0;
+	uint16_t stepCheckLastIsr = 0;
+	stepInputCheck_t stepCheckResult = {0, 0, 0, 0, 0, 0};
+
+	/** Configure Timer4 to count falling edges on T4 (PE1). Must be called with interrupts disabled */
+	void startStepTimer(void);
+
+	/**
+	 * @brief      	Compare the step counts of Timer4 and interrupt0. Called by the control interrupt
+	 *
+	 * @param[in]  	timerEdges - TCNT4
+	 * @param[in]  	isrEdges - stepCheckIsrEdges
+	 * @param[in]  	pending - 1 if an INT0 interrupt was pending when the counts were read
+	 */
+	void stepCheckUpdate(uint16_t timerEdges, uint16_t isrEdges, bool pending);
 
 	volatile posFilter_t externalStepInputFilter;
 
+	/** Control loop (timer1 interrupt) frequency in Hz */
+	uint16_t controlFrequency = ENCODERINTFREQ*2;
+	/** Default control loop frequency of the mode given to setup(), in Hz */
+	uint16_t controlFrequencyBase = ENCODERINTFREQ*2;
+	/** Frequency last given to setControlFrequency(), 0 = default of the mode */
+	uint16_t controlFrequencyRequest = 0;
+	/** Encoder filter Beta chosen by setup() for controlFrequencyBase */
+	uint8_t encoderBetaBase = 5;
+	/** Control loop period in seconds */
+	float controlPeriod = ENCODERINTPERIOD*0.5;
+	/** I term of the step input filter, per control tick */
+	float pulseFilterKi;
+
+#if CONTROLFIXEDPOINT
+	volatile posFilterFixed_t externalStepInputFilterFixed;
+	/** Step input filter gains, Q8.24 per control tick */
+	int32_t pulseFilterKpFixed;
+	int32_t pulseFilterKiFixed;
+	/** Speed used to limit the proportional part of the PID, Q24.8 steps/s */
+	volatile int32_t currentPidSpeedFixed = 0;
+	/** Current PID error, Q16.16 steps */
+	volatile int32_t currentPidErrorFixed = 0;
+	/** Factor converting PID output in steps/s (Q24.8) to driver velocity, Q16.16 */
+	int32_t pidVelocityFactorFixed;
+	/** Closed loop control threshold in microsteps */
+	volatile int32_t controlThresholdFixed = 10;
+#endif
+
 	float currentPidSpeed;
 	/** This variable is used to indicate which mode the uStepper is
 	* running in (Normal, dropin or pid)*/
 	volatile uint8_t mode;	
-	float pTerm;	
-	/** This variable contains the integral coefficient used by the PID */
-	float iTerm;		
-
-	float dTerm;
 	bool brake;
 	volatile bool pidDisabled;
 	/** This variable sets the threshold for activating/deactivating closed loop position control - i.e. it is the allowed error in steps for the control**/
 	volatile float controlThreshold = 10;
+
+	/** Closed loop feedforward gains, as given to setClosedLoopFeedforward() */
+	float closedLoopKv = 0.0;
+	float closedLoopKa = 0.0;
+	float closedLoopKi = CLOSEDLOOPTRIMKI;
+	/** Lead per VACTUAL unit, Q16.16 microsteps */
+	int32_t closedLoopKvFixed = 0;
+	/** Lead per VACTUAL change per control tick, Q16.16 microsteps */
+	int32_t closedLoopKaFixed = 0;
+	/** Trim integral gain per control tick, Q16.16 */
+	int32_t closedLoopKiFixed = 0;
+	/** Filtered VACTUAL change per control tick, Q16.16 */
+	int32_t closedLoopAccel = 0;
+	int32_t closedLoopVOld = 0;
+	/** Integrated following error, Q16.16 microsteps */
+	int32_t closedLoopTrim = 0;
+
+	/** Minimum speed of the encoder stall detector in RPM, as given to enableEncoderStallDetect() */
+	float stallDetectMinimumRpm = STALLDETECTMINRPM;
+	/** Encoder counts per control tick per VACTUAL unit, Q16.16 */
+	int32_t stallSpeedGainFixed = 0;
+	/** encoder.encoderStallDetectEnable and encoder.encoderStallDetectSensitivity as last 
+	 * applied to the stall detector */
+	bool stallDetectLegacyEnabled = 0;
+	float stallDetectLegacySensitivity = 0.0;
+
+	/** Strobe pin wired to the reference switch input of the driver, or NULL when the 
+	 * driver position is not latched */
+	volatile uint8_t *latchPort = NULL;
+	uint8_t latchMask = 0;
+
+	/** Set while the coil currents are commutated from the encoder */
+	volatile bool directCurrent = 0;
+	/** Set while the torque is computed by the controller, to hold directTarget */
+	volatile bool directServo = 0;
+	/** Torque command, -DIRECTCURRENTMAX to DIRECTCURRENTMAX */
+	volatile int16_t directTorque = 0;
+	/** Position held in direct current mode, in microsteps */
+	volatile int32_t directTarget = 0;
+	/** Electrical angle (65536 = one electrical revolution) when the encoder reads 0 */
+	uint16_t directAngleOffset = 0;
+	/** 1 if the electrical angle increases with the encoder angle, -1 otherwise */
+	int8_t directDir = 1;
+	/** Number of electrical revolutions per mechanical revolution */
+	uint8_t directPolePairs = 50;
 	/** This variable holds information on wether the motor is stalled or not.
 	0 = OK, 1 = stalled */
 	volatile bool stall;
@@ -778,17 +1671,210 @@ private:
 	/** Flag to keep track of shaft direction setting */
 	volatile bool shaftDir = 0;
 
-	uint8_t SPI( uint8_t data );
+	/** Number of timer1 interrupts since startup. Used to timestamp captured data */
+	volatile uint32_t controlTicks = 0;
+
+	/** Execution time statistics of the timer1 interrupt, indexed by phase */
+	volatile isrProfile_t isrProfile[ISRPROFILEPHASES];
+	/** Number of timer1 interrupts that overran their period */
+	volatile uint32_t isrOverruns = 0;
+	volatile bool isrProfilerEnabled = 0;
+	/** Set while the current timer1 interrupt is being profiled */
+	volatile bool isrProfiling = 0;
+	/** Set while the timer1 interrupt routine is executing, to detect nested (overrunning) interrupts */
+	volatile bool isrActive = 0;
+	/** TCNT1 value at the start of the phase being timed */
+	uint16_t isrPhaseStart;
+
+	/** Queue of moves. The move at motionQueueHead is the next one to start */
+	motionSegment_t motionQueue[MOTIONQUEUESIZE];
+	volatile uint8_t motionQueueHead = 0;
+	volatile uint8_t motionQueueCount = 0;
+	/** Set while a move started from the queue is being executed */
+	volatile bool motionQueueBusy = 0;
+	/** Target of the last queued move */
+	int32_t motionQueueEnd = 0;
+
+	/**
+	 * @brief      	Add a move to the motion queue, with speeds in driver register units
+	 */
+	bool queueSegment( int32_t steps, float velocity, float acceleration, float deceleration, bool blend );
+
+	/**
+	 * @brief      	Start the next queued move when the current one completes. Called by the control interrupt
+	 *
+	 * @param[in]  	position - ramp position, microsteps
+	 * @param[in]  	velocity - VACTUAL
+	 */
+	void motionQueueService( int32_t position, int32_t velocity );
+
+	/** PVT points. The point at pvtHead ends the next segment */
+	pvtPoint_t pvtBuffer[PVTBUFFERSIZE];
+	volatile uint8_t pvtHead = 0;
+	volatile uint8_t pvtCount = 0;
+	/** Set while a PVT segment is being executed */
+	volatile bool pvtActive = 0;
+	/** Set by clearPvt(), so running out of points is not counted as an underrun */
+	volatile bool pvtCleared = 0;
+	volatile uint16_t pvtUnderruns = 0;
+	/** Segment being executed: start position and distance in microsteps, start and end slopes 
+	 *  (velocity times duration) in microsteps, duration and elapsed time in control ticks */
+	int32_t pvtStart = 0;
+	int32_t pvtDistance = 0;
+	int32_t pvtSlopeStart = 0;
+	int32_t pvtSlopeEnd = 0;
+	uint16_t pvtTicks = 0;
+	uint16_t pvtTick = 0;
+	/** Velocity at the end of the segment, microsteps per control tick, Q16.16 */
+	int32_t pvtVelocity = 0;
+	/** Reference position of the previous tick relative to pvtStart, microsteps, Q24.8 */
+	int32_t pvtReference = 0;
+	/** 2^24 / ICR1, Q16.16. Converts microsteps per control tick (Q24.8) to VACTUAL */
+	int32_t pvtVelocityGain = 0;
+
+	/**
+	 * @brief      	Load the next PVT segment and command the velocity of the next tick. Called by the control interrupt
+	 *
+	 * @param[in]  	position - ramp position, microsteps
+	 */
+	void pvtService( int32_t position );
+
+	/** Jerk limit as given to setMaxJerk(), steps/s^3 */
+	float maxJerk = 0.0;
+	/** Change of AMAX or DMAX per control tick at the jerk limit. 0 = no jerk limit */
+	volatile uint16_t jerkStep = 0;
+	/** Shaped acceleration and deceleration, AMAX units */
+	uint16_t jerkAccel = 0;
+	uint16_t jerkDecel = 0;
+	/** Set while a jerk limited deceleration towards jerkTarget is in progress */
+	bool jerkDecelerating = 0;
+	int32_t jerkTarget = 0;
+	/** Set while the velocity mode ramp accelerates in the positive direction */
+	bool jerkRising = 0;
+	/** 2^18 / ICR1, Q16.16. Scales jerk * speed change to compare with the square of the acceleration */
+	uint32_t jerkTaperGain = 0;
+	/** DMAX / (2 * jerkStep), Q16.16 control ticks, for the DMAX in jerkDecelDmax */
+	uint32_t jerkDecelTicks = 0;
+	uint16_t jerkDecelDmax = 0;
+
+	/**
+	 * @brief      	Shape the acceleration of the ramp generator. Called by the control interrupt
+	 *
+	 * @param[in]  	position - ramp position, microsteps
+	 * @param[in]  	velocity - VACTUAL
+	 */
+	void jerkUpdate( int32_t position, int32_t velocity );
+
+	/**
+	 * @brief      	Next value of a jerk limited acceleration
+	 *
+	 * @param[in]  	accel - current acceleration, AMAX units
+	 * @param[in]  	limit - maximum acceleration, AMAX units
+	 * @param[in]  	speedChange - speed change left until the acceleration must be 0, VACTUAL units
+	 */
+	uint16_t jerkShape( uint16_t accel, uint16_t limit, uint32_t speedChange );
+
+	/**
+	 * @brief      	Distance needed to stop the ramp, with the jerk limit if enabled, plus 
+	 *				MOTIONBLENDTICKS control ticks of travel
+	 *
+	 * @param[in]  	speed - VACTUAL, unsigned
+	 *
+	 * @return 		distance in microsteps
+	 */
+	uint32_t brakingDistance( uint32_t speed );
+
+	/**
+	 * @brief      	Constant deceleration needed to stop the ramp within a distance
+	 *
+	 * @param[in]  	speed - VACTUAL, unsigned
+	 * @param[in]  	distance - microsteps, > 0
+	 *
+	 * @return 		deceleration in DMAX units, rounded up
+	 */
+	uint32_t stopDeceleration( uint32_t speed, uint32_t distance );
+
+	/**
+	 * @brief      	Compute the jerk step from maxJerk and the control frequency
+	 */
+	void updateJerk( void );
+
+	/** Queue of SPI1 transactions. The transaction at spiQueueHead is the one in flight */
+	spiTransaction_t * volatile spiQueue[SPIQUEUESIZE];
+	volatile uint8_t spiQueueHead = 0;
+	volatile uint8_t spiQueueCount = 0;
+	/** Index of the byte currently being clocked in the transaction in flight */
+	volatile uint8_t spiByteIndex = 0;
+	/** Set while the SPI1 bus is in use, either by the engine or by a direct transfer */
+	volatile bool spiBusy = 0;
 
 	void setSPIMode( uint8_t mode );
 
+	void spiSelect( spiTransaction_t *transaction, bool state );
+
+	void spiStart( spiTransaction_t *transaction );
+
+	void spiService( void );
+
+	/**
+	 * @brief      	Service the SPI1 engine if a byte is done and the SPI1 interrupt can not run
+	 */
+	void spiPoll( void );
+
 	void chipSelect( uint8_t pin , bool state );
 
 	void filterSpeedPos(posFilter_t *filter, int32_t steps);
 
 	float pid(float error);
+
+	void updateControlGains(void);
+
+	void encoderStallDetectLegacy(void);
+
+	void closedLoopReset(void);
+
+	void closedLoopUpdate(int32_t stepsMoved, int32_t encoderSteps, uint16_t driverTime);
+
+	uint16_t directEncoderAngle(void);
+
+	uint16_t encoderCalibrationSample(void);
+
+	void directCurrentUpdate(void);
+
+	void isrProfileAdd(uint8_t phase, uint16_t cycles);
+
+	void isrProfileMark(uint8_t phase);
+
+#if CONTROLFIXEDPOINT
+	void filterSpeedPosFixed(volatile posFilterFixed_t *filter, int32_t steps);
+
+	void pidFixed(int32_t error);
+#endif
 	
 	dropinCliSettings_t dropinSettings;
+
+	/** Command being received by dropinCli */
+	char dropinCliBuffer[DROPINCLIBUFFERSIZE];
+	uint8_t dropinCliLength = 0;
+	/** Set when the command being received does not fit in the buffer */
+	bool dropinCliOverflow = 0;
+	/** millis() at the latest received character */
+	uint32_t dropinCliTime = 0;
+	/** Next line of the help text to print, or 0xFF when no help is being printed */
+	uint8_t dropinCliHelpLine = 0xFF;
+	/** Next parameter of the 'parameters;' reply to print, or 0xFF when it is not being printed */
+	uint8_t dropinCliParameter = 0xFF;
+
+	/**
+	 * @brief      	Parse a non-negative decimal number, e.g. '10.002', in place
+	 *
+	 * @param[in]  	text - number, terminated by '\0'
+	 * @param[out]  value - parsed number
+	 *
+	 * @return 		1 if the whole text is a number, 0 otherwise
+	 */
+	bool dropinParseNumber(const char *text, float *value);
+
 	bool loadDropinSettings(void);
 	void saveDropinSettings(void);
 	uint8_t dropinSettingsCalcChecksum(dropinCliSettings_t *settings);
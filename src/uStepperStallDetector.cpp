@@ -0,0 +1,225 @@
+/********************************************************************************************
+* 	 	File: 		uStepperStallDetector.cpp												*
+*		Version:    2.3.0                                          						    *
+*      	Date: 		December 27th, 2021  	                                    			*
+*      	Authors: 	Thomas Hørring Olsen                                   					*
+*					Emil Jacobsen															*
+*                                                   										*
+*********************************************************************************************
+*	(C) 2021																				*
+*																							*
+*	uStepper ApS																			*
+*	www.ustepper.com 																		*
+*	administration@ustepper.com 															*
+*																							*
+*	The code contained in this file is released under the following open source license:	*
+*																							*
+*			Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International			*
+* 																							*
+* 	The code in this file is provided without warranty of any kind - use at own risk!		*
+* 	neither uStepper ApS nor the author, can be held responsible for any damage				*
+* 	caused by the use of the code contained in this file ! 									*
+*                                                                                           *
+********************************************************************************************/
+/**
+* @file uStepperStallDetector.cpp
+*
+* @brief      Function implementations for the encoder stall detector
+*
+*             This file contains class and function implementations for the stall detector
+*             comparing the encoder speed with the driver speed.
+*
+* @author     Thomas Hørring Olsen (thomas@ustepper.com)
+*/
+#include <uStepperS.h>
+
+uStepperStallDetector::uStepperStallDetector(void)
+{
+
+}
+
+void uStepperStallDetector::configure(uint16_t threshold, uint16_t hysteresis, uint8_t window, int32_t minimumSpeed)
+{
+	uint8_t sreg = SREG;
+
+	if(hysteresis > threshold)
+	{
+		hysteresis = threshold;
+	}
+
+	if(window == 0)
+	{
+		window = 1;
+	}
+
+	cli();
+	this->threshold = threshold;
+	this->hysteresis = hysteresis;
+	this->window = window;
+	this->minimumSpeed = abs(minimumSpeed);
+	this->stalled = 0;
+	this->count = 0;
+	this->enabled = 1;
+	SREG = sreg;
+}
+
+void uStepperStallDetector::disable(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->enabled = 0;
+	this->stalled = 0;
+	this->count = 0;
+	SREG = sreg;
+}
+
+bool uStepperStallDetector::isEnabled(void)
+{
+	return this->enabled;
+}
+
+bool uStepperStallDetector::isStalled(void)
+{
+	return this->stalled;
+}
+
+void uStepperStallDetector::clear(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->stalled = 0;
+	this->count = 0;
+	SREG = sreg;
+}
+
+void uStepperStallDetector::setCallback(void (*callback)(bool stalled))
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->callback = callback;
+	SREG = sreg;
+}
+
+uint16_t uStepperStallDetector::getEventCount(void)
+{
+	uint16_t count;
+	uint8_t sreg = SREG;
+
+	cli();
+	count = this->eventCount;
+	SREG = sreg;
+
+	return count;
+}
+
+bool uStepperStallDetector::getEvent(uint8_t index, stallEvent_t *event)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	if(index >= STALLLOGSIZE || index >= this->eventCount)
+	{
+		SREG = sreg;
+		return 0;
+	}
+
+	*event = this->log[(uint8_t)(this->logIndex + STALLLOGSIZE - 1 - index) % STALLLOGSIZE];
+	SREG = sreg;
+
+	return 1;
+}
+
+void uStepperStallDetector::clearEvents(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	this->eventCount = 0;
+	this->logIndex = 0;
+	SREG = sreg;
+}
+
+bool uStepperStallDetector::update(int32_t commanded, int32_t measured, uint32_t tick)
+{
+	int32_t magnitude;
+	int32_t deviation;
+	int32_t limit;
+	stallEvent_t *event;
+
+	if(!this->enabled)
+	{
+		return 0;
+	}
+
+	magnitude = abs(commanded);
+
+	if(magnitude < this->minimumSpeed || magnitude == 0)
+	{
+		// Too slow to tell a stall from noise. A detected stall is kept
+		this->count = 0;
+		return this->stalled;
+	}
+
+	// Shortfall of the measured speed in the commanded direction. Running too fast, or the 
+	// wrong way, also counts as a deviation
+	deviation = (commanded > 0) ? commanded - measured : measured - commanded;
+	deviation = abs(deviation);
+
+	if(!this->stalled)
+	{
+		limit = fixMul(magnitude, this->threshold, 8);
+
+		if(deviation <= limit)
+		{
+			this->count = 0;
+			return 0;
+		}
+
+		if(++this->count < this->window)
+		{
+			return 0;
+		}
+
+		this->count = 0;
+		this->stalled = 1;
+
+		// The log has its own write index, as eventCount stops counting at 0xFFFF
+		event = &this->log[this->logIndex];
+		event->tick = tick;
+		event->commanded = commanded;
+		event->measured = measured;
+		this->logIndex = (this->logIndex + 1) % STALLLOGSIZE;
+		if(this->eventCount < 0xFFFF)
+		{
+			this->eventCount++;
+		}
+	}
+	else
+	{
+		limit = fixMul(magnitude, this->threshold - this->hysteresis, 8);
+
+		if(deviation >= limit)
+		{
+			this->count = 0;
+			return 1;
+		}
+
+		if(++this->count < this->window)
+		{
+			return 1;
+		}
+
+		this->count = 0;
+		this->stalled = 0;
+	}
+
+	if(this->callback)
+	{
+		this->callback(this->stalled);
+	}
+
+	return this->stalled;
+}
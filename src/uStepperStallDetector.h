@@ -0,0 +1,163 @@
+/********************************************************************************************
+* 	 	File: 		uStepperStallDetector.h												*
+*		Version:    2.3.0                                          						    *
+*      	Date: 		December 27th, 2021  	                                    			*
+*      	Authors: 	Thomas Hørring Olsen                                   					*
+*					Emil Jacobsen															*
+*                                                   										*
+*********************************************************************************************
+*	(C) 2021																				*
+*																							*
+*	uStepper ApS																			*
+*	www.ustepper.com 																		*
+*	administration@ustepper.com 															*
+*																							*
+*	The code contained in this file is released under the following open source license:	*
+*																							*
+*			Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International			*
+* 																							*
+* 	The code in this file is provided without warranty of any kind - use at own risk!		*
+* 	neither uStepper ApS nor the author, can be held responsible for any damage				*
+* 	caused by the use of the code contained in this file ! 									*
+*                                                                                           *
+********************************************************************************************/
+/**
+* @file uStepperStallDetector.h
+*
+* @brief      Function prototypes and definitions for the encoder stall detector
+*
+*             This file contains class and function prototypes for the stall detector
+*             comparing the encoder speed with the driver speed, as well as necessary constants.
+*
+* @author     Thomas Hørring Olsen (thomas@ustepper.com)
+*/
+#include <Arduino.h>
+
+#define STALLLOGSIZE 8	/**< Number of stall events kept in the event log */
+
+/**
+ * @brief	Stall event, as kept in the event log of uStepperStallDetector
+ */
+typedef struct
+{
+	uint32_t tick;			/**< Control tick when the stall was detected */
+	int32_t commanded;		/**< Commanded speed when the stall was detected */
+	int32_t measured;		/**< Measured speed when the stall was detected */
+}stallEvent_t;
+
+/**
+ * @brief      Prototype of class for the encoder stall detector
+ *
+ *             Each control tick the measured speed is compared with the commanded speed. A stall 
+ *             is detected when the measured speed deviates from the commanded speed by more than 
+ *             the threshold for window consecutive ticks, and cleared when the deviation is below 
+ *             threshold - hysteresis for window consecutive ticks. Below the minimum speed no 
+ *             decision is made. Speeds may be in any unit, as long as all are in the same unit. 
+ *             Only integer arithmetic is used, and no memory is allocated.
+ */
+class uStepperStallDetector
+{
+friend class uStepperS;
+	public:
+		/**
+		 * @brief	Constructor of uStepperStallDetector class
+		 */
+		uStepperStallDetector(void);
+
+		/**
+		 * @brief      	Configure and enable the detector. The stall state is cleared
+		 *
+		 * @param[in]  	threshold - allowed deviation of the measured speed, 1/256th of the commanded speed
+		 * @param[in]  	hysteresis - the deviation must drop this much below threshold to clear a stall, 1/256th of the commanded speed
+		 * @param[in]  	window - number of consecutive ticks needed to change the stall state, 1 - 255
+		 * @param[in]  	minimumSpeed - no decision is made while the commanded speed is below this
+		 */
+		void configure(uint16_t threshold, uint16_t hysteresis, uint8_t window, int32_t minimumSpeed);
+
+		/**
+		 * @brief      	Disable the detector. The stall state is cleared
+		 */
+		void disable(void);
+
+		/**
+		 * @brief      	Check if the detector is enabled
+		 *
+		 * @return 		1 = enabled, 0 = disabled
+		 */
+		bool isEnabled(void);
+
+		/**
+		 * @brief      	Check if a stall is detected
+		 *
+		 * @return 		1 = stalled, 0 = not stalled
+		 */
+		bool isStalled(void);
+
+		/**
+		 * @brief      	Clear the stall state, e.g. after the stall has been handled
+		 */
+		void clear(void);
+
+		/**
+		 * @brief      	Set a function to be called when the stall state changes
+		 *
+		 *				The function is called from interrupt context, and must return quickly.
+		 *
+		 * @param[in]  	callback - function called with 1 when a stall is detected and 0 when it is cleared. NULL = no function
+		 */
+		void setCallback(void (*callback)(bool stalled));
+
+		/**
+		 * @brief      	Get the number of stalls detected since the event log was cleared
+		 *
+		 *				Only the latest STALLLOGSIZE events are kept.
+		 *
+		 * @return 		number of stalls
+		 */
+		uint16_t getEventCount(void);
+
+		/**
+		 * @brief      	Get an event from the event log
+		 *
+		 * @param[in]  	index - 0 = latest event, 1 = the one before, etc.
+		 * @param[out] 	event - the event
+		 *
+		 * @return 		1 = event returned, 0 = no such event in the log
+		 */
+		bool getEvent(uint8_t index, stallEvent_t *event);
+
+		/**
+		 * @brief      	Clear the event log
+		 */
+		void clearEvents(void);
+
+		/**
+		 * @brief      	Run one update of the detector
+		 *
+		 * @param[in]  	commanded - commanded speed
+		 * @param[in]  	measured - measured speed
+		 * @param[in]  	tick - current control tick, stored in the event log
+		 *
+		 * @return 		1 = stalled, 0 = not stalled
+		 */
+		bool update(int32_t commanded, int32_t measured, uint32_t tick);
+
+	private:
+		volatile bool enabled = 0;
+		volatile bool stalled = 0;
+		uint16_t threshold = 0;
+		uint16_t hysteresis = 0;
+		uint8_t window = 1;
+		int32_t minimumSpeed = 0;
+
+		/** Number of consecutive ticks in favour of changing the stall state */
+		uint8_t count = 0;
+
+		void (*callback)(bool stalled) = NULL;
+
+		stallEvent_t log[STALLLOGSIZE];
+
+		/** Log slot to write the next event to */
+		uint8_t logIndex = 0;
+		volatile uint16_t eventCount = 0;
+};